@@ -235,6 +235,49 @@ unsigned long OS_Fifo_Get(void);
 //          zero or less than zero if a call to OS_Fifo_Get will spin or block
 long OS_Fifo_Size(void);
 
+#define OS_BLOCK_NUM  4      // number of sample blocks in the pool
+#define OS_BLOCK_SIZE 64     // number of 32-bit samples in each block
+
+// ******** OS_Block_Init ************
+// Return every block to the pool and empty the queue of filled blocks
+// Inputs:  none
+// Outputs: none
+void OS_Block_Init(void);
+
+// ******** OS_Block_Alloc ************
+// Take an empty block out of the pool, the caller owns it until it is sent or freed
+// Can be called from the background, never waits
+// Inputs:  none
+// Outputs: pointer to OS_BLOCK_SIZE words, 0 if the pool is exhausted
+long *OS_Block_Alloc(void);
+
+// ******** OS_Block_Free ************
+// Give a block back to the pool once its data has been consumed
+// Inputs:  block from OS_Block_Alloc or OS_Block_Recv
+// Outputs: none
+void OS_Block_Free(long *block);
+
+// ******** OS_Block_Send ************
+// Pass ownership of a filled block to the consumer, the data is not copied
+// Called from the background by the only producer, so no waiting
+// Inputs:  block from OS_Block_Alloc
+// Outputs: none
+void OS_Block_Send(long *block);
+
+// ******** OS_Block_Recv ************
+// Take ownership of the oldest filled block
+// Called in foreground by the only consumer, will block if none
+// Inputs:  none
+// Outputs: pointer to the block, must be given back with OS_Block_Free
+long *OS_Block_Recv(void);
+
+// ******** OS_Block_Exhausted ************
+// Number of times the pool ran dry since OS_Block_Init, failed calls to
+// OS_Block_Alloc before the next OS_Block_Free count once
+// Inputs:  none
+// Outputs: number of exhaustion events
+unsigned long OS_Block_Exhausted(void);
+
 // ******** OS_MailBox_Init ************
 // Initialize communication channel
 // Inputs:  none
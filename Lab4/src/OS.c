@@ -48,6 +48,7 @@ void OS_Init(void){
   LED_Init();
   Serial_Init();
   LCD_Init();
+  OS_Block_Init();
 
   os_timer_init();
 
@@ -526,6 +527,94 @@ long OS_Fifo_Size(void) {
 }
 
 
+static long blocks[OS_BLOCK_NUM][OS_BLOCK_SIZE];
+static long *freeBlocks[OS_BLOCK_NUM];     // stack of blocks owned by the pool
+static int freeNum;
+static long *fullBlocks[OS_BLOCK_NUM];     // queue of filled blocks, oldest first
+static volatile unsigned long fullPutI;    // only written by the producer
+static volatile unsigned long fullGetI;    // only written by the consumer
+static Sema4Type bk_FullNum;
+static unsigned long bk_Exhausted;
+static int bk_Dry;                         // an allocation failed and nothing was freed since
+
+// ******** OS_Block_Init ************
+// Return every block to the pool and empty the queue of filled blocks
+// Inputs:  none
+// Outputs: none
+void OS_Block_Init(void) {
+	unsigned long sr = StartCritical();
+	for (int i = 0; i < OS_BLOCK_NUM; i++) {
+		freeBlocks[i] = blocks[i];
+	}
+	freeNum = OS_BLOCK_NUM;
+	fullPutI = fullGetI = 0;
+	bk_Exhausted = 0;
+	bk_Dry = 0;
+	OS_InitSemaphore(&bk_FullNum, 0);
+	EndCritical(sr);
+}
+
+// ******** OS_Block_Alloc ************
+// Take an empty block out of the pool, the caller owns it until it is sent or freed
+// Can be called from the background, never waits
+// Inputs:  none
+// Outputs: pointer to OS_BLOCK_SIZE words, 0 if the pool is exhausted
+long *OS_Block_Alloc(void) {
+	long *block = 0;
+	unsigned long sr = StartCritical();
+	if (freeNum > 0) {
+		block = freeBlocks[--freeNum];
+	} else if (!bk_Dry) {
+		bk_Dry = 1;       // count the pool running dry, not every retry while it stays dry
+		bk_Exhausted++;
+	}
+	EndCritical(sr);
+	return block;
+}
+
+// ******** OS_Block_Free ************
+// Give a block back to the pool once its data has been consumed
+// Inputs:  block from OS_Block_Alloc or OS_Block_Recv
+// Outputs: none
+void OS_Block_Free(long *block) {
+	unsigned long sr = StartCritical();
+	freeBlocks[freeNum++] = block;
+	bk_Dry = 0;
+	EndCritical(sr);
+}
+
+// ******** OS_Block_Send ************
+// Pass ownership of a filled block to the consumer, the data is not copied
+// Called from the background by the only producer, so no waiting
+// Inputs:  block from OS_Block_Alloc
+// Outputs: none
+// The queue can hold every block in the pool, so it can never be full
+void OS_Block_Send(long *block) {
+	fullBlocks[fullPutI % OS_BLOCK_NUM] = block;
+	fullPutI++;
+	OS_Signal(&bk_FullNum);
+}
+
+// ******** OS_Block_Recv ************
+// Take ownership of the oldest filled block
+// Called in foreground by the only consumer, will block if none
+// Inputs:  none
+// Outputs: pointer to the block, must be given back with OS_Block_Free
+long *OS_Block_Recv(void) {
+	OS_Wait(&bk_FullNum);
+	long *block = fullBlocks[fullGetI % OS_BLOCK_NUM];
+	fullGetI++;
+	return block;
+}
+
+// ******** OS_Block_Exhausted ************
+// Number of times the pool ran dry since OS_Block_Init, failed calls to
+// OS_Block_Alloc before the next OS_Block_Free count once
+unsigned long OS_Block_Exhausted(void) {
+	return bk_Exhausted;
+}
+
+
 #define PERIODIC_NUM 2
 static void (*periodic_tasks[PERIODIC_NUM])(void);   // user function
 static int periodic_num = 0;
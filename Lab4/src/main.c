@@ -115,8 +115,7 @@ unsigned long FilterWork;   // number of digital filter calculations finished
 int Running;                // true while robot is running
 
 #define TIMESLICE 2*TIME_1MS  // thread switch time in system time units
-long x[64],y[64];           // input and output arrays for FFT
-Sema4Type doFFT;            // set every 64 samples by DAS
+long y[64];                 // output array for FFT, input comes from the block pool
 
 long median(long u1,long u2,long u3){
 long result;
@@ -143,6 +142,7 @@ long ADC2millimeter(long adcSample){
 }
 long Distance3;     // distance in mm on IR3
 uint32_t Index3;    // counts to 64 samples
+long *DASBlock;     // block being filled by DAS, owned by DAS until sent to DSP
 long x1,x2,x3;
 void DAS(void){
 long output;
@@ -150,29 +150,35 @@ long output;
   x3=x2; x2= x1;  // MACQ
   x1 = ADC_In();  // channel set when calling ADC_Init
   PD0 ^= 0x01;
-  if(Index3<64){
+  if(DASBlock == 0){
+    DASBlock = OS_Block_Alloc();  // DSP still owns every block, sample dropped
+  }
+  if(DASBlock){
     output = median(x1,x2,x3); // 3-wide median filter
     Distance3 = ADC2millimeter(output);
     FilterWork++;        // calculation finished
-    x[Index3] = Distance3;
+    DASBlock[Index3] = Distance3;
     Index3++;
-    if(Index3==64){
-      OS_Signal(&doFFT);
+    if(Index3==OS_BLOCK_SIZE){
+      OS_Block_Send(DASBlock);  // DSP transforms this block while DAS fills the next one
+      DASBlock = 0;
+      Index3 = 0;
     }
   }
   PD0 ^= 0x01;
 }
 void DSP(void){
 unsigned long DCcomponent;   // 12-bit raw ADC sample, 0 to 4095
-  OS_InitSemaphore(&doFFT,0);
+long *block;
   while(1) {
-    OS_Wait(&doFFT); // wait for 64 samples
+    block = OS_Block_Recv(); // wait for 64 samples
     PD2 = 0x04;
-    cr4_fft_64_stm32(y,x,64);  // complex FFT of last 64 ADC values
+    cr4_fft_64_stm32(y,block,64);  // complex FFT of last 64 ADC values
     PD2 = 0x00;
-    Index3 = 0; // take another buffer
+    OS_Block_Free(block); // take another buffer
     DCcomponent = y[0]&0xFFFF; // Real part at frequency 0, imaginary part should be zero
     ST7735_Message(1,0,"IR3 (mm) =",DCcomponent);
+    ST7735_Message(1,1,"Pool empty =",OS_Block_Exhausted());
   }
 }
 char Name[8]="robot0";
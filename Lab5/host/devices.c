@@ -0,0 +1,721 @@
+/*
+ * devices.c
+ * register models of UART0, SSI0, an SD card and the ST7735 LCD for the
+ * HOST_DEVICES build, and TestmainDevices, a file system and display run on
+ * the real drivers
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "OS.h"
+#include "tm4c123gh6pm.h"
+#include "Serial.h"
+#include "ST7735.h"
+#include "ff.h"
+#include "host.h"
+#include "devices.h"
+
+#define UART0_PAGE  0x4000C000UL
+#define SSI0_PAGE   0x40008000UL
+#define UART0_EXC   (16+5)
+
+// register offsets in the page
+#define UART_DR     0x000
+#define UART_FR     0x018
+#define UART_IBRD   0x024
+#define UART_FBRD   0x028
+#define UART_CTL    0x030
+#define UART_IFLS   0x034
+#define UART_IM     0x038
+#define UART_RIS    0x03C
+#define UART_MIS    0x040
+#define UART_ICR    0x044
+#define SSI_CR0     0x000
+#define SSI_DR      0x008
+#define SSI_SR      0x00C
+#define SSI_CPSR    0x010
+#define SSI_CC      0xFC8
+
+// bit-specific GPIO addresses the drivers use as chip selects
+#define SDC_CS      0x40005004UL   // PB0, 0x01
+#define TFT_CS      0x40004020UL   // PA3, 0x08
+#define TFT_DC      0x40004100UL   // PA6, 0x40 for data
+
+#define UARTREG(off) (*Host_Reg(UART0_PAGE + (off)))
+#define SSIREG(off)  (*Host_Reg(SSI0_PAGE + (off)))
+
+static DevicesStatsType stats;
+
+/*
+ * UART0
+ * 16-byte FIFOs, TX leaves at the baud rate set in IBRD/FBRD (at once on
+ * virtual time, where Serial_OutChar could otherwise spin forever), RX comes
+ * from stdin, a byte per byte time
+ */
+#define UART_FIFOSIZE 16
+#define UART_IDLEBITS 32          // receive time-out
+
+static const int uartLevels[] = {2, 4, 8, 12, 14};
+
+static struct {
+	uint8_t tx[UART_FIFOSIZE];
+	int txHead, txCount;
+	uint8_t rx[UART_FIFOSIZE];
+	int rxHead, rxCount;
+	uint32_t ris;
+	uint64_t txDone;              // end of the byte on the line
+	uint64_t rxNext;              // next look at stdin
+	uint64_t rxLast;              // arrival of the last byte
+	int rxOpen;                   // stdin not at end of file
+	int timeoutArmed;
+	int source;
+} uart;
+
+static uint32_t uartByteTime(void) {
+	uint32_t ibrd = UARTREG(UART_IBRD) & 0xFFFF;
+	uint32_t fbrd = UARTREG(UART_FBRD) & 0x3F;
+	if (ibrd == 0)
+		return 6944;                 // 115200 baud
+	return 160*ibrd + 160*fbrd/64;   // 10 bits of 16 clocks of the divisor
+}
+
+static int uartLevel(uint32_t field) {
+	return uartLevels[field < 5 ? field : 4];
+}
+
+static int uartOn(void) {
+	return (UARTREG(UART_CTL) & (UART_CTL_UARTEN|UART_CTL_TXE)) == (UART_CTL_UARTEN|UART_CTL_TXE);
+}
+
+static void uartSend(uint8_t c) {
+	ssize_t n = write(1, &c, 1);
+	(void)n;
+	stats.uartSent++;
+}
+
+// bring the FIFOs and raw interrupts up to date
+static void uartStep(uint64_t now) {
+	struct pollfd in = {0, POLLIN, 0};
+	uint8_t c;
+	while (uart.txCount && uart.txDone <= now) {
+		uartSend(uart.tx[uart.txHead]);
+		uart.txHead = (uart.txHead + 1) % UART_FIFOSIZE;
+		uart.txCount--;
+		if (uart.txCount == uartLevel(UARTREG(UART_IFLS) & UART_IFLS_TX_M))
+			uart.ris |= UART_RIS_TXRIS;  // the level was crossed
+		if (uart.txCount)
+			uart.txDone += uartByteTime();
+	}
+	if (uart.rxOpen && uart.rxNext <= now && uart.rxCount < UART_FIFOSIZE) {
+		uart.rxNext = now + uartByteTime();
+		if (poll(&in, 1, 0) == 1) {
+			if (read(0, &c, 1) != 1) {
+				uart.rxOpen = 0;
+			} else {
+				uart.rx[(uart.rxHead + uart.rxCount) % UART_FIFOSIZE] = c;
+				uart.rxCount++;
+				uart.rxLast = now;
+				uart.timeoutArmed = 1;
+				stats.uartReceived++;
+				if (uart.rxCount >= uartLevel((UARTREG(UART_IFLS) & UART_IFLS_RX_M) >> 3))
+					uart.ris |= UART_RIS_RXRIS;
+			}
+		}
+	}
+	if (uart.timeoutArmed && uart.rxCount &&
+			now >= uart.rxLast + uartByteTime()*UART_IDLEBITS/10) {
+		uart.ris |= UART_RIS_RTRIS;
+		uart.timeoutArmed = 0;
+	}
+}
+
+// raise the interrupt now, or at the next thing the model has to do
+static void uartUpdate(void) {
+	uint64_t now = Host_Cycles();
+	uint64_t next = HOST_NEVER;
+	if (uart.ris & UARTREG(UART_IM)) {
+		Host_Schedule(uart.source, now);
+		return;
+	}
+	if (uart.txCount && uart.txDone < next)
+		next = uart.txDone;
+	if (uart.rxOpen && uart.rxNext < next)
+		next = uart.rxNext;
+	if (uart.timeoutArmed && uart.rxCount)
+		next = uart.rxLast + uartByteTime()*UART_IDLEBITS/10 < next ?
+				uart.rxLast + uartByteTime()*UART_IDLEBITS/10 : next;
+	Host_Schedule(uart.source, next);
+}
+
+void UART0_Handler(void);
+static void uartIsr(void *arg) {
+	(void)arg;
+	uartStep(Host_Cycles());
+	if (uart.ris & UARTREG(UART_IM)) {
+		stats.uartInterrupts++;
+		UART0_Handler();
+		if (uart.ris & UARTREG(UART_IM)) {  // not acknowledged, try again later
+			Host_Schedule(uart.source, Host_Cycles() + uartByteTime());
+			return;
+		}
+	}
+	uartUpdate();
+}
+
+static void uartRead(uint32_t offset) {
+	uint32_t fr;
+	uartStep(Host_Cycles());
+	switch (offset) {
+	case UART_DR:
+		UARTREG(UART_DR) = 0;
+		if (uart.rxCount) {
+			UARTREG(UART_DR) = uart.rx[uart.rxHead];
+			uart.rxHead = (uart.rxHead + 1) % UART_FIFOSIZE;
+			uart.rxCount--;
+		}
+		break;
+	case UART_FR:
+		fr = 0;
+		if (uart.txCount == 0) fr |= UART_FR_TXFE;
+		if (uart.txCount == UART_FIFOSIZE) fr |= UART_FR_TXFF;
+		if (uart.txCount) fr |= UART_FR_BUSY;
+		if (uart.rxCount == 0) fr |= UART_FR_RXFE;
+		if (uart.rxCount == UART_FIFOSIZE) fr |= UART_FR_RXFF;
+		UARTREG(UART_FR) = fr;
+		break;
+	case UART_RIS:
+		UARTREG(UART_RIS) = uart.ris;
+		break;
+	case UART_MIS:
+		UARTREG(UART_MIS) = uart.ris & UARTREG(UART_IM);
+		break;
+	}
+	uartUpdate();
+}
+
+static void uartWrite(uint32_t offset, uint32_t value) {
+	uint64_t now = Host_Cycles();
+	switch (offset) {
+	case UART_DR:
+		if (Host_Virtual() && uartOn()) {
+			uartSend(value);
+		} else if (uart.txCount < UART_FIFOSIZE) {
+			if (uart.txCount == 0)
+				uart.txDone = now + uartByteTime();
+			uart.tx[(uart.txHead + uart.txCount) % UART_FIFOSIZE] = value;
+			uart.txCount++;
+		}
+		break;
+	case UART_ICR:
+		uart.ris &= ~value;
+		break;
+	case UART_CTL:
+		if (uartOn() && uart.txCount)
+			uart.txDone = now + uartByteTime();
+		break;
+	}
+	if (!uartOn())
+		uart.txDone = HOST_NEVER;
+	uartUpdate();
+}
+
+/*
+ * SD card in SPI mode, SDHC with block addressing, backed by an image file
+ * every exchanged byte first shifts out the head of the response queue
+ */
+#define SD_QUEUESIZE 1024
+#define SD_BLOCK     512
+
+enum {SD_COMMAND, SD_TOKEN, SD_DATA};
+
+static struct {
+	int fd;                        // -1 for an empty socket
+	uint32_t sectors;
+	uint8_t queue[SD_QUEUESIZE];
+	int head, count;
+	uint8_t cmd[6];
+	int cmdLen;
+	int app;                       // the last command was CMD55
+	int idle;
+	int state;
+	int multi;                     // CMD18 or CMD25 in progress
+	uint32_t sector;
+	uint8_t block[SD_BLOCK + 2];
+	int blockLen;
+} sd = {-1};
+
+static void sdQueue(const uint8_t *data, int len) {
+	for (int i = 0; i < len && sd.count < SD_QUEUESIZE; i++) {
+		sd.queue[(sd.head + sd.count) % SD_QUEUESIZE] = data[i];
+		sd.count++;
+	}
+}
+
+static void sdQueueByte(uint8_t b) {
+	sdQueue(&b, 1);
+}
+
+// data token, the sector and a dummy CRC
+static void sdQueueSector(void) {
+	uint8_t data[SD_BLOCK];
+	memset(data, 0, sizeof(data));
+	if (sd.sector < sd.sectors &&
+			pread(sd.fd, data, SD_BLOCK, (off_t)sd.sector * SD_BLOCK) == SD_BLOCK)
+		stats.sdReads++;
+	sdQueueByte(0xFF);
+	sdQueueByte(0xFE);
+	sdQueue(data, SD_BLOCK);
+	sdQueueByte(0xFF);
+	sdQueueByte(0xFF);
+	sd.sector++;
+}
+
+static void sdCommand(void) {
+	uint8_t index = sd.cmd[0] & 0x3F;
+	uint32_t arg = (sd.cmd[1] << 24) | (sd.cmd[2] << 16) | (sd.cmd[3] << 8) | sd.cmd[4];
+	uint8_t r1 = sd.idle ? 0x01 : 0x00;
+	int app = sd.app;
+	static const uint8_t r7[] = {0x00, 0x00, 0x01, 0xAA};
+	static const uint8_t ocr[] = {0xC0, 0xFF, 0x80, 0x00};   // powered up, CCS
+	static const uint8_t cid[16] = {0x03, 'S', 'D', 'H', 'O', 'S', 'T', ' ', 0x10,
+			0x00, 0x00, 0x00, 0x01, 0x01, 0x4A, 0x01};
+	uint8_t csd[16];
+	uint32_t csize = sd.sectors / 1024 - 1;
+
+	stats.sdCommands++;
+	sd.app = 0;
+	sd.count = 0;
+	sdQueueByte(0xFF);                     // Ncr
+	switch (app ? 0x80 | index : index) {
+	case 0:                                // GO_IDLE_STATE
+		sd.idle = 1;
+		sd.multi = 0;
+		sdQueueByte(0x01);
+		break;
+	case 8:                                // SEND_IF_COND
+		sdQueueByte(r1);
+		sdQueue(r7, sizeof(r7));
+		break;
+	case 55:                               // APP_CMD
+		sd.app = 1;
+		sdQueueByte(r1);
+		break;
+	case 0x80 | 41:                        // SD_SEND_OP_COND
+		sd.idle = 0;
+		sdQueueByte(0x00);
+		break;
+	case 58:                               // READ_OCR
+		sdQueueByte(r1);
+		sdQueue(ocr, sizeof(ocr));
+		break;
+	case 9:                                // SEND_CSD, version 2
+		memset(csd, 0, sizeof(csd));
+		csd[0] = 0x40;
+		csd[5] = 0x59;
+		csd[7] = (csize >> 16) & 0x3F;
+		csd[8] = csize >> 8;
+		csd[9] = csize;
+		csd[15] = 0x01;
+		sdQueueByte(r1);
+		sdQueueByte(0xFE);
+		sdQueue(csd, sizeof(csd));
+		sdQueueByte(0xFF);
+		sdQueueByte(0xFF);
+		break;
+	case 10:                               // SEND_CID
+		sdQueueByte(r1);
+		sdQueueByte(0xFE);
+		sdQueue(cid, sizeof(cid));
+		sdQueueByte(0xFF);
+		sdQueueByte(0xFF);
+		break;
+	case 12:                               // STOP_TRANSMISSION
+		sd.multi = 0;
+		sd.count = 0;
+		sdQueueByte(0xFF);                 // stuff byte
+		sdQueueByte(0x00);
+		break;
+	case 16:                               // SET_BLOCKLEN
+	case 23:                               // SET_BLOCK_COUNT
+	case 0x80 | 23:                        // SET_WR_BLK_ERASE_COUNT
+	case 32:                               // ERASE_WR_BLK_START
+	case 33:                               // ERASE_WR_BLK_END
+	case 38:                               // ERASE
+		sdQueueByte(0x00);
+		break;
+	case 17:                               // READ_SINGLE_BLOCK
+	case 18:                               // READ_MULTIPLE_BLOCK
+		sdQueueByte(arg < sd.sectors ? 0x00 : 0x40);
+		if (arg < sd.sectors) {
+			sd.sector = arg;
+			sd.multi = (index == 18);
+			sdQueueSector();
+		}
+		break;
+	case 24:                               // WRITE_BLOCK
+	case 25:                               // WRITE_MULTIPLE_BLOCK
+		sdQueueByte(arg < sd.sectors ? 0x00 : 0x40);
+		if (arg < sd.sectors) {
+			sd.sector = arg;
+			sd.multi = (index == 25);
+			sd.state = SD_TOKEN;
+		}
+		break;
+	default:                               // illegal command
+		sdQueueByte(r1 | 0x04);
+		break;
+	}
+}
+
+static void sdReceive(uint8_t in) {
+	switch (sd.state) {
+	case SD_COMMAND:
+		if (sd.cmdLen == 0 && (in & 0xC0) != 0x40)
+			return;                        // not a start bit
+		sd.cmd[sd.cmdLen++] = in;
+		if (sd.cmdLen == sizeof(sd.cmd)) {
+			sd.cmdLen = 0;
+			sdCommand();
+		}
+		break;
+	case SD_TOKEN:
+		if (in == 0xFE || (sd.multi && in == 0xFC)) {
+			sd.state = SD_DATA;
+			sd.blockLen = 0;
+		} else if (sd.multi && in == 0xFD) {   // stop tran
+			sd.state = SD_COMMAND;
+			sd.multi = 0;
+		} else if (in != 0xFF) {
+			sd.state = SD_COMMAND;             // a command instead, start over
+			sdReceive(in);
+		}
+		break;
+	case SD_DATA:
+		sd.block[sd.blockLen++] = in;
+		if (sd.blockLen == sizeof(sd.block)) {
+			if (sd.sector < sd.sectors &&
+					pwrite(sd.fd, sd.block, SD_BLOCK, (off_t)sd.sector * SD_BLOCK) == SD_BLOCK)
+				stats.sdWrites++;
+			sd.sector++;
+			sdQueueByte(0x05);             // data accepted
+			sd.state = sd.multi ? SD_TOKEN : SD_COMMAND;
+		}
+		break;
+	}
+}
+
+static uint8_t sdExchange(uint8_t in) {
+	uint8_t out = 0xFF;
+	if (sd.fd < 0)
+		return out;                        // nobody drives MISO
+	if (sd.count) {
+		out = sd.queue[sd.head];
+		sd.head = (sd.head + 1) % SD_QUEUESIZE;
+		sd.count--;
+	} else if (sd.multi && sd.state == SD_COMMAND) {
+		sdQueueSector();                   // CMD18 goes on until CMD12
+	}
+	sdReceive(in);
+	return out;
+}
+
+/*
+ * ST7735, 128x160 RGB565, with the commands the driver draws with
+ * the image is kept the way rotation 0 shows it, MX and MY mirror it
+ * against that and MV turns it
+ */
+#define LCD_WIDTH    128
+#define LCD_HEIGHT   160
+#define LCD_CASET    0x2A
+#define LCD_RASET    0x2B
+#define LCD_RAMWR    0x2C
+#define LCD_MADCTL   0x36
+#define LCD_MX       0x40
+#define LCD_MY       0x80
+#define LCD_MV       0x20
+#define LCD_BGR      0x08
+
+static struct {
+	uint16_t pixels[LCD_HEIGHT][LCD_WIDTH];
+	uint8_t command;
+	uint8_t args[4];
+	int argc;
+	uint8_t madctl;
+	int x0, x1, y0, y1;           // window
+	int x, y;
+	int high;                     // first byte of a pixel
+	const char *file;
+} lcd = {.madctl = LCD_MX | LCD_MY};
+
+static void lcdPixel(uint16_t color) {
+	int w = (lcd.madctl & LCD_MV) ? LCD_HEIGHT : LCD_WIDTH;
+	int h = (lcd.madctl & LCD_MV) ? LCD_WIDTH : LCD_HEIGHT;
+	int c = lcd.x, r = lcd.y;
+	if (c < w && r < h) {
+		if (!(lcd.madctl & LCD_MX)) c = w - 1 - c;
+		if (!(lcd.madctl & LCD_MY)) r = h - 1 - r;
+		if (lcd.madctl & LCD_MV) {
+			int t = c; c = r; r = t;
+		}
+		lcd.pixels[r][c] = color;
+		stats.lcdPixels++;
+	}
+	if (++lcd.x > lcd.x1) {
+		lcd.x = lcd.x0;
+		if (++lcd.y > lcd.y1)
+			lcd.y = lcd.y0;
+	}
+}
+
+static void lcdByte(uint8_t b, int data) {
+	if (!data) {
+		lcd.command = b;
+		lcd.argc = 0;
+		lcd.high = -1;
+		if (b == LCD_RAMWR) {
+			lcd.x = lcd.x0;
+			lcd.y = lcd.y0;
+		}
+		return;
+	}
+	switch (lcd.command) {
+	case LCD_CASET:
+	case LCD_RASET:
+		if (lcd.argc < 4)
+			lcd.args[lcd.argc++] = b;
+		if (lcd.argc == 4 && lcd.command == LCD_CASET) {
+			lcd.x0 = (lcd.args[0] << 8) | lcd.args[1];
+			lcd.x1 = (lcd.args[2] << 8) | lcd.args[3];
+		} else if (lcd.argc == 4) {
+			lcd.y0 = (lcd.args[0] << 8) | lcd.args[1];
+			lcd.y1 = (lcd.args[2] << 8) | lcd.args[3];
+		}
+		break;
+	case LCD_RAMWR:
+		if (lcd.high < 0) {
+			lcd.high = b;
+		} else {
+			lcdPixel((lcd.high << 8) | b);
+			lcd.high = -1;
+		}
+		break;
+	case LCD_MADCTL:
+		lcd.madctl = b;
+		break;
+	}
+}
+
+// binary PPM, the BGR bit decides which end of the RGB565 word is red
+static void lcdSave(void) {
+	FILE *f;
+	if (!lcd.file || !(f = fopen(lcd.file, "wb")))
+		return;
+	fprintf(f, "P6\n%d %d\n255\n", LCD_WIDTH, LCD_HEIGHT);
+	for (int r = 0; r < LCD_HEIGHT; r++) {
+		for (int c = 0; c < LCD_WIDTH; c++) {
+			uint16_t p = lcd.pixels[r][c];
+			uint8_t hi = (p >> 11) << 3, g = ((p >> 5) & 0x3F) << 2, lo = (p & 0x1F) << 3;
+			uint8_t rgb[3] = {hi, g, lo};
+			if (lcd.madctl & LCD_BGR) {
+				rgb[0] = lo;
+				rgb[2] = hi;
+			}
+			fwrite(rgb, 1, 3, f);
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * SSI0
+ * a frame is exchanged as soon as DR is written, so the TX FIFO is always
+ * empty and never busy, the time it takes on the bus is charged instead
+ */
+#define SSI_FIFOSIZE 8
+
+static struct {
+	uint8_t rx[SSI_FIFOSIZE];
+	int rxHead, rxCount;
+} ssi;
+
+static uint32_t ssiFrameTime(void) {
+	uint32_t cpsdvsr = SSIREG(SSI_CPSR) & 0xFF;
+	uint32_t scr = (SSIREG(SSI_CR0) >> SSI_CR0_SCR_S) & 0xFF;
+	uint32_t div = (SSIREG(SSI_CC) & 0xF) == SSI_CC_CS_PIOSC ? 5 : 1;   // 16 MHz PIOSC
+	if (cpsdvsr < 2)
+		cpsdvsr = 2;
+	return 8 * div * cpsdvsr * (1 + scr);
+}
+
+static void ssiRead(uint32_t offset) {
+	uint32_t sr = SSI_SR_TFE | SSI_SR_TNF;
+	switch (offset) {
+	case SSI_SR:
+		if (ssi.rxCount) sr |= SSI_SR_RNE;
+		if (ssi.rxCount == SSI_FIFOSIZE) sr |= SSI_SR_RFF;
+		SSIREG(SSI_SR) = sr;
+		break;
+	case SSI_DR:
+		SSIREG(SSI_DR) = 0;
+		if (ssi.rxCount) {
+			SSIREG(SSI_DR) = ssi.rx[ssi.rxHead];
+			ssi.rxHead = (ssi.rxHead + 1) % SSI_FIFOSIZE;
+			ssi.rxCount--;
+		}
+		break;
+	}
+}
+
+static void ssiWrite(uint32_t offset, uint32_t value) {
+	uint8_t in = 0xFF;
+	uint32_t time;
+	if (offset != SSI_DR)
+		return;
+	if ((*Host_Reg(SDC_CS) & 0x01) == 0)
+		in = sdExchange(value);
+	if ((*Host_Reg(TFT_CS) & 0x08) == 0)
+		lcdByte(value, *Host_Reg(TFT_DC) & 0x40);
+	if (ssi.rxCount < SSI_FIFOSIZE) {
+		ssi.rx[(ssi.rxHead + ssi.rxCount) % SSI_FIFOSIZE] = in;
+		ssi.rxCount++;
+	}
+	time = ssiFrameTime();
+	stats.ssiBytes++;
+	stats.ssiCycles += time;
+	Host_Advance(time);
+}
+
+// what is still in the TX FIFO goes out, the LCD is saved
+static void devicesStop(void) {
+	while (uart.txCount) {
+		uartSend(uart.tx[uart.txHead]);
+		uart.txHead = (uart.txHead + 1) % UART_FIFOSIZE;
+		uart.txCount--;
+	}
+	lcdSave();
+}
+
+int Devices_Init(const char *image, const char *lcdFile) {
+	struct stat st;
+	SYSCTL_PRGPIO_R = 0x3F;           // every clock the drivers wait for is ready
+	SYSCTL_PRSSI_R = 0x0F;
+	SYSCTL_PRTIMER_R = 0x3F;
+	SYSCTL_PRUART_R = 0xFF;
+	*Host_Reg(SDC_CS) = 0x01;        // pulled up
+	*Host_Reg(TFT_CS) = 0x08;
+	if (image) {
+		sd.fd = open(image, O_RDWR);
+		if (sd.fd < 0 || fstat(sd.fd, &st) < 0 || st.st_size < 1024*SD_BLOCK) {
+			perror(image);
+			return 0;
+		}
+		sd.sectors = (st.st_size / SD_BLOCK) & ~1023UL;   // whole CSD size units
+		sd.idle = 1;
+	}
+	lcd.file = lcdFile;
+	Host_OnStop(devicesStop);
+	uart.rxOpen = 1;
+	uart.txDone = HOST_NEVER;
+	uart.source = Host_AddSource(UART0_EXC, -1, uartIsr, 0);
+	if (uart.source < 0)
+		return 0;
+	return Host_AddDevice(UART0_PAGE, uartRead, uartWrite) &&
+			Host_AddDevice(SSI0_PAGE, ssiRead, ssiWrite);
+}
+
+const DevicesStatsType *Devices_Stats(void) {
+	return &stats;
+}
+
+//*******************Devices test**********
+// runs the real Serial.c, diskio.c, ff.c and ST7735.c on the models
+// mounts the card, makes a file system if there is none, lists the root,
+// writes a file and reads it back, timing each step with OS_Time
+// the disk driver waits on its 1 ms Timer5A counter without touching a
+// register, run it on the real clock (no -v)
+#define DEVFILE   "host.txt"
+#define DEVBLOCKS 16
+
+void WaitForInterrupt(void);
+static FATFS DevFs;
+static FIL DevFile;
+static uint8_t DevBuffer[SD_BLOCK];
+
+static void DevReport(const char *step, FRESULT res, unsigned long start) {
+	Serial_println("%s: result=%u time=%u us", (char *)step, res,
+			OS_TimeDifference(start, OS_Time()) / (TIME_1MS/1000));
+}
+
+static void DevFilesystem(void) {
+	DIR dir;
+	FILINFO info;
+	UINT n;
+	unsigned long start = OS_Time();
+	unsigned long errors = 0;
+	FRESULT res = f_mount(&DevFs, "", 1);
+	DevReport("mount", res, start);
+	if (res == FR_NO_FILESYSTEM) {
+		start = OS_Time();
+		res = f_mkfs("", 0, 0);
+		DevReport("mkfs", res, start);
+		if (res == FR_OK)
+			res = f_mount(&DevFs, "", 1);
+	}
+	if (res == FR_OK) {
+		start = OS_Time();
+		res = f_opendir(&dir, "/");
+		while (res == FR_OK && f_readdir(&dir, &info) == FR_OK && info.fname[0])
+			Serial_println("  %s %u", info.fname, info.fsize);
+		DevReport("list", res, start);
+		start = OS_Time();
+		res = f_open(&DevFile, DEVFILE, FA_WRITE | FA_CREATE_ALWAYS);
+		for (int b = 0; res == FR_OK && b < DEVBLOCKS; b++) {
+			memset(DevBuffer, 'a' + b, sizeof(DevBuffer));
+			res = f_write(&DevFile, DevBuffer, sizeof(DevBuffer), &n);
+		}
+		if (res == FR_OK)
+			res = f_close(&DevFile);
+		DevReport("write", res, start);
+		start = OS_Time();
+		res = f_open(&DevFile, DEVFILE, FA_READ);
+		for (int b = 0; res == FR_OK && b < DEVBLOCKS; b++) {
+			res = f_read(&DevFile, DevBuffer, sizeof(DevBuffer), &n);
+			for (UINT i = 0; i < n; i++)
+				errors += DevBuffer[i] != 'a' + b;
+			errors += sizeof(DevBuffer) - n;
+		}
+		if (res == FR_OK)
+			res = f_close(&DevFile);
+		DevReport("read", res, start);
+		Serial_println("read back errors=%u", errors);
+	}
+	ST7735_Message(0, 0, "fs result=", res);
+	ST7735_Message(0, 1, "errors=", errors);
+	ST7735_Message(1, 0, "sd reads=", Devices_Stats()->sdReads);
+	ST7735_Message(1, 1, "sd writes=", Devices_Stats()->sdWrites);
+	Serial_println("uart sent=%u received=%u interrupts=%u", stats.uartSent,
+			stats.uartReceived, stats.uartInterrupts);
+	Serial_println("ssi bytes=%u bus time=%u us", stats.ssiBytes,
+			(unsigned long)(stats.ssiCycles / (TIME_1MS/1000)));
+	Serial_println("sd commands=%u reads=%u writes=%u", stats.sdCommands,
+			stats.sdReads, stats.sdWrites);
+	Serial_println("lcd pixels=%u", stats.lcdPixels);
+	OS_Sleep(100);       // let the UART drain
+	Host_Stop();
+}
+static void DevIdle(void) {
+	while (1)
+		WaitForInterrupt();
+}
+int TestmainDevices(void) {   // TestmainDevices
+	OS_Init();           // initialize, disable interrupts
+	OS_AddProcess(&DevFilesystem, 0, 0, 128, 1);
+	OS_AddProcess(&DevIdle, 0, 0, 128, 7);
+	OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+	return 0;            // this never executes
+}
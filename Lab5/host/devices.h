@@ -0,0 +1,39 @@
+/*
+ * devices.h
+ * register models of UART0, SSI0 and what hangs off SSI0 on the board, an SD
+ * card and the ST7735 LCD, for the HOST_DEVICES build of the host port
+ * the drivers in Serial.c, diskio.c and ST7735.c run unchanged against them
+ */
+
+#ifndef __DEVICES_H
+#define __DEVICES_H
+
+#include <stdint.h>
+
+// device statistics
+typedef struct {
+	unsigned long uartSent;       // bytes out of the UART0 TX FIFO
+	unsigned long uartReceived;   // bytes into the RX FIFO from stdin
+	unsigned long uartInterrupts; // runs of UART0_Handler
+	unsigned long ssiBytes;       // SSI0 frames
+	uint64_t ssiCycles;           // bus time of those frames, in 12.5ns units
+	unsigned long sdCommands;
+	unsigned long sdReads;        // sectors
+	unsigned long sdWrites;       // sectors
+	unsigned long lcdPixels;      // pixels written with RAMWR
+} DevicesStatsType;
+
+//******** Devices_Init ***************
+// trap the UART0 and SSI0 pages, show every peripheral clock as ready and
+// the chip selects as high, call after Host_Init and before the test main
+// Inputs: SD card image, 512-byte sectors, 0 for an empty socket
+//         file the LCD is written to as a PPM when the program stops, 0 for none
+// Outputs: 1 if successful, 0 if the image cannot be opened or traps are unavailable
+int Devices_Init(const char *image, const char *lcdFile);
+
+//******** Devices_Stats ***************
+// Inputs: none
+// Outputs: statistics since Devices_Init
+const DevicesStatsType *Devices_Stats(void);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * heapbench.c
+ * TestmainHeap, latency distributions of Heap_Malloc and Heap_Free against
+ * the first-fit search heap.c used before, replaying the allocation pattern
+ * of the ELF loader: text and data segments, freed in the order killProcess
+ * frees them; the pcb and the Serial formatting buffer come from block pools
+ * and are left out
+ * times are host ns less the cost of reading the clock, only their ratio
+ * means anything
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "OS.h"
+#include "heap.h"
+#include "trace.h"
+#include "bench.h"
+#include "Serial.h"
+#include "host.h"
+#include "sim.h"
+
+#define HEAPSTEPS    200000
+#define HEAPPROCS    8            // loaded processes alive at most
+#define HEAPBINS     4096         // 1 ns bins, the last one takes the rest
+#define HEAPCHECK    1000         // steps between Heap_Test calls
+#define HEAPCALIBRATE 1000        // clock reads that calibrate heapClockCost
+
+static const SimDistType HeapText = {SIM_UNIFORM, 64, 512};
+static const SimDistType HeapData = {SIM_UNIFORM, 8, 128};
+static const SimDistType HeapCoin = {SIM_UNIFORM, 0, 99};
+static const SimDistType HeapSeed = {SIM_UNIFORM, 1, 0x7FFFFFFF};
+
+/*
+ * the first-fit Heap_Malloc/Heap_Free of heap.c before segregated fit,
+ * same boundary tags, same checks in free, same critical section and the same
+ * BENCH and TRACE calls as heap.c has now, on its own array
+ */
+static int32_t FirstFit[HEAP_SIZE_WORDS];
+#define FF_END (FirstFit + HEAP_SIZE_WORDS)
+
+static int32_t ffRoom(int32_t *block) {
+	return *block > 0 ? *block : -*block;
+}
+
+static void ffInit(void) {
+	FirstFit[0] = FirstFit[HEAP_SIZE_WORDS - 1] = -(int32_t)(HEAP_SIZE_WORDS - 2);
+}
+
+static void *ffMalloc(int32_t desiredBytes) {
+	BENCH_BEGIN(BENCH_MALLOC);
+	unsigned long sr = StartCritical();
+	int32_t words = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
+	int32_t *block = FirstFit, *found = 0;
+	while (words > 0 && block < FF_END) {
+		if (*block < 0 && words <= -*block) {
+			int32_t leftover = -*block - words - 2;
+			if (leftover > 0) {
+				block[0] = block[words + 1] = words;
+				block[words + 2] = block[words + 3 + leftover] = -leftover;
+			} else {
+				*block = block[ffRoom(block) + 1] = -*block;
+			}
+			found = block + 1;
+			break;
+		}
+		block += ffRoom(block) + 2;
+	}
+	EndCritical(sr);
+	BENCH_END(BENCH_MALLOC);
+	TRACE(TRACE_MALLOC, found == 0 ? 0 : (words > 255 ? 255 : words));
+	return found;
+}
+
+static int32_t ffFree(void *pointer) {
+	BENCH_BEGIN(BENCH_FREE);
+	unsigned long sr = StartCritical();
+	int32_t *block = (int32_t *)pointer - 1;
+	int32_t *next;
+	if (block < FirstFit || block >= FF_END || *block <= 0 ||
+			block + *block + 1 >= FF_END || block[*block + 1] != *block) {
+		EndCritical(sr);
+		BENCH_END(BENCH_FREE);
+		TRACE(TRACE_FREE, HEAP_ERROR_CORRUPTED_HEAP);
+		return HEAP_ERROR_CORRUPTED_HEAP;
+	}
+	*block = block[ffRoom(block) + 1] = -*block;
+	if (block > FirstFit && block[-1] < 0) {
+		int32_t *previous = block - ffRoom(block - 1) - 2;
+		int32_t room = ffRoom(previous) + ffRoom(block) + 2;
+		*previous = previous[room + 1] = -room;
+		block = previous;
+	}
+	next = block + ffRoom(block) + 2;
+	if (next < FF_END && *next < 0) {
+		int32_t room = ffRoom(block) + ffRoom(next) + 2;
+		*block = block[room + 1] = -room;
+	}
+	EndCritical(sr);
+	BENCH_END(BENCH_FREE);
+	TRACE(TRACE_FREE, HEAP_OK);
+	return HEAP_OK;
+}
+
+/*
+ * the replay
+ */
+typedef struct {
+	const char *name;
+	void (*init)(void);
+	void *(*malloc)(int32_t bytes);
+	int32_t (*free)(void *pointer);
+	int (*test)(void);                 // 0 if there is no check
+} HeapAllocatorType;
+
+typedef struct {
+	unsigned long count;
+	uint32_t max;
+	uint64_t total;
+	unsigned long bins[HEAPBINS];
+} HeapLatencyType;
+
+typedef struct {
+	HeapLatencyType malloc;
+	HeapLatencyType free;
+	unsigned long loads;
+	unsigned long failures;            // mallocs that returned 0
+	unsigned long errors;              // failed Heap_Test checks
+} HeapResultType;
+
+#define HEAPALLOCATORS 2
+static HeapResultType HeapResults[HEAPALLOCATORS];
+
+static uint32_t heapClockCost;        // ns of an empty heapNow pair
+
+static uint32_t heapNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+// the cheapest empty pair, so the bins hold the heap's own time
+static void heapCalibrate(void) {
+	heapClockCost = 0xFFFFFFFF;
+	for (int i = 0; i < HEAPCALIBRATE; i++) {
+		uint32_t start = heapNow();
+		uint32_t ns = heapNow() - start;
+		if (ns < heapClockCost)
+			heapClockCost = ns;
+	}
+}
+
+static void latencyAdd(HeapLatencyType *l, uint32_t ns) {
+	ns = ns > heapClockCost ? ns - heapClockCost : 0;
+	l->count++;
+	l->total += ns;
+	if (ns > l->max)
+		l->max = ns;
+	l->bins[ns < HEAPBINS ? ns : HEAPBINS - 1]++;
+}
+
+static uint32_t latencyPercentile(const HeapLatencyType *l, unsigned long perThousand) {
+	unsigned long want = (l->count * perThousand + 999) / 1000;
+	unsigned long seen = 0;
+	for (uint32_t i = 0; i < HEAPBINS; i++) {
+		seen += l->bins[i];
+		if (seen >= want && want)
+			return i;
+	}
+	return l->max;
+}
+
+static void *timedMalloc(const HeapAllocatorType *a, HeapResultType *r, int32_t bytes) {
+	uint32_t start = heapNow();
+	void *p = a->malloc(bytes);
+	latencyAdd(&r->malloc, heapNow() - start);
+	if (p == 0)
+		r->failures++;
+	return p;
+}
+
+static void timedFree(const HeapAllocatorType *a, HeapResultType *r, void *p) {
+	uint32_t start;
+	if (p == 0)
+		return;
+	start = heapNow();
+	a->free(p);
+	latencyAdd(&r->free, heapNow() - start);
+}
+
+static void heapReplay(const HeapAllocatorType *a, HeapResultType *r, uint32_t seed) {
+	void *text[HEAPPROCS] = {0}, *data[HEAPPROCS] = {0};
+	int alive[HEAPPROCS] = {0};
+
+	memset(r, 0, sizeof(*r));
+	Sim_Seed(seed);                   // the same requests for every allocator
+	a->init();
+	for (int step = 0; step < HEAPSTEPS; step++) {
+		int p = Sim_Sample(&HeapCoin) % HEAPPROCS;
+		if (!alive[p] && Sim_Sample(&HeapCoin) < 60) {
+			// LOADER_ALIGN_ALLOC for the segments
+			text[p] = timedMalloc(a, r, Sim_Sample(&HeapText));
+			data[p] = timedMalloc(a, r, Sim_Sample(&HeapData));
+			alive[p] = 1;
+			r->loads++;
+		} else if (alive[p]) {
+			// killProcess
+			timedFree(a, r, text[p]);
+			timedFree(a, r, data[p]);
+			alive[p] = 0;
+		}
+		if (a->test && step % HEAPCHECK == 0 && a->test() != HEAP_OK)
+			r->errors++;
+	}
+	for (int p = 0; p < HEAPPROCS; p++) {
+		if (alive[p]) {
+			timedFree(a, r, text[p]);
+			timedFree(a, r, data[p]);
+		}
+	}
+	if (a->test && a->test() != HEAP_OK)
+		r->errors++;
+}
+
+static void latencyReport(const char *name, const char *op, const HeapLatencyType *l) {
+	Serial_println("%s %s n=%u mean=%u p50=%u p90=%u p99=%u p999=%u max=%u ns",
+			(char *)name, (char *)op, l->count, l->count ? (uint32_t)(l->total / l->count) : 0,
+			latencyPercentile(l, 500), latencyPercentile(l, 900),
+			latencyPercentile(l, 990), latencyPercentile(l, 999), l->max);
+}
+
+static void heapInit(void) {
+	Heap_Init();
+}
+static int heapTest(void) {
+	Heap_Stats();                      // refresh the largest block, Heap_Test checks it
+	return Heap_Test();
+}
+
+static const HeapAllocatorType HeapAllocators[HEAPALLOCATORS] = {
+	{"firstfit", ffInit, ffMalloc, ffFree, 0},
+	{"tlsf",     heapInit, Heap_Malloc, Heap_Free, heapTest},
+};
+
+// the drivers print from a thread, so the replays run before OS_Launch
+static void HeapReport(void) {
+	Serial_println("heap %u bytes, %u steps, up to %u processes",
+			HEAP_SIZE_BYTES, HEAPSTEPS, HEAPPROCS);
+	for (int i = 0; i < HEAPALLOCATORS; i++) {
+		const HeapResultType *r = &HeapResults[i];
+		latencyReport(HeapAllocators[i].name, "malloc", &r->malloc);
+		latencyReport(HeapAllocators[i].name, "free", &r->free);
+		Serial_println("%s loads=%u failed mallocs=%u heap errors=%u",
+				(char *)HeapAllocators[i].name, r->loads, r->failures, r->errors);
+	}
+	Host_Stop();
+}
+void WaitForInterrupt(void);
+
+static void HeapIdle(void) {
+	while (1)
+		WaitForInterrupt();
+}
+int TestmainHeap(void) {   // TestmainHeap
+	uint32_t seed = Sim_Sample(&HeapSeed);   // follows -r
+	OS_Init();           // initialize, disable interrupts
+	heapCalibrate();
+	for (int i = 0; i < HEAPALLOCATORS; i++)
+		heapReplay(&HeapAllocators[i], &HeapResults[i], seed);
+	Heap_Init();         // a clean heap for the processes
+	OS_AddProcess(&HeapReport, 0, 0, 128, 0);
+	OS_AddProcess(&HeapIdle, 0, 0, 128, 7);
+	OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+	return 0;            // this never executes
+}
@@ -0,0 +1,620 @@
+/*
+ * host.c
+ * POSIX host port of the kernel, replaces osasm.S and startup.c
+ * see host.h for the overall picture and the build command
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "OS.h"
+#include "tm4c123gh6pm.h"
+#include "host.h"
+
+void threadScheduler(void);
+void Timer0A_Handler(void);
+void Timer1A_Handler(void);
+void Timer2A_Handler(void);
+void Timer3A_Handler(void);
+#ifdef HOST_DEVICES
+void Timer5A_Handler(void);
+#endif
+
+// address ranges the register macros point into
+#define PERIPH_BASE 0x40000000UL   // GPIO, UART, SSI, ADC, timers, system control
+#define PERIPH_SIZE 0x00100000UL
+#define PPB_BASE    0xE0000000UL   // DWT, SysTick, NVIC, system control block
+#define PPB_SIZE    0x00100000UL
+
+#define NVIC_PRI_BYTE(irq) (*((volatile uint8_t *)(0xE000E400UL + (irq))))
+#define SYSTICK_PENDSTSET  (1u << 26)
+
+typedef struct {
+	ucontext_t uc;
+	void (*task)(void);
+} hostContext;
+
+typedef struct {
+	int exception;
+	int priority;
+	void (*handler)(void *arg);
+	void *arg;
+	uint64_t next;                         // HOST_NEVER while idle
+} hostSource;
+
+typedef struct {
+	volatile uint32_t *ctl, *imr, *ris, *tailr, *tar;
+	int irq;
+	void (*handler)(void);
+} hostTimer;
+
+// Timer4A (profiler) is not driven on the host, Timer5A (disk) only with the devices
+static const hostTimer timers[] = {
+	{&TIMER0_CTL_R, &TIMER0_IMR_R, &TIMER0_RIS_R, &TIMER0_TAILR_R, &TIMER0_TAR_R, 19, Timer0A_Handler},
+	{&TIMER1_CTL_R, &TIMER1_IMR_R, &TIMER1_RIS_R, &TIMER1_TAILR_R, &TIMER1_TAR_R, 21, Timer1A_Handler},
+	{&TIMER2_CTL_R, &TIMER2_IMR_R, &TIMER2_RIS_R, &TIMER2_TAILR_R, &TIMER2_TAR_R, 23, Timer2A_Handler},
+	{&TIMER3_CTL_R, &TIMER3_IMR_R, &TIMER3_RIS_R, &TIMER3_TAILR_R, &TIMER3_TAR_R, 35, Timer3A_Handler},
+#ifdef HOST_DEVICES
+	{&TIMER5_CTL_R, &TIMER5_IMR_R, &TIMER5_RIS_R, &TIMER5_TAILR_R, &TIMER5_TAR_R, 92, Timer5A_Handler},
+#endif
+};
+#define NUMTIMERS (sizeof(timers)/sizeof(timers[0]))
+
+static hostContext contexts[NUMTHREADS];
+static char stacks[NUMTHREADS][HOST_STACKSIZE] __attribute__((aligned(16)));
+
+static struct timespec startTime;
+static unsigned long slowdown = 1;
+static uint64_t limit;                     // in cycles, 0 for none
+static int virtualTime;                    // time only moves in Host_Consume and WaitForInterrupt
+static uint64_t simNow;                    // the virtual clock
+
+static hostSource sources[HOST_MAXSOURCES];
+static int numSources;
+static uint32_t (*costs[HOST_EXCEPTIONS])(void *arg);
+static void *costArgs[HOST_EXCEPTIONS];
+
+static volatile sig_atomic_t primask = 1;  // reset leaves interrupts enabled, OS_Init disables them
+static volatile sig_atomic_t inHandler;
+static volatile sig_atomic_t pending;      // a tick arrived while it could not be delivered
+static volatile sig_atomic_t monitor;      // exclusive monitor of LDREX/STREX
+static volatile uint8_t ipsr;
+
+static void (*stopHook)(void);
+
+#ifdef HOST_DEVICES
+#if !defined(__x86_64__)
+#error "the register traps of HOST_DEVICES need an x86-64 host"
+#endif
+#define PAGE_SIZE 0x1000UL
+#define EFLAGS_TF 0x100                    // single step
+#define PF_WRITE  0x2                      // page fault error code: write access
+
+typedef struct {
+	unsigned long base;
+	void (*read)(uint32_t offset);
+	void (*write)(uint32_t offset, uint32_t value);
+} hostDevice;
+
+static hostDevice devices[HOST_MAXDEVICES];
+static int numDevices;
+static hostDevice *trapDevice;             // access being single stepped
+static uint32_t trapOffset;
+static int trapWrite;
+static int trapAlarmBlocked;
+#endif
+static volatile uint8_t *alias;            // untrapped view of the peripheral space
+
+static int timerOn[NUMTIMERS];
+static uint64_t timerNext[NUMTIMERS];      // cycle of the next timeout
+static int sysTickOn;
+static uint64_t sysTickNext;
+
+static void hostWrite(const char *s) {
+	size_t len = strlen(s);
+	while (len) {
+		ssize_t n = write(1, s, len);
+		if (n <= 0)
+			return;
+		s += n;
+		len -= n;
+	}
+}
+
+// the same memory twice: at the register addresses, where device pages get
+// trapped, and at a free address for the device models
+static void *mapFixed(unsigned long base, unsigned long size, int withAlias) {
+	int fd = memfd_create("tm4c", 0);
+	void *p = MAP_FAILED;
+	if (fd >= 0 && ftruncate(fd, size) == 0)
+		p = mmap((void *)base, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if (p == MAP_FAILED || p != (void *)base) {
+		perror("host: cannot map peripheral space");
+		exit(1);
+	}
+	if (withAlias) {
+		alias = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (alias == MAP_FAILED) {
+			perror("host: cannot map peripheral space");
+			exit(1);
+		}
+	}
+	close(fd);
+	return p;
+}
+
+void Host_Init(unsigned long limitMs, unsigned long slow) {
+	mapFixed(PERIPH_BASE, PERIPH_SIZE, 1);
+	mapFixed(PPB_BASE, PPB_SIZE, 0);
+	virtualTime = (slow == 0);
+	slowdown = slow ? slow : 1;
+	limit = (uint64_t)limitMs * (HOST_BUSHZ / 1000);
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+}
+
+uint64_t Host_Cycles(void) {
+	struct timespec now;
+	if (virtualTime)
+		return simNow;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ns = (uint64_t)(now.tv_sec - startTime.tv_sec) * 1000000000ULL
+			+ now.tv_nsec - startTime.tv_nsec;
+	return ns * (HOST_BUSHZ / 1000000) / 1000 / slowdown;
+}
+
+uint32_t Host_Time(void) {
+	if (virtualTime)
+		Host_Consume(HOST_READCOST);
+	return (uint32_t)Host_Cycles();
+}
+
+int Host_Virtual(void) {
+	return virtualTime;
+}
+
+uint8_t Host_IPSR(void) {
+	return ipsr;
+}
+
+/*
+ * Threads
+ */
+
+static void threadEntry(void) {
+	hostContext *ctx = (hostContext *)RunPt->sp;
+	// a new thread is entered from the scheduler, the handler ends here
+	inHandler = 0;
+	ipsr = 0;
+	monitor = 0;
+	ctx->task();
+	OS_Exit(0);
+}
+
+void Host_InitStack(int slot, int32_t **sp, void (*task)(void)) {
+	hostContext *ctx = &contexts[slot];
+	getcontext(&ctx->uc);
+	ctx->uc.uc_stack.ss_sp = stacks[slot];
+	ctx->uc.uc_stack.ss_size = HOST_STACKSIZE;
+	ctx->uc.uc_link = NULL;
+	sigemptyset(&ctx->uc.uc_sigmask);   // threads run with the tick unblocked
+	ctx->task = task;
+	makecontext(&ctx->uc, threadEntry, 0);
+	*sp = (int32_t *)ctx;
+}
+
+/*
+ * Interrupts
+ */
+
+// the same as the SysTick_Handler in osasm.S
+static void contextSwitch(void) {
+	tcbType *old = RunPt;
+	ipsr = 15;
+	threadScheduler();
+	ipsr = 0;
+	if (RunPt != old)
+		swapcontext(&((hostContext *)old->sp)->uc, &((hostContext *)RunPt->sp)->uc);
+}
+
+// NVIC_ENn_R is write-one-to-set, as memory each write undoes the last one,
+// so the NVIC enable is taken for granted
+static int timerArmed(int t) {
+	const hostTimer *tm = &timers[t];
+	return (*tm->ctl & TIMER_CTL_TAEN) && (*tm->imr & TIMER_IMR_TATOIM);
+}
+
+void Host_OnStop(void (*hook)(void)) {
+	stopHook = hook;
+}
+
+void Host_Stop(void) {
+	char msg[64];
+	if (stopHook)
+		stopHook();
+	snprintf(msg, sizeof(msg), "\r\nhost: stopped at %lu ms\r\n",
+			(unsigned long)(Host_Cycles() / (HOST_BUSHZ / 1000)));
+	hostWrite(msg);
+	_exit(0);
+}
+
+// arm newly enabled timers and bring the counters up to date
+static void updateTimers(uint64_t now) {
+	for (int t = 0; t < NUMTIMERS; t++) {
+		uint64_t period = (uint64_t)*timers[t].tailr + 1;
+		if (!timerArmed(t)) {
+			timerOn[t] = 0;
+			continue;
+		}
+		if (!timerOn[t]) {
+			timerOn[t] = 1;
+			timerNext[t] = now + period;
+		}
+		if (timerNext[t] > now)
+			*timers[t].tar = timerNext[t] - now - 1;
+	}
+	if ((NVIC_ST_CTRL_R & (NVIC_ST_CTRL_ENABLE | NVIC_ST_CTRL_INTEN)) ==
+			(NVIC_ST_CTRL_ENABLE | NVIC_ST_CTRL_INTEN)) {
+		uint64_t period = (uint64_t)(NVIC_ST_RELOAD_R & 0x00FFFFFF) + 1;
+		if (!sysTickOn) {
+			sysTickOn = 1;
+			sysTickNext = now + period;
+		}
+		if (sysTickNext > now)
+			NVIC_ST_CURRENT_R = sysTickNext - now - 1;
+	} else {
+		sysTickOn = 0;
+	}
+}
+
+// time of the next timeout or source event
+static uint64_t nextEvent(void) {
+	uint64_t next = HOST_NEVER;
+	updateTimers(Host_Cycles());
+	for (int t = 0; t < NUMTIMERS; t++) {
+		if (timerOn[t] && timerNext[t] < next)
+			next = timerNext[t];
+	}
+	for (int i = 0; i < numSources; i++) {
+		if (sources[i].next < next)
+			next = sources[i].next;
+	}
+	if (sysTickOn && ((NVIC_INT_CTRL_R & SYSTICK_PENDSTSET) || sysTickNext < next))
+		next = (NVIC_INT_CTRL_R & SYSTICK_PENDSTSET) ? Host_Cycles() : sysTickNext;
+	return next;
+}
+
+// execution time of a handler, the kernel code itself takes none
+static void charge(int exception) {
+	if (costs[exception])
+		Host_Consume(costs[exception](costArgs[exception]));
+}
+
+// runs with the tick blocked, as a handler: no nesting, no preemption
+static void dispatch(void) {
+	inHandler = 1;
+	monitor = 0;                        // exception entry clears the monitor
+
+	// every expired timer and source once, most urgent priority first
+	for (;;) {
+		uint64_t now = Host_Cycles();
+		int best = -1;
+		int bestPri = 8;
+		if (limit && now >= limit)
+			Host_Stop();
+		updateTimers(now);
+		for (int t = 0; t < NUMTIMERS; t++) {
+			int pri = NVIC_PRI_BYTE(timers[t].irq) >> 5;
+			if (timerOn[t] && timerNext[t] <= now && pri < bestPri) {
+				best = t;
+				bestPri = pri;
+			}
+		}
+		for (int i = 0; i < numSources; i++) {
+			int pri = sources[i].priority >= 0 ? sources[i].priority :
+					NVIC_PRI_BYTE(sources[i].exception - 16) >> 5;
+			if (sources[i].next <= now && pri < bestPri) {
+				best = NUMTIMERS + i;
+				bestPri = pri;
+			}
+		}
+		if (best < 0)
+			break;
+		if (best >= NUMTIMERS) {
+			hostSource *src = &sources[best - NUMTIMERS];
+			src->next = HOST_NEVER;         // the handler schedules the next event
+			ipsr = src->exception;
+			charge(src->exception);
+			src->handler(src->arg);
+			ipsr = 0;
+			continue;
+		}
+		uint64_t period = (uint64_t)*timers[best].tailr + 1;
+		uint64_t late = now - timerNext[best];
+		*timers[best].tar = late < period ? period - 1 - late : 0;
+		*timers[best].ris &= ~TIMER_RIS_TATORIS;
+		// timeouts missed meanwhile collapse into this one, like the RIS flag
+		do
+			timerNext[best] += period;
+		while (timerNext[best] <= now);
+		ipsr = 16 + timers[best].irq;
+		charge(16 + timers[best].irq);
+		timers[best].handler();
+		ipsr = 0;
+	}
+
+	// SysTick has the lowest priority, so it goes last
+	if (sysTickOn) {
+		uint64_t now = Host_Cycles();
+		uint64_t period = (uint64_t)(NVIC_ST_RELOAD_R & 0x00FFFFFF) + 1;
+		if ((NVIC_INT_CTRL_R & SYSTICK_PENDSTSET) || sysTickNext <= now) {
+			NVIC_INT_CTRL_R &= ~SYSTICK_PENDSTSET;
+			ipsr = 15;
+			charge(15);
+			ipsr = 0;
+			sysTickNext = Host_Cycles() + period;  // OS_Suspend also restarts the slice
+			NVIC_ST_CURRENT_R = period - 1;
+			contextSwitch();
+		}
+	}
+	monitor = 0;                        // and so does exception return
+	inHandler = 0;
+}
+
+static void tick(int sig) {
+	(void)sig;
+	pending = 1;
+	if (primask || inHandler)
+		return;
+	pending = 0;
+	dispatch();
+}
+
+// deliver a tick that was held back while interrupts were disabled
+static void poll(void) {
+	sigset_t block, old;
+	if (!pending || primask || inHandler)
+		return;
+	sigemptyset(&block);
+	sigaddset(&block, SIGALRM);
+	sigprocmask(SIG_BLOCK, &block, &old);
+	pending = 0;
+	dispatch();
+	sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void Host_Sync(void) {
+	pending = 1;
+	poll();
+}
+
+long Host_Ldrex(volatile long *addr) {
+	monitor = 1;
+	return *addr;
+}
+
+int Host_Strex(volatile long *addr, long val) {
+	unsigned long sr = StartCritical();
+	int fail = !monitor;
+	if (!fail)
+		*addr = val;
+	monitor = 0;
+	EndCritical(sr);
+	return fail;
+}
+
+void Host_Clrex(void) {
+	monitor = 0;
+}
+
+void Host_Consume(uint32_t cycles) {
+	uint64_t left = cycles;
+	if (!virtualTime) {
+		uint64_t start = Host_Cycles();
+		while (Host_Cycles() - start < left) {}
+		return;
+	}
+	for (;;) {
+		uint64_t next = nextEvent();
+		if (next > simNow + left || primask || inHandler) {
+			if (next <= simNow + left)
+				pending = 1;                  // taken when interrupts are enabled again
+			simNow += left;
+			return;
+		}
+		// interrupted part way, the rest runs when this thread is back
+		left -= next - simNow;
+		simNow = next;
+		dispatch();
+	}
+}
+
+int Host_AddSource(int exception, int priority, void (*handler)(void *arg), void *arg) {
+	if (numSources == HOST_MAXSOURCES || exception >= HOST_EXCEPTIONS)
+		return -1;
+	sources[numSources].exception = exception;
+	sources[numSources].priority = priority;
+	sources[numSources].handler = handler;
+	sources[numSources].arg = arg;
+	sources[numSources].next = HOST_NEVER;
+	return numSources++;
+}
+
+void Host_Schedule(int source, uint64_t when) {
+	sources[source].next = when;
+	if (when <= Host_Cycles())
+		pending = 1;                        // raised from outside a handler
+}
+
+void Host_Advance(uint32_t cycles) {
+	if (!virtualTime)
+		return;
+	simNow += cycles;
+	if (nextEvent() <= simNow)
+		pending = 1;
+}
+
+volatile uint32_t *Host_Reg(unsigned long addr) {
+	return (volatile uint32_t *)(alias + (addr - PERIPH_BASE));
+}
+
+#ifdef HOST_DEVICES
+/*
+ * Register traps
+ * A device page is PROT_NONE. An access faults, the read hook refreshes the
+ * register through the alias, the page is opened and the access single
+ * stepped with the trap flag. The trap closes the page again and hands a
+ * written value to the write hook. A read-modify-write is two accesses at
+ * -O0; an instruction that reads and writes memory at once is seen as a write.
+ */
+static hostDevice *findDevice(unsigned long page) {
+	for (int i = 0; i < numDevices; i++) {
+		if (devices[i].base == page)
+			return &devices[i];
+	}
+	return 0;
+}
+
+static void trapAccess(int sig, siginfo_t *info, void *context) {
+	ucontext_t *uc = context;
+	unsigned long addr = (unsigned long)info->si_addr;
+	hostDevice *dev = findDevice(addr & ~(PAGE_SIZE - 1));
+	if (!dev || trapDevice) {
+		signal(sig, SIG_DFL);               // a real fault, let it crash
+		return;
+	}
+	trapDevice = dev;
+	trapOffset = addr & (PAGE_SIZE - 1) & ~3UL;
+	trapWrite = (uc->uc_mcontext.gregs[REG_ERR] & PF_WRITE) != 0;
+	if (!trapWrite && dev->read)
+		dev->read(trapOffset);
+	mprotect((void *)dev->base, PAGE_SIZE, PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+	// no tick may run between the access and its trap
+	trapAlarmBlocked = sigismember(&uc->uc_sigmask, SIGALRM);
+	sigaddset(&uc->uc_sigmask, SIGALRM);
+}
+
+static void trapStep(int sig, siginfo_t *info, void *context) {
+	ucontext_t *uc = context;
+	hostDevice *dev = trapDevice;
+	(void)sig;
+	(void)info;
+	uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+	if (!dev)
+		return;
+	trapDevice = 0;
+	mprotect((void *)dev->base, PAGE_SIZE, PROT_NONE);
+	if (!trapAlarmBlocked)
+		sigdelset(&uc->uc_sigmask, SIGALRM);
+	if (trapWrite && dev->write)
+		dev->write(trapOffset, *Host_Reg(dev->base + trapOffset));
+}
+
+int Host_AddDevice(unsigned long base, void (*read)(uint32_t offset),
+		void (*write)(uint32_t offset, uint32_t value)) {
+	struct sigaction sa;
+	if (numDevices == HOST_MAXDEVICES || (base & (PAGE_SIZE - 1)))
+		return 0;
+	if (numDevices == 0) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = trapAccess;
+		sa.sa_flags = SA_SIGINFO;
+		sigemptyset(&sa.sa_mask);
+		sigaddset(&sa.sa_mask, SIGALRM);
+		sigaction(SIGSEGV, &sa, NULL);
+		sa.sa_sigaction = trapStep;
+		sigaction(SIGTRAP, &sa, NULL);
+	}
+	devices[numDevices].base = base;
+	devices[numDevices].read = read;
+	devices[numDevices].write = write;
+	numDevices++;
+	return mprotect((void *)base, PAGE_SIZE, PROT_NONE) == 0;
+}
+#endif
+
+void Host_SetCost(int exception, uint32_t (*cost)(void *arg), void *arg) {
+	if (exception < HOST_EXCEPTIONS) {
+		costs[exception] = cost;
+		costArgs[exception] = arg;
+	}
+}
+
+/*
+ * osasm.S and startup.c
+ */
+
+void OS_DisableInterrupts(void) {
+	primask = 1;
+}
+
+void OS_EnableInterrupts(void) {
+	primask = 0;
+	poll();
+}
+
+unsigned long StartCritical(void) {
+	unsigned long sr = primask;
+	primask = 1;
+	return sr;
+}
+
+void EndCritical(unsigned long sr) {
+	primask = sr;
+	if (!sr)
+		poll();
+}
+
+void WaitForInterrupt(void) {
+	sigset_t none;
+	if (virtualTime) {
+		uint64_t next = nextEvent();
+		if (next == HOST_NEVER) {
+			hostWrite("\r\nhost: nothing left to wait for");
+			Host_Stop();
+		}
+		if (next > simNow)
+			simNow = next;
+		if (!primask && !inHandler)
+			dispatch();
+		return;
+	}
+	if (pending) {
+		poll();
+		return;
+	}
+	sigemptyset(&none);
+	sigsuspend(&none);
+}
+
+void StartOS(void) {
+	struct sigaction sa;
+	struct itimerval it;
+	static ucontext_t reset;
+
+	if (virtualTime)
+		goto launch;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = tick;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, NULL);
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = HOST_TICKUS;
+	it.it_value = it.it_interval;
+	setitimer(ITIMER_REAL, &it, NULL);
+
+launch:
+	threadScheduler();
+	primask = 0;
+	swapcontext(&reset, &((hostContext *)RunPt->sp)->uc);
+	// main is never resumed
+}
@@ -0,0 +1,179 @@
+/*
+ * host.h
+ * POSIX host port of the kernel
+ *
+ * OS.c, FIFO.c, heap.c, trace.c, bench.c and the test mains in main.c are
+ * compiled unchanged for Linux with -DHOST. host.c stands in for osasm.S and
+ * startup.c:
+ *  - the TM4C peripheral and private peripheral address ranges are mapped as
+ *    ordinary memory, so the register macros of tm4c123gh6pm.h still work
+ *  - every thread is a ucontext coroutine with its own host stack, RunPt->sp
+ *    points to the saved context instead of a saved register frame
+ *  - a periodic SIGALRM plays the NVIC: it reads the timer and SysTick
+ *    registers the kernel programmed, advances them against a simulated
+ *    80 MHz clock and calls Timer0A..Timer3A_Handler and the scheduler
+ *  - PRIMASK is a flag, interrupts that arrive while it is set are held
+ *    pending and delivered by EndCritical/OS_EnableInterrupts
+ * Handlers run to completion one at a time in NVIC priority order, there is
+ * no nesting. Drivers (LCD, UART, SD card) are stubbed in stubs.c.
+ *
+ * With -DHOST_DEVICES the real Serial.c, ST7735.c, diskio.c and ff.c are built
+ * instead, against register models in devices.c. A modelled peripheral page
+ * is mapped PROT_NONE, every access to it faults into the model and is then
+ * single stepped (x86-64 only). The untrapped contents are reached through
+ * Host_Reg. Timer5A, the disk driver's 1 ms timer, is driven too.
+ *
+ * With virtual time (slowdown 0) there is no SIGALRM. The clock only moves
+ * when code calls Host_Consume to model its execution time, or when every
+ * thread waits in WaitForInterrupt and the clock jumps to the next event.
+ * The kernel itself takes no time except the handler costs set with
+ * Host_SetCost, so runs are deterministic and hours of scheduling take
+ * seconds. A thread that spins without calling Host_Consume or OS_Time
+ * stops the clock.
+ * sim.c builds models of tasks and interrupt sources on top of this.
+ *
+ * build, from Lab5:
+ *   gcc -DHOST -std=gnu99 -O0 -g -Iinc -I../lib -Ihost -Dmain=target_main \
+ *       src/OS.c src/FIFO.c src/heap.c src/blockpool.c src/trace.c src/bench.c src/main.c \
+ *       host/host.c host/stubs.c host/sim.c host/heapbench.c host/hostmain.c -lm -o oshost
+ * keep -O0, the test mains count in plain globals that an optimizer keeps in registers
+ * with the register models:
+ *   gcc -DHOST -DHOST_DEVICES -std=gnu99 -O0 -g -Iinc -I../lib -Ihost -Dmain=target_main \
+ *       src/OS.c src/FIFO.c src/heap.c src/blockpool.c src/trace.c src/bench.c src/main.c \
+ *       src/Serial.c src/ST7735.c src/diskio.c src/ff.c \
+ *       host/host.c host/stubs.c host/sim.c host/heapbench.c host/devices.c host/hostmain.c -lm -o oshost
+ * -O0 matters here as well, an instruction that reads and writes a register at
+ * once would reach the model as a write only
+ * run:
+ *   ./oshost [-t ms] [-s slowdown | -v] [-r seed] [-d image] [-l lcd.ppm] <testmain>
+ */
+
+#ifndef __HOST_H
+#define __HOST_H
+
+#include <stdint.h>
+
+#define HOST_BUSHZ      80000000   // simulated core clock, one OS_Time unit per cycle
+#define HOST_TICKUS     50         // host interrupt poll period, in us of real time
+#define HOST_STACKSIZE  (64*1024)  // bytes of host stack per thread
+#define HOST_MAXSOURCES 8          // modelled interrupt sources
+#define HOST_MAXDEVICES 8          // trapped peripheral pages
+#define HOST_EXCEPTIONS 160        // exception numbers, 16 + IRQ
+#define HOST_NEVER      UINT64_MAX
+#define HOST_READCOST   8          // cycles of one OS_Time on virtual time
+
+//******** Host_Init ***************
+// map the peripheral address space and start the simulated clock
+// Inputs: simulated time limit in ms, 0 for none
+//         slowdown, number of real seconds per simulated second
+//           0 runs on virtual time instead of the real clock
+// Outputs: none
+void Host_Init(unsigned long limitMs, unsigned long slowdown);
+
+//******** Host_InitStack ***************
+// build the initial context of a thread, replaces the fake register frame
+// Inputs: tcb slot number, address of its sp field, thread entry point
+// Outputs: none
+void Host_InitStack(int slot, int32_t **sp, void (*task)(void));
+
+//******** Host_Cycles ***************
+// simulated time since Host_Init
+// Inputs: none
+// Outputs: time in 12.5ns units
+uint64_t Host_Cycles(void);
+
+//******** Host_Time ***************
+// OS_Time on the host, wraps like the 32-bit target value
+// on virtual time every read takes HOST_READCOST, so polling loops move on
+// Inputs: none
+// Outputs: time in 12.5ns units
+uint32_t Host_Time(void);
+
+//******** Host_Virtual ***************
+// Inputs: none
+// Outputs: 1 on virtual time, 0 on the real clock
+int Host_Virtual(void);
+
+//******** Host_Stop ***************
+// print the simulated time and end the program
+// Inputs: none
+// Outputs: none (does not return)
+void Host_Stop(void);
+
+//******** Host_OnStop ***************
+// function run by Host_Stop before it prints, e.g. to save device state
+// Inputs: function, 0 for none
+// Outputs: none
+void Host_OnStop(void (*hook)(void));
+
+//******** Host_Consume ***************
+// model execution time of the caller, interrupts due meanwhile are taken
+// and may preempt a thread, which then finishes the rest later
+// on the real clock this busy-waits instead
+// Inputs: time in 12.5ns units
+// Outputs: none
+void Host_Consume(uint32_t cycles);
+
+//******** Host_AddSource ***************
+// add a modelled interrupt source with no kernel handler behind it
+// Inputs: exception number reported by Host_IPSR, 16 + IRQ
+//         NVIC priority, 0 is the highest, -1 to take it from the NVIC
+//           priority register of the IRQ, as a driver sets it
+//         function run as the handler and its argument
+// Outputs: source number, -1 if there are too many
+int Host_AddSource(int exception, int priority, void (*handler)(void *arg), void *arg);
+
+//******** Host_Schedule ***************
+// raise a source at the given time, a source fires once per call
+// a time already past is taken at the next chance, as for a pended IRQ
+// Inputs: source number, time in 12.5ns units, HOST_NEVER to cancel
+// Outputs: none
+void Host_Schedule(int source, uint64_t when);
+
+//******** Host_Advance ***************
+// time taken by a modelled device, e.g. the bits of an SSI transfer
+// on virtual time the clock moves as in Host_Consume, the real clock
+// needs no help since a trapped access takes longer than the bus anyway
+// Inputs: time in 12.5ns units
+// Outputs: none
+void Host_Advance(uint32_t cycles);
+
+//******** Host_Reg ***************
+// the untrapped view of a peripheral register, for the device models
+// Inputs: register address, 0x40000000 to 0x400FFFFF
+// Outputs: pointer to the register contents
+volatile uint32_t *Host_Reg(unsigned long addr);
+
+//******** Host_AddDevice ***************
+// trap every access to a 4 KB peripheral page (HOST_DEVICES only)
+// read runs before a load and may update the register through Host_Reg,
+// it must not take time; write runs after a store with the value stored and
+// may take time with Host_Advance; both run in a signal handler
+// Inputs: page address, read and write functions, either may be 0
+// Outputs: 1 if successful, 0 if there are too many or base is not a page
+int Host_AddDevice(unsigned long base, void (*read)(uint32_t offset),
+		void (*write)(uint32_t offset, uint32_t value));
+
+//******** Host_SetCost ***************
+// execution time charged at the start of every run of a handler
+// Inputs: exception number, 15 for the SysTick context switch
+//         function returning the time in 12.5ns units and its argument
+// Outputs: none
+void Host_SetCost(int exception, uint32_t (*cost)(void *arg), void *arg);
+
+//******** Host_Sync ***************
+// deliver pending interrupts now, including a SysTick pended by OS_Suspend
+// does nothing while interrupts are disabled or inside a handler
+// Inputs: none
+// Outputs: none
+void Host_Sync(void);
+
+// LDREX/STREX/CLREX, any interrupt in between clears the monitor
+long Host_Ldrex(volatile long *addr);
+int Host_Strex(volatile long *addr, long val);
+void Host_Clrex(void);
+
+// exception number of the handler being run, 0 in a thread
+uint8_t Host_IPSR(void);
+
+#endif
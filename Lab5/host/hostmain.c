@@ -0,0 +1,114 @@
+/*
+ * hostmain.c
+ * picks one of the test mains of main.c by name and runs it on the host port
+ * main.c is built with -Dmain=target_main, so its realmain is not in the way
+ */
+
+#undef main
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "host.h"
+#include "sim.h"
+#ifdef HOST_DEVICES
+#include "devices.h"
+#endif
+
+int TestmainFifo(void);
+int TestmainTopic(void);
+int TestmainRWLock(void);
+int TestmainSema(void);
+int TestmainJoin(void);
+int TestmainExit(void);
+int TestmainTT(void);
+int TestmainServer(void);
+int TestmainPool(void);
+int TestmainMBox(void);
+int TestmainBench(void);
+int TestmainSim(void);
+int TestmainHeap(void);
+#ifdef HOST_DEVICES
+int TestmainDevices(void);
+#endif
+
+static const struct {
+	const char *name;
+	int (*testmain)(void);
+} testmains[] = {
+	{"fifo",   TestmainFifo},
+	{"topic",  TestmainTopic},
+	{"rwlock", TestmainRWLock},
+	{"sema",   TestmainSema},
+	{"join",   TestmainJoin},
+	{"exit",   TestmainExit},
+	{"tt",     TestmainTT},
+	{"server", TestmainServer},
+	{"pool",   TestmainPool},
+	{"mbox",   TestmainMBox},
+	{"bench",  TestmainBench},
+	{"sim",    TestmainSim},
+	{"heap",   TestmainHeap},
+#ifdef HOST_DEVICES
+	{"devices", TestmainDevices},
+#endif
+};
+#define NUMTESTMAINS (sizeof(testmains)/sizeof(testmains[0]))
+
+static void usage(const char *prog) {
+#ifdef HOST_DEVICES
+	fprintf(stderr, "usage: %s [-t ms] [-s slowdown | -v] [-r seed] [-d image] [-l lcd.ppm] <testmain>\n", prog);
+#else
+	fprintf(stderr, "usage: %s [-t ms] [-s slowdown | -v] [-r seed] <testmain>\n", prog);
+#endif
+	fprintf(stderr, "  -t ms        stop after this much simulated time (default 20000, 0 runs forever)\n");
+	fprintf(stderr, "  -s slowdown  real seconds per simulated second (default 1)\n");
+	fprintf(stderr, "  -v           virtual time, the clock only moves with modelled execution time\n");
+	fprintf(stderr, "  -r seed      seed of the sim.c distributions (default 1)\n");
+#ifdef HOST_DEVICES
+	fprintf(stderr, "  -d image     SD card image, a multiple of 512 KB (default an empty socket)\n");
+	fprintf(stderr, "  -l lcd.ppm   save the LCD when the program stops\n");
+#endif
+	fprintf(stderr, "testmains:");
+	for (unsigned i = 0; i < NUMTESTMAINS; i++)
+		fprintf(stderr, " %s", testmains[i].name);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	unsigned long limitMs = 20000;
+	unsigned long slowdown = 1;
+	const char *image = NULL, *lcdFile = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:vr:d:l:")) != -1) {
+		switch (opt) {
+		case 't': limitMs = strtoul(optarg, NULL, 0); break;
+		case 's': slowdown = strtoul(optarg, NULL, 0); if (!slowdown) usage(argv[0]); break;
+		case 'v': slowdown = 0; break;
+		case 'r': Sim_Seed(strtoul(optarg, NULL, 0)); break;
+		case 'd': image = optarg; break;
+		case 'l': lcdFile = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	for (unsigned i = 0; i < NUMTESTMAINS; i++) {
+		if (strcmp(argv[optind], testmains[i].name) == 0) {
+			Host_Init(limitMs, slowdown);
+#ifdef HOST_DEVICES
+			if (!Devices_Init(image, lcdFile))
+				return 1;
+#else
+			if (image || lcdFile)
+				usage(argv[0]);
+#endif
+			testmains[i].testmain();   // OS_Launch does not return
+			return 0;
+		}
+	}
+	usage(argv[0]);
+	return 2;
+}
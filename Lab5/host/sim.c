@@ -0,0 +1,233 @@
+/*
+ * sim.c
+ * task and interrupt models for the virtual-time simulator, and TestmainSim,
+ * a mixed workload run on the real scheduler, semaphores and Fifo
+ */
+
+#include <math.h>
+#include "OS.h"
+#include "tm4c123gh6pm.h"
+#include "Serial.h"
+#include "host.h"
+#include "sim.h"
+
+static uint32_t seed = 1;
+
+void Sim_Seed(uint32_t s) {
+	seed = s ? s : 1;
+}
+
+// xorshift32
+static uint32_t simRandom(void) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+// uniform in [0,1)
+static double simUnit(void) {
+	return simRandom() / 4294967296.0;
+}
+
+uint32_t Sim_Sample(const SimDistType *dist) {
+	double x;
+	switch (dist->kind) {
+	case SIM_UNIFORM:
+		if (dist->b <= dist->a)
+			return dist->a;
+		return dist->a + simRandom() % (dist->b - dist->a + 1);
+	case SIM_NORMAL:
+		// sum of 12 uniforms, mean 6 and variance 1
+		x = -6.0;
+		for (int i = 0; i < 12; i++)
+			x += simUnit();
+		x = dist->a + x * dist->b;
+		return x > 0 ? (uint32_t)x : 0;
+	case SIM_EXPONENTIAL:
+		return (uint32_t)(-log(1.0 - simUnit()) * dist->a);
+	case SIM_FIXED:
+	default:
+		return dist->a;
+	}
+}
+
+void Sim_Run(const SimDistType *dist) {
+	Host_Consume(Sim_Sample(dist));
+}
+
+static uint32_t simCost(void *arg) {
+	return Sim_Sample(arg);
+}
+
+void Sim_SetCost(int exception, const SimDistType *dist) {
+	Host_SetCost(exception, simCost, (void *)dist);
+}
+
+static void simIsr(void *arg) {
+	SimIsrType *isr = arg;
+	isr->runs++;
+	Sim_Run(&isr->cost);
+	if (isr->task)
+		isr->task();
+	isr->release += Sim_Sample(&isr->interarrival);
+	Host_Schedule(isr->source, isr->release);
+}
+
+int Sim_AddIsr(SimIsrType *isr) {
+	isr->source = Host_AddSource(isr->exception, isr->priority, simIsr, isr);
+	if (isr->source < 0)
+		return 0;
+	isr->runs = 0;
+	isr->release = Host_Cycles() + Sim_Sample(&isr->interarrival);
+	Host_Schedule(isr->source, isr->release);
+	return 1;
+}
+
+int Sim_Complete(SimDeadlineType *task, unsigned long release, unsigned long deadline) {
+	unsigned long response = OS_TimeDifference(release, OS_Time());
+	task->runs++;
+	if (response > task->maxResponse)
+		task->maxResponse = response;
+	if (response > deadline) {
+		task->misses++;
+		return 1;
+	}
+	return 0;
+}
+
+void Sim_Report(const SimDeadlineType *task) {
+	Serial_println("%s runs=%u misses=%u", task->name, task->runs, task->misses);
+	Serial_println("%s max response=%u", task->name, task->maxResponse);
+}
+
+//*******************Simulated workload**********
+// SIMRUNMS of virtual time with
+//   Timer1A: 1 kHz sampling task, 5-15us
+//   Timer0A: 770 Hz control law, 20-50us
+//   ADC0 sequencer 3: 2 kHz, puts the conversion time into the Fifo
+//   GPIOF: SW1 pressed every 500ms on average, through the real GPIOPortF_Handler
+//   SimFilter: priority 2, filters each ADC sample, 2ms deadline
+//   SimControl: priority 3, 10ms period, about 3ms of work, deadline at the next period
+//   SimBackground: priority 5, soaks up the rest 100us at a time
+// Prints the same jitter lines as print_jitter and the jitter command, and
+// runs/misses lines like TestmainServer, then stops the program
+#define SIMRUNMS      3600000       // one hour
+#define SIMCONTROLMS  10
+#define PF4           (*((volatile unsigned long *)0x40025040))
+
+void print_jitter(void);
+void WaitForInterrupt(void);
+void GPIOPortF_Handler(void);
+extern unsigned long jitter1Histogram[JITTERSIZE];
+extern unsigned long jitter2Histogram[JITTERSIZE];
+
+static const SimDistType SimSwitchCost = {SIM_FIXED, 160, 0};    // 2us
+static const SimDistType SimTickCost   = {SIM_FIXED, 80, 0};     // 1us
+static const SimDistType SimSampleCost = {SIM_UNIFORM, 400, 1200};
+static const SimDistType SimLawCost    = {SIM_UNIFORM, 1600, 4000};
+static const SimDistType SimFilterCost = {SIM_UNIFORM, 4000, 20000};
+static const SimDistType SimControlCost= {SIM_NORMAL, 3*TIME_1MS, TIME_1MS/2};
+static const SimDistType SimChunk      = {SIM_FIXED, TIME_1MS/10, 0};
+static const SimDistType SimPressGap   = {SIM_EXPONENTIAL, 500*TIME_1MS, 0};
+static const SimDistType SimPressHold  = {SIM_UNIFORM, 50*TIME_1MS, 200*TIME_1MS};
+
+static void SimAdcTask(void);
+static void SimButtonEdge(void);
+static SimIsrType SimAdc = {
+	16+17, 1, {SIM_FIXED, TIME_500US, 0}, {SIM_FIXED, 240, 0}, SimAdcTask};
+static SimIsrType SimButton = {
+	16+30, 5, {SIM_EXPONENTIAL, 500*TIME_1MS, 0}, {SIM_FIXED, 0, 0}, SimButtonEdge};
+
+static SimDeadlineType SimFilter = {"filter"};
+static SimDeadlineType SimControl = {"control"};
+static unsigned long SimLost, SimPushes, SimBackground;
+
+static void SimSample(void) {    // runs in Timer1A_Handler
+	Sim_Run(&SimSampleCost);
+}
+static void SimLaw(void) {       // runs in Timer0A_Handler
+	Sim_Run(&SimLawCost);
+}
+static void SimAdcTask(void) {   // the sample is stamped with its conversion time
+	if (OS_Fifo_Put((uint32_t)SimAdc.release) == 0)
+		SimLost++;
+}
+static void SimButtonEdge(void) {
+	int pressed = (PF4 & 0x10) != 0;   // negative logic, it was released
+	PF4 = pressed ? 0 : 0x10;
+	if (GPIO_PORTF_IM_R & 0x10) {      // edges are lost while the handler debounces
+		GPIO_PORTF_RIS_R |= 0x10;
+		GPIOPortF_Handler();
+		GPIO_PORTF_RIS_R &= ~0x10;
+	}
+	SimButton.interarrival = pressed ? SimPressHold : SimPressGap;
+}
+static void SimPush(void) {      // SW1 task
+	SimPushes++;
+}
+static void SimFilterTask(void) {
+	while (1) {
+		unsigned long sample = OS_Fifo_Get();
+		Sim_Run(&SimFilterCost);
+		Sim_Complete(&SimFilter, sample, 2*TIME_1MS);
+	}
+}
+static void SimControlTask(void) {
+	unsigned long release = OS_Time();
+	unsigned long next = OS_MsTime();
+	while (1) {
+		Sim_Run(&SimControlCost);
+		if (Sim_Complete(&SimControl, release, SIMCONTROLMS*TIME_1MS))
+			next = OS_MsTime();        // start over rather than catch up
+		next += SIMCONTROLMS;
+		if (OS_MsTime() < next)
+			OS_Sleep(next - OS_MsTime());
+		release = OS_Time();
+	}
+}
+static void SimBackgroundTask(void) {
+	while (1) {
+		Sim_Run(&SimChunk);
+		SimBackground++;
+	}
+}
+static void SimIdle(void) {
+	while (1)
+		WaitForInterrupt();
+}
+static void SimReport(void) {
+	OS_Sleep(SIMRUNMS);
+	print_jitter();
+	Serial_println("Periodic Task 1 histogram (0.1 us):");
+	for (int i = 0; i < JITTERSIZE; i++)
+		Serial_printf("%u %u\n\r", i, jitter1Histogram[i]);
+	Serial_println("Periodic Task 2 histogram (0.1 us):");
+	for (int i = 0; i < JITTERSIZE; i++)
+		Serial_printf("%u %u\n\r", i, jitter2Histogram[i]);
+	Sim_Report(&SimFilter);
+	Sim_Report(&SimControl);
+	Serial_println("adc runs=%u lost=%u", SimAdc.runs, SimLost);
+	Serial_println("sw1 pushes=%u", SimPushes);
+	Serial_println("background loops=%u", SimBackground);
+	Host_Stop();
+}
+int TestmainSim(void) {   // TestmainSim
+	OS_Init();           // initialize, disable interrupts
+	Sim_SetCost(15, &SimSwitchCost);
+	Sim_SetCost(16+35, &SimTickCost);
+	OS_Fifo_Init(16);
+	OS_AddPeriodicThread(&SimSample, TIME_1MS, 1);
+	OS_AddPeriodicThread(&SimLaw, 1300*TIME_1MS/1000, 2);
+	PF4 = 0x10;          // released
+	OS_AddSW1Task(&SimPush, 2);
+	Sim_AddIsr(&SimAdc);
+	Sim_AddIsr(&SimButton);
+	OS_AddProcess(&SimReport, 0, 0, 128, 0);
+	OS_AddProcess(&SimFilterTask, 0, 0, 128, 2);
+	OS_AddProcess(&SimControlTask, 0, 0, 128, 3);
+	OS_AddProcess(&SimBackgroundTask, 0, 0, 128, 5);
+	OS_AddProcess(&SimIdle, 0, 0, 128, 7);
+	OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+	return 0;            // this never executes
+}
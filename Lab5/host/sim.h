@@ -0,0 +1,91 @@
+/*
+ * sim.h
+ * task and interrupt models for the virtual-time simulator
+ * execution times and interarrival times are drawn from distributions with
+ * a seeded generator, so a run with the same seed repeats exactly
+ */
+
+#ifndef __SIM_H
+#define __SIM_H
+
+#include <stdint.h>
+
+typedef enum {
+	SIM_FIXED,          // a
+	SIM_UNIFORM,        // a to b
+	SIM_NORMAL,         // mean a, standard deviation b, never below 0
+	SIM_EXPONENTIAL     // mean a
+} SimKindType;
+
+// times in 12.5ns units
+typedef struct {
+	SimKindType kind;
+	uint32_t a;
+	uint32_t b;
+} SimDistType;
+
+// a modelled interrupt source, such as the ADC or a button
+typedef struct {
+	int exception;            // 16 + IRQ, as seen by Host_IPSR
+	int priority;             // NVIC priority, 0 is the highest
+	SimDistType interarrival; // time from one request to the next
+	SimDistType cost;         // execution time of the handler
+	void (*task)(void);       // run in the handler after the cost, may be 0
+	unsigned long runs;
+	uint64_t release;         // time of the current request
+	int source;
+} SimIsrType;
+
+// completion times of a task against its deadline
+typedef struct {
+	const char *name;
+	unsigned long runs;
+	unsigned long misses;
+	unsigned long maxResponse; // in 12.5ns units
+} SimDeadlineType;
+
+//******** Sim_Seed ***************
+// restart the generator
+// Inputs: seed, 0 is replaced by 1
+// Outputs: none
+void Sim_Seed(uint32_t seed);
+
+//******** Sim_Sample ***************
+// draw one value
+// Inputs: distribution
+// Outputs: time in 12.5ns units
+uint32_t Sim_Sample(const SimDistType *dist);
+
+//******** Sim_Run ***************
+// model execution of the caller for one sample of the distribution
+// Inputs: distribution
+// Outputs: none
+void Sim_Run(const SimDistType *dist);
+
+//******** Sim_SetCost ***************
+// execution time of a kernel handler, e.g. 15 for the context switch
+// or 16+35 for the Timer3A tick
+// Inputs: exception number, distribution, kept by reference
+// Outputs: none
+void Sim_SetCost(int exception, const SimDistType *dist);
+
+//******** Sim_AddIsr ***************
+// start a modelled interrupt source, the first request comes one
+// interarrival time after the call
+// Inputs: source, kept by reference
+// Outputs: 1 if successful, 0 if there are too many sources
+int Sim_AddIsr(SimIsrType *isr);
+
+//******** Sim_Complete ***************
+// record one completion of a task
+// Inputs: deadline record, release time and relative deadline in 12.5ns units
+// Outputs: 1 if the deadline was missed
+int Sim_Complete(SimDeadlineType *task, unsigned long release, unsigned long deadline);
+
+//******** Sim_Report ***************
+// print runs and misses like the target tests do
+// Inputs: deadline record
+// Outputs: none
+void Sim_Report(const SimDeadlineType *task);
+
+#endif
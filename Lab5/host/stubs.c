@@ -0,0 +1,122 @@
+/*
+ * stubs.c
+ * board drivers for the host port: the serial port is the terminal,
+ * the PLL, LEDs, LCD and SD card do nothing
+ * with HOST_DEVICES the real serial, LCD and SD card drivers run on the
+ * models in devices.c instead
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "OS.h"
+#include "Serial.h"
+#include "LED.h"
+#include "PLL.h"
+#include "ST7735.h"
+#include "ff.h"
+
+void PLL_Init(uint32_t freq) {
+	(void)freq;
+}
+
+void LED_Init(void) {}
+void LED_RED_ON(void) {}
+void LED_RED_OFF(void) {}
+void LED_RED_TOGGLE(void) {}
+void LED_BLUE_ON(void) {}
+void LED_BLUE_OFF(void) {}
+void LED_BLUE_TOGGLE(void) {}
+void LED_GREEN_ON(void) {}
+void LED_GREEN_OFF(void) {}
+void LED_GREEN_TOGGLE(void) {}
+
+#ifndef HOST_DEVICES
+void LCD_Init(void) {}
+
+void ST7735_OutString(char *ptr) {
+	(void)ptr;
+}
+
+void ST7735_Message(unsigned long device, unsigned long line, char *string, long value) {
+	(void)device; (void)line; (void)string; (void)value;
+}
+
+// write(2) rather than stdio, handlers print too and may preempt a thread mid-call
+static void serialWrite(const char *buf, size_t len) {
+	while (len) {
+		ssize_t n = write(1, buf, len);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+void Serial_Init(void) {}
+void Serial_ThreadExit(void) {}
+
+void Serial_OutChar(char data) {
+	serialWrite(&data, 1);
+}
+
+void Serial_OutString(char *pt) {
+	serialWrite(pt, strlen(pt));
+}
+
+char Serial_InChar(void) {
+	char c;
+	while (read(0, &c, 1) != 1)
+		OS_Suspend();
+	return c;
+}
+
+void Serial_OutUDec(uint32_t n) {
+	char buf[12];
+	serialWrite(buf, snprintf(buf, sizeof(buf), "%u", n));
+}
+
+void Serial_OutUHex(uint32_t number) {
+	char buf[12];
+	serialWrite(buf, snprintf(buf, sizeof(buf), "%X", number));
+}
+
+static void serialFormat(char *format, va_list ap, int newline) {
+	char buf[256];
+	int len = vsnprintf(buf, sizeof(buf) - 2, format, ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(buf) - 3)
+		len = sizeof(buf) - 3;
+	if (newline) {
+		buf[len++] = '\r';
+		buf[len++] = '\n';
+	}
+	serialWrite(buf, len);
+}
+
+void Serial_printf(char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	serialFormat(format, ap, 0);
+	va_end(ap);
+}
+
+void Serial_println(char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	serialFormat(format, ap, 1);
+	va_end(ap);
+}
+
+// the test mains only mount the card
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt) {
+	(void)fs; (void)path; (void)opt;
+	return FR_NOT_READY;
+}
+#endif
+
+void interpreter(void) {
+	Serial_println("interpreter: not available on the host");
+}
@@ -20,6 +20,10 @@
 #define TIME_250US  (TIME_1MS/5)
 
 #define NUMTHREADS  15        // maximum number of threads
+#define OS_TLS_SLOTS 4        // thread-local storage slots per thread
+
+// TLS slot assignments
+#define OS_TLS_SERIAL 0       // Serial_printf formatting buffer, given back by OS_Exit
 
 #define FS 400              // producer/consumer sampling
 #define RUNLENGTH (20*FS)   // display results and quit when NumSamples==RUNLENGTH
@@ -34,7 +38,8 @@ enum State {
 		FREE,
 		ACTIVE,
 		SLEEP,
-		BLOCKED
+		BLOCKED,
+		DEAD        // killed, slot freed at the next thread switch
 };
 
 typedef struct tcb tcbType;
@@ -46,6 +51,89 @@ typedef struct Sema4{
   int end;					 	 // the end index of waiters
 } Sema4Type;
 
+/*
+ *	Reader-writer lock, writer preference, priority aware
+ */
+typedef struct RWLock {
+	long readers;                   // number of threads holding it for reading
+	int writer;                     // 1 while a thread holds it for writing
+	tcbType *handoff;               // woken writer that was given the lock, 0 if none
+	tcbType *waiters[NUMTHREADS];   // blocked threads, in no particular order
+	uint8_t waitWrite[NUMTHREADS];  // 1 if the matching waiter wants to write
+	int waitNum;
+} RWLockType;
+
+/*
+ *	Mailbox with N slots of a fixed message size
+ */
+#define MBOX_MAXSIZE 16       // bytes per message, copied with interrupts disabled
+typedef struct MBox {
+	uint8_t *buf;             // slots*size bytes of message storage
+	unsigned long size;       // bytes per message
+	unsigned long slots;      // number of messages it can hold
+	unsigned long putI;       // slot the next message goes into
+	unsigned long getI;       // slot the next message comes from
+	Sema4Type dataValid;      // number of slots holding mail
+	Sema4Type boxFree;        // number of empty slots
+} MBoxType;
+
+/*
+ *	Publish/subscribe topic, one producer and any number of readers
+ */
+#define TOPIC_MAXSUBS   8     // queued subscribers per topic
+#define TOPIC_QUEUESIZE 4     // samples queued per subscriber, must be a power of 2
+
+typedef struct TopicSample {
+	unsigned long data;
+	unsigned long time;       // OS_Time when it was published
+} TopicSampleType;
+
+typedef struct TopicSub {
+	TopicSampleType queue[TOPIC_QUEUESIZE];
+	unsigned long putI;       // only written by the producer
+	unsigned long getI;       // only written by the subscriber
+	unsigned long lost;       // samples dropped because the queue was full
+	Sema4Type dataNum;        // number of samples in the queue
+} TopicSubType;
+
+typedef struct Topic {
+	volatile unsigned long seq;      // odd while the producer is writing sample
+	volatile TopicSampleType sample; // latest sample
+	int subNum;
+	TopicSubType *subs[TOPIC_MAXSUBS];
+} TopicType;
+
+/*
+ *	Worker pool statistics, times in 12.5ns units
+ */
+typedef struct PoolStats {
+	unsigned long jobsRun;        // jobs picked up by a worker
+	unsigned long jobsRejected;   // submissions refused because the queue was full
+	unsigned long totalWait;      // sum of queue waits, divide by jobsRun for the average
+	unsigned long maxWait;        // longest queue wait
+} PoolStatsType;
+
+/*
+ *	Sporadic server statistics, times in 12.5ns units
+ */
+typedef struct ServerStats {
+	unsigned long jobsRun;        // jobs completed
+	unsigned long jobsRejected;   // submissions refused because the queue was full
+	unsigned long exhaustions;    // times the budget ran out and the server was demoted
+	unsigned long totalResponse;  // sum of submit to completion times
+	unsigned long maxResponse;    // longest submit to completion time
+	unsigned long budgetLeft;     // budget left when the stats were read
+} ServerStatsType;
+
+/*
+ *	One slot of the time-triggered schedule table, see OS_TT_Start
+ */
+#define TT_MAXSLOTS 16
+typedef struct TTSlot {
+	void (*task)(void);           // background task released at the start of the slot, 0 for none
+	unsigned long budget;         // allowed execution time in 12.5ns units, 0 for the whole slot
+} TTSlotType;
+
 typedef struct pcb pcbType;
 
 /*
@@ -58,9 +146,13 @@ typedef struct tcb {
 	enum State state;
 	int tid;
 	uint32_t sleepTimeLeft;    // number of cycles left the thread needs to remain in sleep state
-	Sema4Type *blocked;        // the semaphore it is blocked on
+	void *blocked;             // the semaphore or reader-writer lock it is blocked on
 	int32_t priority;
 	pcbType *pcb;
+	int joinable;              // 1 if the exit code is kept for OS_Join
+	int joinTid;               // thread it is waiting for in OS_Join, -1 if none
+	int exitCode;              // exit code handed over by OS_Join
+	void *tls[OS_TLS_SLOTS];   // thread-local storage, cleared when the thread is created
 } tcbType;
 
 /*
@@ -70,10 +162,29 @@ struct pcb {
 	int pid;
 	void *text;
 	void *data;
+	int loaded;                // 1 if text came from the loader, 0 for a placeholder
 	int threadNum;
+	struct heap_arena *arena;  // from OS_Arena_Init, released with the process, 0 if none
 };
 
-//extern tcbType *RunPt;
+extern tcbType *RunPt;
+
+// ******** OS_TLS_Get ************
+// read a thread-local storage slot of the running thread
+// input:  slot, 0 to OS_TLS_SLOTS-1
+// output: value stored with OS_TLS_Set, 0 if never set or before OS_Launch
+// in a handler this is the slot of the interrupted thread
+static inline void *OS_TLS_Get(int slot) {
+	return RunPt ? RunPt->tls[slot] : 0;
+}
+
+// ******** OS_TLS_Set ************
+// write a thread-local storage slot of the running thread
+// input:  slot, 0 to OS_TLS_SLOTS-1, and the value to store
+// output: none
+static inline void OS_TLS_Set(int slot, void *value) {
+	if (RunPt) RunPt->tls[slot] = value;
+}
 
 
 // ******** OS_Init ************
@@ -105,6 +216,13 @@ void OS_Wait(Sema4Type *semaPt);
 // output: none
 void OS_Signal(Sema4Type *semaPt);
 
+// ******** OS_TryWait ************
+// decrement semaphore only if that would not block
+// input:  pointer to a counting semaphore
+// output: 1 if the semaphore was decremented, 0 if it is not available
+// Can be called from the background
+int OS_TryWait(Sema4Type *semaPt);
+
 // ******** OS_bWait ************
 // Lab2 spinlock, set to 0
 // Lab3 block if less than zero
@@ -119,6 +237,41 @@ void OS_bWait(Sema4Type *semaPt);
 // output: none
 void OS_bSignal(Sema4Type *semaPt);
 
+// ******** OS_InitRWLock ************
+// initialize a reader-writer lock, unlocked with no waiters
+// input:  pointer to the lock
+// output: none
+void OS_InitRWLock(RWLockType *rwPt);
+
+// ******** OS_ReadLock ************
+// acquire the lock for reading, shared with other readers
+// blocks while a writer holds the lock, or while a writer of equal
+//   or higher priority is waiting (writer preference)
+// input:  pointer to the lock
+// output: none
+void OS_ReadLock(RWLockType *rwPt);
+
+// ******** OS_ReadUnlock ************
+// release a lock acquired with OS_ReadLock
+// input:  pointer to the lock
+// output: none
+void OS_ReadUnlock(RWLockType *rwPt);
+
+// ******** OS_WriteLock ************
+// acquire the lock for writing, exclusive of readers and other writers
+// when released, the highest priority waiter goes next
+// input:  pointer to the lock
+// output: none
+void OS_WriteLock(RWLockType *rwPt);
+
+// ******** OS_WriteUnlock ************
+// release a lock acquired with OS_WriteLock
+// a waiting writer is handed the lock directly, and a woken waiter of
+//   higher priority than the caller runs right away (also OS_ReadUnlock)
+// input:  pointer to the lock
+// output: none
+void OS_WriteUnlock(RWLockType *rwPt);
+
 //******** OS_AddThread ***************
 // add a foregound thread to the scheduler
 // Inputs: pointer to a void-void foreground task
@@ -129,6 +282,26 @@ void OS_bSignal(Sema4Type *semaPt);
 int OS_AddThread(void(*task)(void),
    unsigned long stackSize, unsigned long priority);
 
+//******** OS_AddJoinableThread ***************
+// add a foregound thread whose exit code can be collected with OS_Join
+// Inputs: pointer to a void-void foreground task
+//         number of bytes allocated for its stack
+//         priority, 0 is highest, 5 is the lowest
+// Outputs: handle (thread ID) to pass to OS_Join, -1 if this thread can not be added
+//          or NUMTHREADS exit codes are already waiting to be joined
+int OS_AddJoinableThread(void(*task)(void),
+   unsigned long stackSize, unsigned long priority);
+
+//******** OS_Join ***************
+// wait for a joinable thread to exit
+// Inputs: handle from OS_AddJoinableThread
+//         where to store its exit code, may be 0
+// Outputs: 1 if successful, 0 if there is no such joinable thread
+//          (never created, not joinable, or already joined), or if waiting
+//          would never end (the caller itself, or a thread joining the caller)
+// The TCB and stack are released when the thread exits, not when it is joined
+int OS_Join(int tid, int *exitCode);
+
 //******** OS_Id ***************
 // returns the thread ID for the currently running thread
 // Inputs: none
@@ -155,6 +328,32 @@ unsigned long OS_Id(void);
 int OS_AddPeriodicThread(void(*task)(void),
    uint32_t period, uint32_t priority);
 
+//******** OS_TT_Start ***************
+// run background tasks from a static schedule table (time-triggered cyclic executive)
+// Timer2A interrupts once per slot; slot i releases table[i].task and the
+// table repeats every slots*slotLength (the major cycle). A task that needs a
+// higher rate appears in several slots. Foreground threads run in the slack.
+// Inputs: schedule table, kept by the OS, must stay valid while running
+//         number of slots, 1 to TT_MAXSLOTS
+//         slot length in system time units (12.5ns)
+//         priority 0 is the highest, 7 is the lowest
+// Outputs: 1 if successful, 0 if the table is invalid or already running
+// Tasks follow the same rules as OS_AddPeriodicThread tasks
+int OS_TT_Start(const TTSlotType *table, unsigned long slots,
+   unsigned long slotLength, unsigned long priority);
+
+//******** OS_TT_Stop ***************
+// stop the cyclic executive started by OS_TT_Start
+// Inputs: none
+// Outputs: none
+void OS_TT_Stop(void);
+
+//******** OS_TT_Overruns ***************
+// number of times a slot's task ran past its budget or into the next slot
+// Inputs: slot number
+// Outputs: overrun count since OS_TT_Start
+unsigned long OS_TT_Overruns(unsigned long slot);
+
 //******** OS_AddSW1Task ***************
 // add a background task to run whenever the SW1 (PF4) button is pushed
 // Inputs: pointer to a void/void background function
@@ -185,6 +384,70 @@ int OS_AddSW1Task(void(*task)(void), unsigned long priority);
 //           determines the relative priority of these four threads
 int OS_AddSW2Task(void(*task)(void), unsigned long priority);
 
+// ******** OS_Pool_Init ************
+// Create the worker threads that run jobs passed to OS_Pool_Submit
+// Inputs:  number of worker threads, priority of the workers
+// Outputs: number of workers actually created
+// Call once, from main before OS_Launch or from a thread
+int OS_Pool_Init(unsigned long workers, unsigned long priority);
+
+// ******** OS_Pool_Submit ************
+// Queue a job for the next free worker thread
+// Can be called from threads and from the background, never waits
+// Inputs:  function to run, argument passed to it
+// Outputs: 1 if queued, 0 if the job queue is full
+// The job runs to completion on a worker, it can sleep or block, but must return
+int OS_Pool_Submit(void (*fn)(void *), void *arg);
+
+// ******** OS_Pool_Stats ************
+// How long jobs have waited in the queue before a worker picked them up
+// Inputs:  none
+// Outputs: copy of the pool statistics, wait times in 12.5ns units
+PoolStatsType OS_Pool_Stats(void);
+
+// ******** OS_Arena_Init ************
+// Give the running thread's process an arena, memory that is handed out by
+// OS_Arena_Malloc and released in one step when the last thread of the
+// process exits, instead of freeing each block
+// Inputs:  bytes the arena can hand out
+// Outputs: 1 if successful, 0 if the heap is full or the process has an arena
+int OS_Arena_Init(unsigned long bytes);
+
+// ******** OS_Arena_Malloc ************
+// Allocate memory from the running thread's process arena, in constant time
+// Inputs:  number of bytes
+// Outputs: pointer to the memory, 0 if the process has no arena or it is full
+// There is no free, the memory lives as long as the process
+void *OS_Arena_Malloc(unsigned long bytes);
+
+// ******** OS_Server_Init ************
+// Create the sporadic server thread that runs jobs passed to OS_Server_Submit
+// While budget is left the server runs at priority; once it is used up the
+// server drops to lowPriority, and the time used is given back period ms after
+// the server started using it. Threads below priority lose at most
+// budget + 1ms to the server in any period ms.
+// Inputs:  budget in 12.5ns units, replenishment period in ms,
+//          priority while budget is left, priority once it is exhausted
+// Outputs: 1 if successful, 0 if the thread could not be created
+// Call once, from main before OS_Launch or from a thread
+int OS_Server_Init(unsigned long budget, unsigned long period,
+		unsigned long priority, unsigned long lowPriority);
+
+// ******** OS_Server_Submit ************
+// Queue an aperiodic job for the sporadic server, jobs run in order
+// Can be called from threads and from the background, never waits
+// Inputs:  function to run, argument passed to it
+// Outputs: 1 if queued, 0 if the queue is full or OS_Server_Init has not
+//          created the server, the caller then runs the job itself
+// The job can sleep or block, but must return
+int OS_Server_Submit(void (*fn)(void *), void *arg);
+
+// ******** OS_Server_Stats ************
+// Response times and budget exhaustions of the sporadic server
+// Inputs:  none
+// Outputs: copy of the server statistics
+ServerStatsType OS_Server_Stats(void);
+
 // ******** OS_Sleep ************
 // place this thread into a dormant state
 // input:  number of msec to sleep
@@ -199,6 +462,13 @@ void OS_Sleep(unsigned long sleepTime);
 // output: none
 void OS_Kill(void);
 
+// ******** OS_Exit ************
+// kill the currently running thread with an exit code for OS_Join
+// release its TCB and stack
+// input:  exit code
+// output: none
+void OS_Exit(int exitCode);
+
 // ******** OS_Suspend ************
 // suspend execution of currently running thread
 // scheduler will choose another thread to execute
@@ -229,6 +499,16 @@ void OS_Fifo_Init(unsigned long size);
 //  this function can not disable or enable interrupts
 int OS_Fifo_Put(unsigned long data);
 
+// ******** OS_Fifo_PutN ************
+// Enter up to n data samples into the Fifo in one operation
+// Called from the background, so no waiting
+// Inputs:  pointer to the samples, number of samples
+// Outputs: number of samples saved, less than n if the Fifo became full
+// The consumer is woken at most once per call, and only when
+//   the number of elements has reached the watermark; if it outranks the
+//   interrupted thread it runs as soon as the handler returns
+int OS_Fifo_PutN(const unsigned long *data, unsigned long n);
+
 // ******** OS_Fifo_Get ************
 // Remove one data sample from the Fifo
 // Called in foreground, will spin/block if empty
@@ -236,6 +516,30 @@ int OS_Fifo_Put(unsigned long data);
 // Outputs: data
 unsigned long OS_Fifo_Get(void);
 
+// ******** OS_Fifo_GetN ************
+// Remove up to n data samples from the Fifo in one operation
+// Called in foreground, returns right away if data is available,
+//   otherwise blocks until the watermark is reached or OS_Fifo_Flush
+// Inputs:  buffer for the samples, maximum number of samples
+// Outputs: number of samples removed, 1 to n
+unsigned long OS_Fifo_GetN(unsigned long *data, unsigned long n);
+
+// ******** OS_Fifo_SetWatermark ************
+// Set the number of elements that must be in the Fifo
+//   before a blocked consumer is woken up
+// Inputs:  watermark, 1 (default, wake on every sample) to the Fifo size
+// Outputs: none
+// A consumer blocked below the watermark sleeps until the producer puts
+//   enough samples; a producer that stops short must call OS_Fifo_Flush
+void OS_Fifo_SetWatermark(unsigned long level);
+
+// ******** OS_Fifo_Flush ************
+// Wake a consumer blocked below the watermark with whatever the Fifo holds
+// Called from the background by the producer when it stops short
+// Inputs:  none
+// Outputs: none
+void OS_Fifo_Flush(void);
+
 // ******** OS_Fifo_Size ************
 // Check the status of the Fifo
 // Inputs: none
@@ -245,6 +549,87 @@ unsigned long OS_Fifo_Get(void);
 //          zero or less than zero if a call to OS_Fifo_Get will spin or block
 long OS_Fifo_Size(void);
 
+// ******** OS_MBox_Init ************
+// Initialize a mailbox with slots messages of size bytes each
+// Inputs:  pointer to the mailbox
+//          storage for slots*size bytes, owned by the mailbox from now on
+//          size of one message in bytes, 1 to MBOX_MAXSIZE
+//          number of messages the mailbox can hold before Send blocks
+// Outputs: 1 if successful, 0 if the size or the number of slots is invalid;
+//          an invalid mailbox has no slots, so the try versions always fail
+// Pass larger messages by pointer, the copy is part of the interrupt latency
+int OS_MBox_Init(MBoxType *mbPt, void *buf, unsigned long size, unsigned long slots);
+
+// ******** OS_MBox_Send ************
+// enter one message into the mailbox
+// Inputs:  pointer to the mailbox, pointer to the message (size bytes)
+// Outputs: none
+// This function will be called from a foreground thread
+// It will block if every slot contains mail not yet received
+void OS_MBox_Send(MBoxType *mbPt, const void *msg);
+
+// ******** OS_MBox_Recv ************
+// remove the oldest message from the mailbox
+// Inputs:  pointer to the mailbox, buffer for the message (size bytes)
+// Outputs: none
+// This function will be called from a foreground thread
+// It will block if the mailbox is empty
+void OS_MBox_Recv(MBoxType *mbPt, void *msg);
+
+// ******** OS_MBox_TrySend ************
+// enter one message into the mailbox if there is room, never waits
+// Inputs:  pointer to the mailbox, pointer to the message (size bytes)
+// Outputs: 1 if sent, 0 if the mailbox is full
+// Can be called from the background
+int OS_MBox_TrySend(MBoxType *mbPt, const void *msg);
+
+// ******** OS_MBox_TryRecv ************
+// remove the oldest message from the mailbox if there is one, never waits
+// Inputs:  pointer to the mailbox, buffer for the message (size bytes)
+// Outputs: 1 if a message was received, 0 if the mailbox is empty
+// Can be called from the background
+int OS_MBox_TryRecv(MBoxType *mbPt, void *msg);
+
+// ******** OS_Topic_Init ************
+// Initialize a topic with no samples and no queued subscribers
+// Inputs:  pointer to the topic
+// Outputs: none
+void OS_Topic_Init(TopicType *topicPt);
+
+// ******** OS_Topic_Subscribe ************
+// Attach a queued subscriber, it receives its own copy of every sample
+//   published from now on
+// Inputs:  pointer to the topic, pointer to the subscriber
+// Outputs: 1 if successful, 0 if the topic already has TOPIC_MAXSUBS subscribers
+// Readers that only need the latest value do not need to subscribe
+int OS_Topic_Subscribe(TopicType *topicPt, TopicSubType *subPt);
+
+// ******** OS_Topic_Publish ************
+// Publish one sample to every reader of the topic
+// Called from the background by the only producer of this topic, so no waiting
+// Inputs:  pointer to the topic, data
+// Outputs: none
+void OS_Topic_Publish(TopicType *topicPt, unsigned long data);
+
+// ******** OS_Topic_Latest ************
+// Read the most recent sample without ever blocking the producer
+// Inputs:  pointer to the topic, where to store the sample
+// Outputs: sequence number of the sample, 0 if nothing published yet
+unsigned long OS_Topic_Latest(TopicType *topicPt, TopicSampleType *samplePt);
+
+// ******** OS_Topic_Read ************
+// Remove the oldest queued sample of a subscriber
+// Called in foreground by the owner of the subscriber, will block if empty
+// Inputs:  pointer to the subscriber, where to store the sample
+// Outputs: none
+void OS_Topic_Read(TopicSubType *subPt, TopicSampleType *samplePt);
+
+// ******** OS_Topic_TryRead ************
+// Remove the oldest queued sample of a subscriber if there is one, never waits
+// Inputs:  pointer to the subscriber, where to store the sample
+// Outputs: 1 if a sample was read, 0 if the queue is empty
+int OS_Topic_TryRead(TopicSubType *subPt, TopicSampleType *samplePt);
+
 // ******** OS_MailBox_Init ************
 // Initialize communication channel
 // Inputs:  none
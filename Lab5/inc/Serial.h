@@ -116,6 +116,12 @@ void Serial_InString(char *bufPt, uint16_t max);
 
 void Serial_printf(char *format, ...);
 
+//------------Serial_ThreadExit------------
+// Give the running thread's formatting buffer back, called by OS_Exit
+// Input: none
+// Output: none
+void Serial_ThreadExit(void);
+
 void Serial_println(char *format, ...);
 
 #endif
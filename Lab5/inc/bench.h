@@ -0,0 +1,88 @@
+// filename *************************bench.h ************************
+// Cycle-accurate microbenchmarks on the Cortex-M4 DWT cycle counter
+// BENCH_BEGIN(site) and BENCH_END(site) bracket a code path in one function;
+// each site accumulates count, total, min and max with the cost of the two
+// macros themselves calibrated out by Bench_Init. A read of CYCCNT is a single
+// load, atomic and free of the multiply OS_Time needs.
+// On the host port the counter is Host_Cycles, bus cycles of the simulated clock;
+// -v charges no time for kernel code, so the kernel sites read 0 there.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+#define BENCH_ENABLE 1        // 0 compiles every BENCH_BEGIN/BENCH_END out
+
+// instrumented sites
+enum BenchSite {
+	BENCH_SWITCH = 0,     // threadScheduler, picking the next thread
+	BENCH_WAIT,           // OS_Wait and OS_bWait when they do not block
+	BENCH_SIGNAL,         // OS_Signal and OS_bSignal
+	BENCH_FIFO_PUT,       // OS_Fifo_PutN
+	BENCH_FIFO_GET,       // OS_Fifo_GetN once data is available
+	BENCH_MALLOC,         // Heap_Malloc
+	BENCH_FREE,           // Heap_Free
+	BENCH_SITES
+};
+
+typedef struct BenchStats {
+	uint32_t count;
+	uint32_t total;       // in counter ticks, bus cycles on target
+	uint32_t min;
+	uint32_t max;
+} BenchStatsType;
+
+#ifndef HOST
+#define DWT_CTRL_R    (*((volatile uint32_t *)0xE0001000))
+#define DWT_CYCCNT_R  (*((volatile uint32_t *)0xE0001004))
+#define DEMCR_R       (*((volatile uint32_t *)0xE000EDFC))
+#define DEMCR_TRCENA  0x01000000  // enable DWT and ITM
+#define DWT_CTRL_CYCCNTENA 0x00000001
+#define BENCH_NOW()   (DWT_CYCCNT_R)
+#else
+#include "host.h"
+#define BENCH_NOW()   ((uint32_t)Host_Cycles())
+#endif
+
+#if BENCH_ENABLE
+#define BENCH_BEGIN(site) uint32_t bench_##site = BENCH_NOW()
+#define BENCH_END(site)   Bench_Record((site), BENCH_NOW() - bench_##site)
+#else
+#define BENCH_BEGIN(site)
+#define BENCH_END(site)
+#endif
+
+//******** Bench_Init ***************
+// start the cycle counter, measure the cost of an empty BEGIN/END pair
+// and clear every site
+// input:  none
+// output: none
+void Bench_Init(void);
+
+//******** Bench_Record ***************
+// add one measurement to a site, used by BENCH_END
+// can be called from threads and from the background
+// input:  site, raw elapsed ticks including the BEGIN/END overhead
+// output: none
+void Bench_Record(int site, uint32_t elapsed);
+
+//******** Bench_Reset ***************
+// clear the accumulators of every site
+// input:  none
+// output: none
+void Bench_Reset(void);
+
+//******** Bench_Get ***************
+// read the accumulators of a site
+// input:  site
+// output: copy of its statistics, min is 0xFFFFFFFF if count is 0
+BenchStatsType Bench_Get(int site);
+
+//******** Bench_Overhead ***************
+// cost of an empty BEGIN/END pair, already subtracted from every measurement
+// input:  none
+// output: ticks
+uint32_t Bench_Overhead(void);
+
+#endif
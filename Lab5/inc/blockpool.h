@@ -0,0 +1,75 @@
+// filename *************************blockpool.h ************************
+// Fixed-size block pools next to the general heap, for small kernel objects
+// that are allocated and freed often. A pool is an array of equal blocks
+// with a free list threaded through the free ones, so BlockPool_Alloc and
+// BlockPool_Free are O(1), cost no boundary tags and never fragment the heap.
+// Unlike the heap, which disables interrupts around each call, a pool is
+// not locked; callers that share one between threads do so inside
+// StartCritical/EndCritical.
+
+#ifndef BLOCKPOOL_H
+#define BLOCKPOOL_H
+
+#include <stdint.h>
+
+#define BLOCKPOOL_OK 0
+#define BLOCKPOOL_ERROR_NOT_IN_POOL 1   // outside the pool or not at the start of a block
+#define BLOCKPOOL_ERROR_NOT_USED 2      // freed twice, the pool has no block in use
+
+#define BLOCKPOOL_MAXPOOLS 8            // pools BlockPool_Get can list
+
+// words in a block holding an object of this many bytes, at least room for the link
+#define BLOCKPOOL_WORDS(bytes) ((((bytes) < sizeof(void *) ? sizeof(void *) : (bytes)) \
+		+ sizeof(uint32_t) - 1) / sizeof(uint32_t))
+
+// storage for count objects of a type, pass it to BlockPool_Init
+#define BLOCKPOOL_STORAGE(name, type, count) \
+	static uint32_t name[(count) * BLOCKPOOL_WORDS(sizeof(type))]
+
+typedef struct BlockPool {
+	const char *name;
+	uint32_t *start;             // first block
+	uint32_t *end;               // one past the last block
+	uint32_t *free;              // first free block, 0 if the pool is empty
+	uint32_t blockWords;
+	uint32_t blocks;
+	uint32_t used;
+	uint32_t peak;               // most blocks in use at once
+	uint32_t failures;           // BlockPool_Alloc calls that found the pool empty
+} BlockPoolType;
+
+//******** BlockPool_Init ***************
+// Make every block of the storage free, clear the statistics and make the
+// pool visible to BlockPool_Get; calling it again on a pool resets it
+// input: pool, name for the statistics, storage from BLOCKPOOL_STORAGE,
+//   size of one object in bytes, number of blocks in the storage
+// output: none
+void BlockPool_Init(BlockPoolType *pool, const char *name, uint32_t *storage,
+		uint32_t objectBytes, uint32_t blocks);
+
+//******** BlockPool_Alloc ***************
+// Take a block, contents not initialized
+// input: pool
+// output: the block, 0 if every block is in use
+void *BlockPool_Alloc(BlockPoolType *pool);
+
+//******** BlockPool_Free ***************
+// Return a block to its pool
+// input: pool, a block from BlockPool_Alloc on that pool
+// output: BLOCKPOOL_OK, BLOCKPOOL_ERROR_NOT_IN_POOL if it is not one of
+//   the pool's blocks, or BLOCKPOOL_ERROR_NOT_USED if it is already free;
+//   a double free is caught when no block is in use or when the block was
+//   the last one freed, an older one would need a walk of the free list
+int32_t BlockPool_Free(BlockPoolType *pool, void *block);
+
+//******** BlockPool_Owns ***************
+// input: pool, any pointer
+// output: 1 if the pointer is a block of this pool, 0 otherwise
+int BlockPool_Owns(const BlockPoolType *pool, const void *block);
+
+//******** BlockPool_Get ***************
+// input: index, 0 and up, in the order the pools were initialized
+// output: the pool, 0 past the last one
+const BlockPoolType *BlockPool_Get(int index);
+
+#endif //#ifndef BLOCKPOOL_H
@@ -2,6 +2,7 @@
 // Implements memory heap for dynamic memory allocation.
 // Follows standard malloc/calloc/realloc/free interface
 // for allocating/unallocating memory.
+// Safe to call from any thread, each call runs in a critical section.
 
 // Jacob Egner 2008-07-31
 // modified 1/31/08 Jonathan Valvano for style
@@ -28,14 +29,17 @@
 #ifndef HEAP_H
 #define HEAP_H
 
-// feel free to change HEAP_SIZE_BYTES to however
-// big you want the heap to be
+// on the board the heap is all SRAM after .bss, found by Heap_Init;
+// HEAP_SIZE_BYTES only sizes the heap of the host port
 #define HEAP_SIZE_BYTES (2048)
 #define HEAP_SIZE_WORDS (HEAP_SIZE_BYTES / sizeof(int32_t))
+// least SRAM after .bss Heap_Init accepts, lab5.ld checks the same
+#define HEAP_MIN_BYTES (2048)
 
 #define HEAP_OK 0
 #define HEAP_ERROR_CORRUPTED_HEAP 1
 #define HEAP_ERROR_POINTER_OUT_OF_RANGE 2
+#define HEAP_ERROR_TOO_SMALL 3
 
 // struct for holding statistics on the state of the heap
 typedef struct heap_stats {
@@ -44,12 +48,15 @@ typedef struct heap_stats {
   int32_t wordsOverhead;
   int32_t blocksUsed;
   int32_t blocksUnused;
+  int32_t wordsLargestFree;  // room of the largest unused block, the most one malloc can get
+  int32_t fragmentation;     // percent of the available words outside that block
 } heap_stats_t;
 
 //******** Heap_Init *************** 
 // Initialize the Heap
 // input: none
-// output: always HEAP_OK
+// output: HEAP_OK, or HEAP_ERROR_TOO_SMALL if less than HEAP_MIN_BYTES
+//  are left after .bss; the heap is then empty and every malloc fails
 // notes: Initializes/resets the heap to a clean state where no memory
 //  is allocated.
 int32_t Heap_Init(void);
@@ -64,6 +71,17 @@ int32_t Heap_Init(void);
 void* Heap_Malloc(int32_t desiredBytes);
 
 
+//******** Heap_AlignedMalloc *************** 
+// Allocate memory at an aligned address, data not initialized
+// input: 
+//   desiredBytes: desired number of bytes to allocate
+//   alignment: power of two in bytes, anything up to 4 is plain Heap_Malloc
+// output: void* pointing to the allocated memory or will return NULL
+//   if there isn't sufficient space or alignment is not a power of two
+// notes: free it with Heap_Free; Heap_Realloc does not keep the alignment
+void* Heap_AlignedMalloc(int32_t desiredBytes, int32_t alignment);
+
+
 //******** Heap_Calloc *************** 
 // Allocate memory, data are initialized to 0
 // input:
@@ -82,8 +100,9 @@ void* Heap_Calloc(int32_t desiredBytes);
 //    where the contents of the old block will be copied to
 // output: void* pointing to the new block or will return NULL
 //   if there is any reason the reallocation can't be completed
-// notes: the given block will be unallocated after its contents
-//   are copied to the new block
+// notes: grows or shrinks in place when the neighboring blocks allow it,
+//   otherwise the given block will be unallocated after its contents
+//   are copied to the new block; on failure the given block is untouched
 void* Heap_Realloc(void* oldBlock, int32_t desiredBytes);
 
 
@@ -108,7 +127,33 @@ int32_t Heap_Test(void);
 // return the current status of the heap
 // input: none
 // output: a heap_stats_t that describes the current usage of the heap
+// notes: constant time apart from one short list, cheap enough to poll
 heap_stats_t Heap_Stats(void);
 
 
+// an arena hands out memory from one heap block, which is freed as a whole
+typedef struct heap_arena heap_arena_t;
+
+//******** Heap_ArenaCreate *************** 
+// Allocate an arena for Heap_ArenaMalloc
+// input: bytes the arena can hand out
+// output: the arena, or NULL if there isn't sufficient space
+heap_arena_t* Heap_ArenaCreate(int32_t bytes);
+
+
+//******** Heap_ArenaMalloc *************** 
+// Allocate memory from an arena, data not initialized
+// input: arena from Heap_ArenaCreate, desired number of bytes
+// output: void* pointing to the memory, or NULL if the arena is full
+// notes: constant time, the memory is only returned by Heap_ArenaRelease
+void* Heap_ArenaMalloc(heap_arena_t* arena, int32_t desiredBytes);
+
+
+//******** Heap_ArenaRelease *************** 
+// Free an arena and everything allocated from it, with a single Heap_Free
+// input: arena from Heap_ArenaCreate
+// output: the status of Heap_Free
+int32_t Heap_ArenaRelease(heap_arena_t* arena);
+
+
 #endif //#ifndef HEAP_H
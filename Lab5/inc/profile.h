@@ -0,0 +1,60 @@
+// filename *************************profile.h ************************
+// Statistical PC-sampling profiler
+// Timer4A interrupts at a fixed rate and the PC stacked by the interrupted
+// context is counted in a histogram of address ranges. Kernel code is binned
+// over [_text, _etext) from the linker script; code of a loaded ELF process is
+// binned by its offset from the process text base. Dump the histogram with
+// the interpreter "prof dump" command and map the bins to functions on the
+// host with Lab5/tools/profdecode.c and the linker map or nm output.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+// 0 shrinks both histograms to one bin, which saves 640 bytes of .bss; the
+// target default, build with -DPROFILE_ENABLE=1 to profile
+#ifndef PROFILE_ENABLE
+#define PROFILE_ENABLE 0
+#endif
+#if PROFILE_ENABLE
+#define PROF_BINS      256    // kernel histogram bins
+#define PROF_PROC_BINS 64     // loaded process histogram bins
+#else
+#define PROF_BINS      1      // every kernel sample in one bin
+#define PROF_PROC_BINS 1
+#endif
+#define PROF_PROC_SHIFT 5     // loaded process bin size is 2^PROF_PROC_SHIFT bytes
+
+//******** Profile_Start ***************
+// clear the histogram and start sampling
+// input:  sampling period in 12.5ns units, choose one that is not a multiple
+//         of the periodic threads so samples do not lock to their phase
+//         interrupt priority, 0 also samples the other handlers
+// output: none
+void Profile_Start(unsigned long period, unsigned long priority);
+
+//******** Profile_Stop ***************
+// stop sampling, the histogram is kept for Profile_Dump
+// input:  none
+// output: none
+void Profile_Stop(void);
+
+//******** Profile_Dump ***************
+// print the histogram over UART
+// "prof <samples> <kernel text base> <kernel bin shift>", then one line per
+// non-empty bin: "K <address> <count>" for kernel code,
+// "P <pid> <text base> <offset> <count>" for the loaded process sampled first,
+// and finally "X <count>" for samples outside both ranges (RAM, other processes)
+// all numbers are hex
+// input:  none
+// output: none
+void Profile_Dump(void);
+
+//******** Profile_Sample ***************
+// count one sample, called by Timer4A_Handler in osasm.S
+// input:  stacked PC of the interrupted context
+// output: none
+void Profile_Sample(uint32_t pc);
+
+#endif
@@ -0,0 +1,105 @@
+// filename *************************trace.h ************************
+// Kernel event trace ring
+// Records context switches, ISR entry and exit, semaphore block and wake,
+// OS FIFO put and get, and heap events into a RAM ring that always holds the
+// last TRACE_SIZE events. Each record is 4 bytes with a delta timestamp.
+// Dump it with the interpreter "trace" command and decode it on the host with
+// Lab5/tools/tracedecode.c
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// 0 compiles every TRACE() call out and shrinks the ring to one record, which
+// saves 1 KB of .bss; the target default, build with -DTRACE_ENABLE=1 to trace
+#ifndef TRACE_ENABLE
+#ifdef HOST
+#define TRACE_ENABLE 1
+#else
+#define TRACE_ENABLE 0
+#endif
+#endif
+#if TRACE_ENABLE
+#define TRACE_SIZE   256      // records in the ring, must be a power of 2
+#else
+#define TRACE_SIZE   1        // Trace_Event still works for "trace cost"
+#endif
+#define TRACE_SHIFT  6        // timestamp unit is 2^TRACE_SHIFT bus cycles, 0.8us
+
+// event codes, the meaning of id is given for each
+enum TraceEvent {
+	TRACE_TIME = 0,       // id 0, delta holds bits 31-16 of the next record's delta
+	TRACE_SWITCH,         // thread ID switched to
+	TRACE_ISR_ENTER,      // exception number
+	TRACE_ISR_EXIT,       // exception number
+	TRACE_SEM_BLOCK,      // thread ID that blocked
+	TRACE_SEM_WAKE,       // thread ID woken up
+	TRACE_FIFO_PUT,       // elements in the OS FIFO after the put
+	TRACE_FIFO_GET,       // elements in the OS FIFO after the get
+	TRACE_MALLOC,         // words requested, 255 if more, 0 if the request failed
+	TRACE_FREE,           // 0 if freed, error code otherwise
+	TRACE_USER,           // any value, markers placed by the application
+	TRACE_EVENTNUM
+};
+
+typedef struct TraceRecord {
+	uint8_t event;        // enum TraceEvent
+	uint8_t id;
+	uint16_t delta;       // time since the previous record, in 2^TRACE_SHIFT cycles
+} TraceRecordType;
+
+#if TRACE_ENABLE
+#define TRACE(event, id)  Trace_Event((event), (id))
+#define TRACE_ISR_IN()    Trace_Event(TRACE_ISR_ENTER, Trace_IPSR())
+#define TRACE_ISR_OUT()   Trace_Event(TRACE_ISR_EXIT, Trace_IPSR())
+#else
+#define TRACE(event, id)
+#define TRACE_ISR_IN()
+#define TRACE_ISR_OUT()
+#endif
+
+// exception number of the running handler, 0 in a thread
+#ifdef HOST
+#include "host.h"
+#define Trace_IPSR()      Host_IPSR()
+#else
+static inline uint8_t Trace_IPSR(void) {
+	uint32_t ipsr;
+	__asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
+	return ipsr;
+}
+#endif
+
+//******** Trace_Event ***************
+// append a record to the ring, overwriting the oldest one when full
+// can be called from threads and from the background
+// input:  event code, event argument
+// output: none
+void Trace_Event(uint8_t event, uint8_t id);
+
+//******** Trace_Stop ***************
+// stop recording so the ring can be read without being overwritten
+// input:  none
+// output: none
+void Trace_Stop(void);
+
+//******** Trace_Start ***************
+// resume recording after Trace_Stop
+// input:  none
+// output: none
+void Trace_Start(void);
+
+//******** Trace_Count ***************
+// number of valid records in the ring
+// input:  none
+// output: 0 to TRACE_SIZE
+unsigned long Trace_Count(void);
+
+//******** Trace_Get ***************
+// read a record, call between Trace_Stop and Trace_Start
+// input:  index, 0 is the oldest record
+// output: the record
+TraceRecordType Trace_Get(unsigned long i);
+
+#endif
@@ -11,6 +11,12 @@
 #include "Serial.h"
 #include "ST7735.h"
 #include "heap.h"
+#include "blockpool.h"
+#include "trace.h"
+#include "bench.h"
+#ifdef HOST
+#include "host.h"
+#endif
 
 #define PE0  (*((volatile unsigned long *)0x40024004))
 #define PE1  (*((volatile unsigned long *)0x40024008))
@@ -23,12 +29,16 @@
 #define TIME_250US  (TIME_1MS/5)
 #define OS_PERIOD   TIME_1MS  // period of OS_Timer, in unit of 12.5ns (cycles)
 
-#define STACKSIZE   400      // number of 32-bit words in stack
+#ifndef STACKSIZE
+#define STACKSIZE   384      // number of 32-bit words in stack, cat through FatFs needs about 1.3 KB
+#endif
 
 static unsigned long OS_Timer;	   // in unit of 1ms by default
 
 static tcbType tcbs[NUMTHREADS];
+#ifndef HOST
 static int32_t Stacks[NUMTHREADS][STACKSIZE];
+#endif
 tcbType *RunPt;	  // current running thread
 pcbType *pcbPt;   // current running process
 static uint32_t threadCnt;
@@ -36,6 +46,17 @@ static tcbType *lastThread;
 void * dataPt;      // record the data section pointer for the current running process (in case a addThread (initStack) is called, need to load into R9)
 void StartOS(void);
 static void os_timer_init(void);
+static void serverCharge(void);
+static void serverTick(void);
+static tcbType *serverTcb;
+static unsigned long serverRunStart;
+
+// a process has a thread until it is freed, so there are never more pcbs than threads
+BLOCKPOOL_STORAGE(pcbStorage, pcbType, NUMTHREADS);
+static BlockPoolType pcbPool;
+// text and data placeholders of processes that are not loaded, two per process
+BLOCKPOOL_STORAGE(wordStorage, uint32_t, 2*NUMTHREADS);
+static BlockPoolType wordPool;
 
 
 // ******** OS_Init ************
@@ -50,20 +71,35 @@ void OS_Init(void){
   Serial_Init();
 
   LCD_Init();
-  Heap_Init();
+  if (Heap_Init() != HEAP_OK) {
+    LED_RED_ON();             // too little SRAM after .bss, every malloc fails
+  }
+  BlockPool_Init(&pcbPool, "pcb", pcbStorage, sizeof(pcbType), NUMTHREADS);
+  BlockPool_Init(&wordPool, "word", wordStorage, sizeof(uint32_t), 2*NUMTHREADS);
   os_timer_init();
+  Bench_Init();
 
   NVIC_ST_CTRL_R = 0;         // disable SysTick during setup
   NVIC_ST_CURRENT_R = 0;      // any write to current clears it
   NVIC_SYS_PRI3_R =(NVIC_SYS_PRI3_R&0x00FFFFFF)|0xE0000000; // priority 7
 }
 
+#ifndef HOST
+// a thread function that returns ends up here
+static void threadReturn(void) {
+	OS_Exit(0);
+}
+#endif
+
 // notice R13 (MSP/PSP) not stored in stack
 static void setInitialStack(int i, void (*thread_starting_addr)(void)){
+#ifdef HOST
+  Host_InitStack(i, &tcbs[i].sp, thread_starting_addr);  // a ucontext instead of a register frame
+#else
   tcbs[i].sp = &Stacks[i][STACKSIZE-16]; // thread stack pointer, initially pointing to the bottom (above all registers)
   Stacks[i][STACKSIZE-1] = 0x01000000;   // thumb bit (PSR)
   Stacks[i][STACKSIZE-2] = (int32_t) thread_starting_addr;  // PC
-  Stacks[i][STACKSIZE-3] = 0x14141414;   // R14 (LR)
+  Stacks[i][STACKSIZE-3] = (int32_t) threadReturn;  // R14 (LR), a thread that returns exits with code 0
   Stacks[i][STACKSIZE-4] = 0x12121212;   // R12  SP
   Stacks[i][STACKSIZE-5] = 0x03030303;   // R3
   Stacks[i][STACKSIZE-6] = 0x02020202;   // R2
@@ -77,6 +113,7 @@ static void setInitialStack(int i, void (*thread_starting_addr)(void)){
   Stacks[i][STACKSIZE-14] = 0x06060606;  // R6
   Stacks[i][STACKSIZE-15] = 0x05050505;  // R5
   Stacks[i][STACKSIZE-16] = 0x04040404;  // R4
+#endif
 }
 
 /* Currently, id is used to track the avaliability of a thread slot.
@@ -90,39 +127,63 @@ static int findFreeThreadSlot(void) {
 	return -1;
 }
 
+// text and data are loader blocks on the heap or placeholders from wordPool
+static void freeSegment(void *segment) {
+	if (BlockPool_Free(&wordPool, segment) != BLOCKPOOL_OK)
+		Heap_Free(segment);
+}
+
 static void killProcess(pcbType *pcb) {
+	int pid = pcb->pid;
+	freeSegment(pcb->text);
+	freeSegment(pcb->data);
+	if (pcb->arena)
+		Heap_ArenaRelease(pcb->arena);
+	BlockPool_Free(&pcbPool, pcb);
 	OS_EnableInterrupts();        // better to add this otherwise semaphore inside serial port may cause trouble
-	Serial_println("pid %u freed", pcb->pid);
-	Heap_Free(pcb->text);
-	Heap_Free(pcb->data);
-	Heap_Free(pcb);
+	Serial_println("pid %u freed", pid);
 	OS_DisableInterrupts();
 }
-//******** OS_AddThread ***************
-// add a foregound thread to the scheduler
-// Inputs: pointer to a void-void foreground task
-//         number of bytes allocated for its stack
-//         priority, 0 is highest, 5 is the lowest
-// Outputs: 1 if successful, 0 if this thread can not be added
-// stack size must be divisable by 8 (aligned to double word boundary)
-int OS_AddThread(void(*task)(void), unsigned long stackSize, unsigned long priority) {
-	static int nextID = 0;
+// exit codes of joinable threads that finished before anyone joined them
+// a record is taken when the thread is added, so OS_Exit always has one
+#define EXIT_FREE    0
+#define EXIT_RUNNING 1       // reserved by a joinable thread nobody waits for yet
+#define EXIT_DONE    2       // the thread exited, code holds its exit code
+static struct {
+	int state;
+	int tid;
+	int code;
+} exitRecs[NUMTHREADS];
+
+static int findExitRec(int tid, int state) {
+	for (int i = 0; i < NUMTHREADS; i++) {
+		if (exitRecs[i].state == state && (state == EXIT_FREE || exitRecs[i].tid == tid))
+			return i;
+	}
+	return -1;
+}
+
+// set up a new thread in a free slot, returns its tid or -1 if the table is full
+// or, for a joinable thread, no exit record is free
+static int addThread(void(*task)(void), unsigned long priority, int joinable) {
+	static int nextID = 0;    // never reused, OS_Join relies on it
 	int32_t sr;
+	int rec = -1;
 	sr = StartCritical();
 	int slot = findFreeThreadSlot();
-	if (slot == 0) {
-		tcbs[0].next = &tcbs[0];
-		tcbs[0].prev = &tcbs[0];
-		tcbs[0].tid = nextID++;
-		tcbs[0].state = ACTIVE;
-		tcbs[0].priority = priority;
-		setInitialStack(0, task);
-		lastThread = &tcbs[0];
-		tcbs[0].pcb = pcbPt;
-	}
-	else if (slot == -1)  {
+	if (joinable)
+		rec = findExitRec(0, EXIT_FREE);
+	if (slot == -1 || (joinable && rec == -1))  {
 		EndCritical(sr);
-		return 0;
+		return -1;
+	}
+	if (rec != -1) {
+		exitRecs[rec].state = EXIT_RUNNING;
+		exitRecs[rec].tid = nextID;
+	}
+	if (threadCnt == 0) {
+		tcbs[slot].next = &tcbs[slot];
+		tcbs[slot].prev = &tcbs[slot];
 	}
 	else {
 		// keeping both next and prev helps relinking when a thread dies
@@ -130,18 +191,87 @@ int OS_AddThread(void(*task)(void), unsigned long stackSize, unsigned long prior
 		tcbs[slot].prev = lastThread;
 		lastThread->next->prev = &tcbs[slot];  // last thread's prev is the first thread
 		lastThread->next = &tcbs[slot];
-		lastThread = &tcbs[slot];
-
-		setInitialStack(slot, task);
-		tcbs[slot].tid = nextID++;
-		tcbs[slot].state = ACTIVE;
-		tcbs[slot].priority = priority;
-		tcbs[slot].pcb = pcbPt;
+	}
+	lastThread = &tcbs[slot];
+
+	setInitialStack(slot, task);
+	tcbs[slot].tid = nextID++;
+	tcbs[slot].state = ACTIVE;
+	tcbs[slot].priority = priority;
+	tcbs[slot].pcb = pcbPt;
+	tcbs[slot].joinable = joinable;
+	tcbs[slot].joinTid = -1;
+	for (int i = 0; i < OS_TLS_SLOTS; i++) {
+		tcbs[slot].tls[i] = 0;
 	}
 	threadCnt++;
 	pcbPt->threadNum++;
 	EndCritical(sr);
-	return 1;
+	return tcbs[slot].tid;
+}
+
+//******** OS_AddThread ***************
+// add a foregound thread to the scheduler
+// Inputs: pointer to a void-void foreground task
+//         number of bytes allocated for its stack
+//         priority, 0 is highest, 5 is the lowest
+// Outputs: 1 if successful, 0 if this thread can not be added
+// stack size must be divisable by 8 (aligned to double word boundary)
+int OS_AddThread(void(*task)(void), unsigned long stackSize, unsigned long priority) {
+	return addThread(task, priority, 0) >= 0;
+}
+
+//******** OS_AddJoinableThread ***************
+// add a foregound thread whose exit code can be collected with OS_Join
+// Inputs: pointer to a void-void foreground task
+//         number of bytes allocated for its stack
+//         priority, 0 is highest, 5 is the lowest
+// Outputs: handle (thread ID) to pass to OS_Join, -1 if this thread can not be added
+//          or NUMTHREADS exit codes are already waiting to be joined
+int OS_AddJoinableThread(void(*task)(void), unsigned long stackSize, unsigned long priority) {
+	return addThread(task, priority, 1);
+}
+
+//******** OS_Join ***************
+// wait for a joinable thread to exit
+// Inputs: handle from OS_AddJoinableThread
+//         where to store its exit code, may be 0
+// Outputs: 1 if successful, 0 if there is no such joinable thread
+//          (never created, not joinable, or already joined), or if waiting
+//          would never end (the caller itself, or a thread joining the caller)
+// Each thread can be joined once; its TCB and stack are released when it
+//   exits, not when it is joined, so unjoined threads do not fill the table,
+//   but each keeps one of NUMTHREADS exit records until it is joined
+// Thread IDs are never reused, so the ID of a reaped thread matches neither
+//   an exit record nor the thread now in its TCB
+int OS_Join(int tid, int *exitCode) {
+	if (tid < 0 || tid == RunPt->tid)
+		return 0;
+	OS_DisableInterrupts();
+	int rec = findExitRec(tid, EXIT_DONE);
+	if (rec != -1) {                // already finished
+		exitRecs[rec].state = EXIT_FREE;
+		if (exitCode) *exitCode = exitRecs[rec].code;
+		OS_EnableInterrupts();
+		return 1;
+	}
+	for (int i = 0; i < NUMTHREADS; i++) {
+		if (tcbs[i].state != FREE && tcbs[i].state != DEAD && tcbs[i].tid == tid && tcbs[i].joinable) {
+			if (tcbs[i].joinTid == RunPt->tid)
+				break;                // it waits for us, both would sleep forever
+			tcbs[i].joinable = 0;     // only one joiner
+			rec = findExitRec(tid, EXIT_RUNNING);
+			exitRecs[rec].state = EXIT_FREE;   // the code is handed over directly
+			RunPt->joinTid = tid;
+			RunPt->state = BLOCKED;
+			OS_EnableInterrupts();
+			OS_Suspend();             // OS_Exit of the target fills in exitCode and wakes us
+			if (exitCode) *exitCode = RunPt->exitCode;
+			return 1;
+		}
+	}
+	OS_EnableInterrupts();
+	return 0;
 }
 
 
@@ -151,7 +281,7 @@ int OS_AddThread(void(*task)(void), unsigned long stackSize, unsigned long prior
 int OS_AddProcess(void(*entry)(void), void *text, void *data, unsigned long stackSize, unsigned long priority) {
 	static uint32_t nextID = 0;
 	unsigned long sr = StartCritical();
-	pcbType *newPcb = Heap_Malloc(sizeof(pcbType));
+	pcbType *newPcb = BlockPool_Alloc(&pcbPool);
 	if (!newPcb) {
 		EndCritical(sr);
 		return 0;
@@ -159,11 +289,13 @@ int OS_AddProcess(void(*entry)(void), void *text, void *data, unsigned long stac
 
 	newPcb->pid = nextID;
 	if (text) newPcb->text = text;  		// for OS created processes that do not have text and data on heap
-	else newPcb->text = Heap_Malloc(4);
+	else newPcb->text = BlockPool_Alloc(&wordPool);
 	if (data) newPcb->data = data;
-	else newPcb->data = Heap_Malloc(4);
+	else newPcb->data = BlockPool_Alloc(&wordPool);
 
+	newPcb->loaded = text != 0;
 	newPcb->threadNum = 0;
+	newPcb->arena = 0;
 	dataPt = newPcb->data;
 	pcbType *temp = pcbPt;  // when adding new process, the thread needs to be added to the new process not current running process
 	pcbPt = newPcb;			// therefore create a temporary pcb to store the current running process
@@ -190,7 +322,7 @@ int OS_AddProcess(void(*entry)(void), void *text, void *data, unsigned long stac
 // In Lab 2, you can ignore the theTimeSlice field
 // In Lab 3, you should implement the user-defined TimeSlice field
 // It is ok to limit the range of theTimeSlice to match the 24-bit SysTick
-void OS_Launch(uint32_t theTimeSlice){
+void OS_Launch(unsigned long theTimeSlice){
   NVIC_ST_RELOAD_R = theTimeSlice - 1; // reload value
   NVIC_ST_CTRL_R = 0x00000007; // enable, core clock and interrupt arm
   StartOS();                   // start on the first task. enable processor interrupt
@@ -207,14 +339,18 @@ unsigned long OS_Id(void) {
 // schedules the next thread to run
 // always selects the highest priority (including the current running thread), so may cause starvation
 void threadScheduler(void) {
+	BENCH_BEGIN(BENCH_SWITCH);
 	// deal with initial launch
 	if (RunPt == 0) {
 		RunPt = &tcbs[0];
 	}
+	if (RunPt == serverTcb) {
+		serverCharge();       // may drop the server to its background priority
+	}
 	tcbType * pt = RunPt;
 	tcbType * endPt;  // endPt is the last thread to check in the Linked List
 	// whether this thread is killed
-	if (RunPt->state == FREE) {
+	if (RunPt->state == DEAD) {
 		endPt = RunPt->prev;
 	}
 	else {
@@ -230,9 +366,21 @@ void threadScheduler(void) {
 			bestPt = pt;
 		}
 	} while (pt != endPt);
+	// a killed thread is still running on its stack until this switch,
+	// so its slot only becomes reusable here, with interrupts disabled
+	if (RunPt->state == DEAD) {
+		RunPt->state = FREE;
+	}
+	if (bestPt != RunPt) {
+		TRACE(TRACE_SWITCH, bestPt->tid);
+	}
 	RunPt = bestPt;
+	if (bestPt == serverTcb) {
+		serverRunStart = OS_Time();
+	}
 	pcbPt = bestPt->pcb;  // update the current running process
 	dataPt = bestPt->pcb->data;  // update data section pointer
+	BENCH_END(BENCH_SWITCH);
 }
 
 // ******** OS_Sleep ************
@@ -256,6 +404,9 @@ void threadScheduler(void) {
 void OS_Suspend(void) {
 	NVIC_ST_CURRENT_R = 0; 			// clear current count
 	NVIC_INT_CTRL_R |= 1 << 26;     // sets the PENDSTSET bit, force systick handler
+#ifdef HOST
+	Host_Sync();                    // nothing watches the register, deliver it now
+#endif
 }
 
 // ******** OS_Sleep ************
@@ -279,18 +430,43 @@ void OS_Sleep(unsigned long sleepTime) {
 // input:  none
 // output: none
 void OS_Kill(void) {
+	OS_Exit(0);
+}
+
+// ******** OS_Exit ************
+// kill the currently running thread with an exit code for OS_Join
+// release its TCB and stack
+// input:  exit code
+// output: none
+void OS_Exit(int exitCode) {
 	OS_DisableInterrupts();
+	if (RunPt->joinable) {   // nobody joined yet, keep the exit code in its record
+		int rec = findExitRec(RunPt->tid, EXIT_RUNNING);
+		exitRecs[rec].state = EXIT_DONE;
+		exitRecs[rec].code = exitCode;
+	}
+	else {
+		for (int i = 0; i < NUMTHREADS; i++) {
+			if (tcbs[i].state == BLOCKED && tcbs[i].joinTid == RunPt->tid) {
+				tcbs[i].exitCode = exitCode;
+				tcbs[i].joinTid = -1;
+				tcbs[i].state = ACTIVE;
+			}
+		}
+	}
+	// free process if all threads are killed, while this thread is still ACTIVE:
+	// killProcess prints with its Serial buffer and enables interrupts to do so
+	if (--RunPt->pcb->threadNum == 0) {
+		killProcess(RunPt->pcb);
+	}
+	Serial_ThreadExit();     // nothing prints for this thread any more
 	// update last thread if this is the last thread
 	if (lastThread == RunPt)
 		lastThread = RunPt->prev;
-	RunPt->state = FREE;
+	RunPt->state = DEAD;     // becomes FREE once the scheduler has switched away from it
 	RunPt->prev->next = RunPt->next;
 	RunPt->next->prev = RunPt->prev;
 	threadCnt--;
-	// free process if all threads are killed
-	if (--RunPt->pcb->threadNum == 0) {
-		killProcess(RunPt->pcb);
-	}
 
 	OS_EnableInterrupts();
 	OS_Suspend();
@@ -330,6 +506,7 @@ void Timer3A_Handler(void){
 			}
 		}
 	}
+	serverTick();
 //	  LED_GREEN_OFF();
 }
 
@@ -342,6 +519,9 @@ void Timer3A_Handler(void){
 // It is ok to change the resolution and precision of this function as long as
 //   this function and OS_TimeDifference have the same resolution and precision
 unsigned long OS_Time(void) {
+#ifdef HOST
+	return Host_Time();
+#endif
 	return OS_Timer * OS_PERIOD + (OS_PERIOD - 1 - TIMER3_TAR_R);  // the right part is the elapsed cycles that yet counted into OS_Timer
 }
 // ******** OS_TimeDifference ************
@@ -388,6 +568,53 @@ void OS_InitSemaphore(Sema4Type *semaPt, long value) {
 	semaPt->end = 0;
 }
 
+/*
+ * Uncontended fast paths
+ * value is updated with LDREX/STREX instead of masking interrupts. Any exception
+ * between the LDREX and the STREX clears the exclusive monitor, so the STREX fails
+ * and the update is retried; the slow paths below run with interrupts disabled,
+ * so they can never land inside a fast path window and can keep using plain stores.
+ * Only blocking a thread or waking one up falls back to the slow path.
+ * Set SEMA_FASTPATH to 0 to always take the slow path (for comparison).
+ */
+#define SEMA_FASTPATH 1
+
+#ifdef HOST
+#define ldrex(addr)      Host_Ldrex(addr)
+#define strex(addr, val) Host_Strex(addr, val)
+#define clrex()          Host_Clrex()
+#else
+static inline long ldrex(volatile long *addr) {
+	long val;
+	__asm volatile ("ldrex %0, [%1]" : "=r" (val) : "r" (addr) : "memory");
+	return val;
+}
+
+// returns 0 if the store succeeded
+static inline int strex(volatile long *addr, long val) {
+	int fail;
+	__asm volatile ("strex %0, %2, [%1]" : "=&r" (fail) : "r" (addr), "r" (val) : "memory");
+	return fail;
+}
+
+static inline void clrex(void) {
+	__asm volatile ("clrex" : : : "memory");
+}
+#endif
+
+// decrement *addr if it is greater than zero, returns 1 if it did
+static int semaTake(volatile long *addr) {
+	long val;
+	do {
+		val = ldrex(addr);
+		if (val <= 0) {
+			clrex();
+			return 0;
+		}
+	} while (strex(addr, val - 1));
+	return 1;
+}
+
 /* Wait can only be called by main thread, because suspend (thread switch) only applies to main threads */
 // ******** OS_Wait ************
 // decrement semaphore
@@ -396,17 +623,27 @@ void OS_InitSemaphore(Sema4Type *semaPt, long value) {
 // input:  pointer to a counting semaphore
 // output: none
 void OS_Wait(Sema4Type *semaPt) {
+	BENCH_BEGIN(BENCH_WAIT);
+#if SEMA_FASTPATH
+	if (semaTake(&semaPt->value)) {
+		BENCH_END(BENCH_WAIT);
+		return;
+	}
+#endif
 	OS_DisableInterrupts();
 	semaPt->value = semaPt->value - 1;
 	if (semaPt->value < 0) {
 		RunPt->state = BLOCKED;
 		RunPt->blocked = semaPt;
+		TRACE(TRACE_SEM_BLOCK, RunPt->tid);
 		semaPt->waiters[semaPt->end] = RunPt;  // add to waiters list
 		semaPt->end = (semaPt->end + 1) % NUMTHREADS;
 		OS_EnableInterrupts();
-		OS_Suspend();
+		OS_Suspend();   // blocked time is not a cost of OS_Wait, not recorded
+		return;
 	}
 	OS_EnableInterrupts();
+	BENCH_END(BENCH_WAIT);
 }
 
 // ******** OS_Signal ************
@@ -416,14 +653,51 @@ void OS_Wait(Sema4Type *semaPt) {
 // input:  pointer to a counting semaphore
 // output: none
 void OS_Signal(Sema4Type *semaPt) {
+	BENCH_BEGIN(BENCH_SIGNAL);
+#if SEMA_FASTPATH
+	long val;
+	do {
+		val = ldrex(&semaPt->value);
+		if (val < 0) {      // someone is blocked, needs the slow path to wake it
+			clrex();
+			break;
+		}
+	} while (strex(&semaPt->value, val + 1));
+	if (val >= 0) {
+		BENCH_END(BENCH_SIGNAL);
+		return;
+	}
+#endif
 	unsigned long sr = StartCritical();
-	tcbType *pt = RunPt;
 	semaPt->value = semaPt->value + 1;
 	if (semaPt->value <= 0) {
+		TRACE(TRACE_SEM_WAKE, semaPt->waiters[semaPt->start]->tid);
 		semaPt->waiters[semaPt->start]->state = ACTIVE;		// release the first blocked thread
 		semaPt->start = (semaPt->start + 1) % NUMTHREADS;
 	}
 	EndCritical(sr);
+	BENCH_END(BENCH_SIGNAL);
+}
+
+
+// ******** OS_TryWait ************
+// decrement semaphore only if that would not block
+// input:  pointer to a counting semaphore
+// output: 1 if the semaphore was decremented, 0 if it is not available
+// Can be called from the background
+int OS_TryWait(Sema4Type *semaPt) {
+#if SEMA_FASTPATH
+	return semaTake(&semaPt->value);
+#else
+	int ret = 0;
+	unsigned long sr = StartCritical();
+	if (semaPt->value > 0) {
+		semaPt->value = semaPt->value - 1;
+		ret = 1;
+	}
+	EndCritical(sr);
+	return ret;
+#endif
 }
 
 
@@ -433,17 +707,31 @@ void OS_Signal(Sema4Type *semaPt) {
 // input:  pointer to a binary semaphore
 // output: none
 void OS_bWait(Sema4Type *semaPt) {
+	BENCH_BEGIN(BENCH_WAIT);
+	int blocked = 0;
+#if SEMA_FASTPATH
+	if (semaTake(&semaPt->value)) {   // 1 -> 0
+		BENCH_END(BENCH_WAIT);
+		return;
+	}
+#endif
 	OS_DisableInterrupts();
 	while (semaPt->value == 0) {
+		blocked = 1;
 		RunPt->state = BLOCKED;
 		RunPt->blocked = semaPt;
+		TRACE(TRACE_SEM_BLOCK, RunPt->tid);
 		semaPt->waiters[semaPt->end] = RunPt;  // add to waiters list
 		semaPt->end = (semaPt->end + 1) % NUMTHREADS;
 		OS_EnableInterrupts();
 		OS_Suspend();
+		OS_DisableInterrupts();   // recheck atomically, another thread may have taken it first
 	}
 	semaPt->value = 0;    // write zero back to it, prepared for usage next time
 	OS_EnableInterrupts();
+	if (!blocked) {
+		BENCH_END(BENCH_WAIT);
+	}
 }
 
 // ******** OS_bSignal ************
@@ -452,25 +740,281 @@ void OS_bWait(Sema4Type *semaPt) {
 // input:  pointer to a binary semaphore
 // output: none
 void OS_bSignal(Sema4Type *semaPt) {
-    unsigned long sr = StartCritical();  // why save I bit here?
-    if (semaPt->value == 0) {
+	BENCH_BEGIN(BENCH_SIGNAL);
+#if SEMA_FASTPATH
+	// the wait list is checked inside the exclusive window, so a thread that
+	// blocks after the check makes the STREX fail
+	int waiting;
+	do {
+		ldrex(&semaPt->value);
+		waiting = (semaPt->start != semaPt->end);
+		if (waiting) {
+			clrex();
+			break;
+		}
+	} while (strex(&semaPt->value, 1));
+	if (!waiting) {
+		BENCH_END(BENCH_SIGNAL);
+		return;
+	}
+#endif
+    unsigned long sr = StartCritical();
+    if (semaPt->value == 0 && semaPt->start != semaPt->end) {  // only if someone is actually waiting
+    	TRACE(TRACE_SEM_WAKE, semaPt->waiters[semaPt->start]->tid);
     	semaPt->waiters[semaPt->start]->state = ACTIVE;		// release the first blocked thread
     	semaPt->start = (semaPt->start + 1) % NUMTHREADS;
     }
 	semaPt->value = 1;
     EndCritical(sr);
+	BENCH_END(BENCH_SIGNAL);
+}
+
+// ******** OS_InitRWLock ************
+// initialize a reader-writer lock, unlocked with no waiters
+// input:  pointer to the lock
+// output: none
+void OS_InitRWLock(RWLockType *rwPt) {
+	rwPt->readers = 0;
+	rwPt->writer = 0;
+	rwPt->handoff = 0;
+	rwPt->waitNum = 0;
+}
+
+// whether a writer at least as important as priority is waiting
+static int rwWriterWaiting(RWLockType *rwPt, int32_t priority) {
+	for (int i = 0; i < rwPt->waitNum; i++) {
+		if (rwPt->waitWrite[i] && rwPt->waiters[i]->priority <= priority)
+			return 1;
+	}
+	return 0;
+}
+
+// put the running thread on the wait list, interrupts must be disabled
+static void rwBlock(RWLockType *rwPt, int write) {
+	RunPt->state = BLOCKED;
+	RunPt->blocked = rwPt;
+	TRACE(TRACE_SEM_BLOCK, RunPt->tid);
+	rwPt->waiters[rwPt->waitNum] = RunPt;
+	rwPt->waitWrite[rwPt->waitNum] = write;
+	rwPt->waitNum++;
+}
+
+// make waiter i runnable and take it off the wait list
+static void rwWakeOne(RWLockType *rwPt, int i) {
+	TRACE(TRACE_SEM_WAKE, rwPt->waiters[i]->tid);
+	rwPt->waiters[i]->state = ACTIVE;
+	rwPt->waitNum--;
+	rwPt->waiters[i] = rwPt->waiters[rwPt->waitNum];
+	rwPt->waitWrite[i] = rwPt->waitWrite[rwPt->waitNum];
+}
+
+/*
+ * Called when the lock may have become available, interrupts must be disabled.
+ * The highest priority waiting writer goes next, unless some waiting readers have
+ * strictly higher priority than it, in which case all of those readers go in together.
+ * Woken readers recheck the lock themselves. A woken writer is given the lock
+ * here, so the releasing thread can not take it back before the writer runs.
+ * Returns the best priority woken, 255 if none.
+ */
+static int32_t rwWake(RWLockType *rwPt) {
+	int32_t wokenPri = 255;
+	int best = -1;
+	int readersWoken = 0;
+	for (int i = 0; i < rwPt->waitNum; i++) {
+		if (rwPt->waitWrite[i] &&
+				(best < 0 || rwPt->waiters[i]->priority < rwPt->waiters[best]->priority))
+			best = i;
+	}
+	int32_t writerPri = (best < 0) ? 255 : rwPt->waiters[best]->priority;
+	for (int i = rwPt->waitNum - 1; i >= 0; i--) {   // backwards, wakeOne moves the last entry into i
+		if (!rwPt->waitWrite[i] && rwPt->waiters[i]->priority < writerPri) {
+			if (best == rwPt->waitNum - 1) best = i;      // the writer is about to be moved into i
+			if (rwPt->waiters[i]->priority < wokenPri) wokenPri = rwPt->waiters[i]->priority;
+			rwWakeOne(rwPt, i);
+			readersWoken++;
+		}
+	}
+	if (!readersWoken && best >= 0 && rwPt->readers == 0 && !rwPt->writer) {
+		rwPt->writer = 1;
+		rwPt->handoff = rwPt->waiters[best];
+		wokenPri = writerPri;
+		rwWakeOne(rwPt, best);
+	}
+	return wokenPri;
+}
+
+// run a woken waiter that outranks the caller now, interrupts must be disabled
+static void rwYield(int32_t wokenPri) {
+	OS_EnableInterrupts();
+	if (wokenPri < RunPt->priority) {
+		OS_Suspend();
+	}
+}
+
+// ******** OS_ReadLock ************
+// acquire the lock for reading, shared with other readers
+// blocks while a writer holds the lock, or while a writer of equal
+// or higher priority is waiting (writer preference)
+// input:  pointer to the lock
+// output: none
+void OS_ReadLock(RWLockType *rwPt) {
+	OS_DisableInterrupts();
+	while (rwPt->writer || rwWriterWaiting(rwPt, RunPt->priority)) {
+		rwBlock(rwPt, 0);
+		OS_EnableInterrupts();
+		OS_Suspend();
+		OS_DisableInterrupts();
+	}
+	rwPt->readers++;
+	OS_EnableInterrupts();
+}
+
+// ******** OS_ReadUnlock ************
+// release a lock acquired with OS_ReadLock
+// input:  pointer to the lock
+// output: none
+void OS_ReadUnlock(RWLockType *rwPt) {
+	int32_t wokenPri = 255;
+	OS_DisableInterrupts();
+	if (--rwPt->readers == 0) {
+		wokenPri = rwWake(rwPt);
+	}
+	rwYield(wokenPri);
+}
+
+// ******** OS_WriteLock ************
+// acquire the lock for writing, exclusive of readers and other writers
+// input:  pointer to the lock
+// output: none
+void OS_WriteLock(RWLockType *rwPt) {
+	OS_DisableInterrupts();
+	while (rwPt->writer || rwPt->readers) {
+		rwBlock(rwPt, 1);
+		OS_EnableInterrupts();
+		OS_Suspend();
+		OS_DisableInterrupts();
+		if (rwPt->handoff == RunPt) {   // rwWake already set writer for us
+			rwPt->handoff = 0;
+			break;
+		}
+	}
+	rwPt->writer = 1;
+	OS_EnableInterrupts();
+}
+
+// ******** OS_WriteUnlock ************
+// release a lock acquired with OS_WriteLock
+// input:  pointer to the lock
+// output: none
+void OS_WriteUnlock(RWLockType *rwPt) {
+	OS_DisableInterrupts();
+	rwPt->writer = 0;
+	rwYield(rwWake(rwPt));
+}
+
+// ******** OS_MBox_Init ************
+// Initialize a mailbox with slots messages of size bytes each
+// Inputs:  pointer to the mailbox
+//          storage for slots*size bytes, owned by the mailbox from now on
+//          size of one message in bytes, 1 to MBOX_MAXSIZE
+//          number of messages the mailbox can hold before Send blocks
+// Outputs: 1 if successful, 0 if the size or the number of slots is invalid
+int OS_MBox_Init(MBoxType *mbPt, void *buf, unsigned long size, unsigned long slots) {
+	if (size == 0 || size > MBOX_MAXSIZE || slots == 0) {
+		slots = 0;             // Send blocks and TrySend fails for good
+	}
+	mbPt->buf = buf;
+	mbPt->size = size;
+	mbPt->slots = slots;
+	mbPt->putI = mbPt->getI = 0;
+	OS_InitSemaphore(&mbPt->dataValid, 0);      // number of slots holding mail not yet received
+	OS_InitSemaphore(&mbPt->boxFree, slots);    // number of empty slots
+	return slots != 0;
+}
+
+/*
+ * The copy is done with interrupts disabled so that several senders (or receivers)
+ * never interleave inside one slot, and so that the try versions can be used from
+ * an ISR. OS_MBox_Init caps messages at MBOX_MAXSIZE bytes, which bounds the copy
+ * and so the interrupt latency it adds.
+ */
+static void mboxPut(MBoxType *mbPt, const void *msg) {
+	unsigned long sr = StartCritical();
+	uint8_t *dst = mbPt->buf + mbPt->putI * mbPt->size;
+	const uint8_t *src = msg;
+	for (unsigned long i = 0; i < mbPt->size; i++) {
+		dst[i] = src[i];
+	}
+	if (++mbPt->putI == mbPt->slots) mbPt->putI = 0;
+	EndCritical(sr);
+	OS_Signal(&mbPt->dataValid);
+}
+
+static void mboxGet(MBoxType *mbPt, void *msg) {
+	unsigned long sr = StartCritical();
+	const uint8_t *src = mbPt->buf + mbPt->getI * mbPt->size;
+	uint8_t *dst = msg;
+	for (unsigned long i = 0; i < mbPt->size; i++) {
+		dst[i] = src[i];
+	}
+	if (++mbPt->getI == mbPt->slots) mbPt->getI = 0;
+	EndCritical(sr);
+	OS_Signal(&mbPt->boxFree);
+}
+
+// ******** OS_MBox_Send ************
+// enter one message into the mailbox
+// Inputs:  pointer to the mailbox, pointer to the message (size bytes)
+// Outputs: none
+// This function will be called from a foreground thread
+// It will block if every slot contains mail not yet received
+void OS_MBox_Send(MBoxType *mbPt, const void *msg) {
+	OS_Wait(&mbPt->boxFree);
+	mboxPut(mbPt, msg);
 }
 
-static unsigned long mailbox;
-static Sema4Type mb_DataValid;
-static Sema4Type mb_BoxFree;
+// ******** OS_MBox_Recv ************
+// remove the oldest message from the mailbox
+// Inputs:  pointer to the mailbox, buffer for the message (size bytes)
+// Outputs: none
+// This function will be called from a foreground thread
+// It will block if the mailbox is empty
+void OS_MBox_Recv(MBoxType *mbPt, void *msg) {
+	OS_Wait(&mbPt->dataValid);
+	mboxGet(mbPt, msg);
+}
+
+// ******** OS_MBox_TrySend ************
+// enter one message into the mailbox if there is room, never waits
+// Inputs:  pointer to the mailbox, pointer to the message (size bytes)
+// Outputs: 1 if sent, 0 if the mailbox is full
+// Can be called from the background
+int OS_MBox_TrySend(MBoxType *mbPt, const void *msg) {
+	if (!OS_TryWait(&mbPt->boxFree)) return 0;
+	mboxPut(mbPt, msg);
+	return 1;
+}
+
+// ******** OS_MBox_TryRecv ************
+// remove the oldest message from the mailbox if there is one, never waits
+// Inputs:  pointer to the mailbox, buffer for the message (size bytes)
+// Outputs: 1 if a message was received, 0 if the mailbox is empty
+// Can be called from the background
+int OS_MBox_TryRecv(MBoxType *mbPt, void *msg) {
+	if (!OS_TryWait(&mbPt->dataValid)) return 0;
+	mboxGet(mbPt, msg);
+	return 1;
+}
+
+// the original single word mailbox is a one slot instance
+static unsigned long mailboxBuf;
+static MBoxType mailbox;
 // ******** OS_MailBox_Init ************
 // Initialize communication channel
 // Inputs:  none
 // Outputs: none
 void OS_MailBox_Init(void) {
-	OS_InitSemaphore(&mb_DataValid, 0);  // initialized to zero meaning the MailBox is empty. When DataValid equals one it means the mailbox has data in it placed by Consumer that has not been read by the Display.
-	OS_InitSemaphore(&mb_BoxFree, 1);    // initialized to one meaning the MailBox is free. When BoxFree equals zero it means the mailbox contains data that has not yet been received
+	OS_MBox_Init(&mailbox, &mailboxBuf, sizeof(mailboxBuf), 1);
 }
 
 // ******** OS_MailBox_Send ************
@@ -480,9 +1024,7 @@ void OS_MailBox_Init(void) {
 // This function will be called from a foreground thread
 // It will spin/block if the MailBox contains data not yet received
 void OS_MailBox_Send(unsigned long data) {
-	OS_bWait(&mb_BoxFree);  // wait until mailbox is free, then mark it full
-	mailbox = data;
-	OS_bSignal(&mb_DataValid);  // signal that mailbox is filled
+	OS_MBox_Send(&mailbox, &data);
 }
 
 // ******** OS_MailBox_Recv ************
@@ -493,17 +1035,17 @@ void OS_MailBox_Send(unsigned long data) {
 // It will spin/block if the MailBox is empty
 unsigned long OS_MailBox_Recv(void) {
 	unsigned long ret;
-	OS_bWait(&mb_DataValid);  // wait until mailbox data is filled
-	ret = mailbox;
-	OS_bSignal(&mb_BoxFree);  // signal that mailbox is now free
+	OS_MBox_Recv(&mailbox, &ret);
 	return ret;
 }
 
-#define OS_FIFO_SIZE 16
-volatile uint32_t *getPt;
-volatile uint32_t *putPt;
+#define OS_FIFO_SIZE 32      // must be a power of 2
+static volatile unsigned long ff_PutI;  // put next, only written by the producer
+static volatile unsigned long ff_GetI;  // get next, only written by the consumer
 static uint32_t fifo[OS_FIFO_SIZE];
-static Sema4Type ff_DataNum;
+static unsigned long ff_Watermark;      // number of elements needed to wake the consumer
+static volatile int ff_Flush;           // set by OS_Fifo_Flush, the consumer takes what there is
+static Sema4Type ff_DataReady;          // signaled when the Fifo reaches the watermark
 //static Sema4Type ff_mutex;		// mutex not needed, because only one consumer
 
 // ******** OS_Fifo_Init ************
@@ -516,8 +1058,44 @@ static Sema4Type ff_DataNum;
 //    e.g., 4 to 64 elements
 //    e.g., must be a power of 2,4,8,16,32,64,128
 void OS_Fifo_Init(unsigned long size) {
-	putPt = getPt = &fifo[0];
-	OS_InitSemaphore(&ff_DataNum, 0);
+	ff_PutI = ff_GetI = 0;
+	ff_Watermark = 1;       // by default wake the consumer on every sample
+	ff_Flush = 0;
+	OS_InitSemaphore(&ff_DataReady, 0);
+}
+
+// ******** OS_Fifo_SetWatermark ************
+// Set the number of elements that must be in the Fifo
+// before a blocked consumer is woken up
+// Inputs:  watermark, 1 to OS_FIFO_SIZE (1 wakes on every sample)
+// Outputs: none
+void OS_Fifo_SetWatermark(unsigned long level) {
+	if (level < 1) level = 1;
+	if (level > OS_FIFO_SIZE) level = OS_FIFO_SIZE;
+	ff_Watermark = level;
+}
+
+// wake the consumer blocked on ff_DataReady, and switch to it right after
+// the calling handler returns if it outranks the interrupted thread
+static void fifoWake(void) {
+	tcbType *consumer = 0;
+	unsigned long sr = StartCritical();
+	if (ff_DataReady.start != ff_DataReady.end)
+		consumer = ff_DataReady.waiters[ff_DataReady.start];
+	EndCritical(sr);
+	OS_bSignal(&ff_DataReady);
+	if (consumer && consumer->priority < RunPt->priority)
+		OS_Suspend();
+}
+
+// ******** OS_Fifo_Flush ************
+// Wake a consumer blocked below the watermark with whatever the Fifo holds
+// Called from the background by the producer when it stops short
+// Inputs:  none
+// Outputs: none
+void OS_Fifo_Flush(void) {
+	ff_Flush = 1;
+	fifoWake();
 }
 
 // ******** OS_Fifo_Put ************
@@ -529,24 +1107,39 @@ void OS_Fifo_Init(unsigned long size) {
 // Since this is called by interrupt handlers
 //  this function can not disable or enable interrupts
 int OS_Fifo_Put(unsigned long data) {
+	return OS_Fifo_PutN(&data, 1);
+}
+
+// ******** OS_Fifo_PutN ************
+// Enter up to n data samples into the Fifo in one operation
+// Called from the background, so no waiting
+// Inputs:  pointer to the samples, number of samples
+// Outputs: number of samples saved, less than n if the Fifo became full
+// Since this is called by interrupt handlers
+//  this function can not disable or enable interrupts
+int OS_Fifo_PutN(const unsigned long *data, unsigned long n) {
 	// only one background producer thread, no critical section
 	/*
-	 * Notice here, cannot just use semaphore.value to check whether it's full or not
-	 * because in Get, DataNum may be decremented, then it's switched out or interrupted by Put
-	 * before the data is actually recorded. Thus we need to make sure FIFO is never full
+	 * The consumer only ever moves ff_GetI forward, so the room computed here
+	 * can only be too small, never too big. ff_PutI is published once after
+	 * all the samples are copied, so the consumer never sees a half written batch.
 	 */
-	uint32_t volatile *nextPutPt;
-	nextPutPt = putPt+1;
-	if(nextPutPt == &fifo[OS_FIFO_SIZE]){
-		nextPutPt = &fifo[0];  // wrap
+	BENCH_BEGIN(BENCH_FIFO_PUT);
+	unsigned long putI = ff_PutI;
+	unsigned long room = OS_FIFO_SIZE - (putI - ff_GetI);
+	if (n > room) {
+		n = room;      // Fifo full, cannot wait here (in ISR)
 	}
-	if(nextPutPt == getPt){
-		return 0;      // Failed, fifo full; Since cannot wait here (in ISR)
+	for (unsigned long i = 0; i < n; i++) {
+		fifo[(putI + i) & (OS_FIFO_SIZE - 1)] = data[i];
 	}
-	*putPt = data;
-	putPt = nextPutPt;
-	OS_Signal(&ff_DataNum);		// increment current data number
-	return 1;
+	ff_PutI = putI + n;
+	TRACE(TRACE_FIFO_PUT, ff_PutI - ff_GetI);
+	if (n && (ff_PutI - ff_GetI) >= ff_Watermark) {
+		fifoWake();   // wake the consumer only once the watermark is reached
+	}
+	BENCH_END(BENCH_FIFO_PUT);
+	return n;
 }
 
 // ******** OS_Fifo_Get ************
@@ -555,17 +1148,39 @@ int OS_Fifo_Put(unsigned long data) {
 // Inputs:  none
 // Outputs: data
 unsigned long OS_Fifo_Get(void) {
-	OS_Wait(&ff_DataNum);	    // decrement current data number; if empty, spin or block
-								// wait until other consumer thread finishes, then lock
-	unsigned long data = *getPt;
-	OS_DisableInterrupts();     // make the getPt increment process atomic
-	getPt++;
-	if (getPt == &fifo[OS_FIFO_SIZE])
-		getPt = &fifo[0];
-	OS_EnableInterrupts();
+	unsigned long data;
+	OS_Fifo_GetN(&data, 1);
 	return data;
 }
 
+// ******** OS_Fifo_GetN ************
+// Remove up to n data samples from the Fifo in one operation
+// Called in foreground, returns right away if data is available,
+// otherwise blocks until the watermark is reached or OS_Fifo_Flush
+// Inputs:  buffer for the samples, maximum number of samples
+// Outputs: number of samples removed, 1 to n
+unsigned long OS_Fifo_GetN(unsigned long *data, unsigned long n) {
+	unsigned long need = (n < ff_Watermark) ? n : ff_Watermark;
+	unsigned long count;
+	if (n == 0) return 0;
+	// a stale signal from an earlier batch only costs one more pass of this loop
+	while ((ff_PutI - ff_GetI) < need && !(ff_Flush && ff_PutI != ff_GetI)) {
+		OS_bWait(&ff_DataReady);
+	}
+	ff_Flush = 0;                     // a flush after this point is seen by the next call
+	BENCH_BEGIN(BENCH_FIFO_GET);      // data is available, waiting is not counted
+	unsigned long getI = ff_GetI;
+	count = ff_PutI - getI;        // can only grow underneath us
+	if (count > n) count = n;
+	for (unsigned long i = 0; i < count; i++) {
+		data[i] = fifo[(getI + i) & (OS_FIFO_SIZE - 1)];
+	}
+	ff_GetI = getI + count;        // single store, atomic with respect to the producer
+	TRACE(TRACE_FIFO_GET, ff_PutI - ff_GetI);
+	BENCH_END(BENCH_FIFO_GET);
+	return count;
+}
+
 // ******** OS_Fifo_Size ************
 // Check the status of the Fifo
 // Inputs: none
@@ -574,10 +1189,404 @@ unsigned long OS_Fifo_Get(void) {
 //          zero or less than zero if the Fifo is empty
 //          zero or less than zero if a call to OS_Fifo_Get will spin or block
 long OS_Fifo_Size(void) {
-	if(putPt < getPt){
-		return ((unsigned short)(putPt-getPt+(OS_FIFO_SIZE*sizeof(uint32_t)))/sizeof(uint32_t));
+	return (long)(ff_PutI - ff_GetI);
+}
+
+
+// ******** OS_Topic_Init ************
+// Initialize a topic with no samples and no queued subscribers
+// Inputs:  pointer to the topic
+// Outputs: none
+void OS_Topic_Init(TopicType *topicPt) {
+	topicPt->seq = 0;
+	topicPt->subNum = 0;
+}
+
+// ******** OS_Topic_Subscribe ************
+// Attach a queued subscriber, it receives its own copy of every sample
+// published from now on
+// Inputs:  pointer to the topic, pointer to the subscriber
+// Outputs: 1 if successful, 0 if the topic already has TOPIC_MAXSUBS subscribers
+// Readers that only need the latest value do not need to subscribe
+int OS_Topic_Subscribe(TopicType *topicPt, TopicSubType *subPt) {
+	int ret = 0;
+	subPt->putI = subPt->getI = 0;
+	subPt->lost = 0;
+	OS_InitSemaphore(&subPt->dataNum, 0);
+	unsigned long sr = StartCritical();
+	if (topicPt->subNum < TOPIC_MAXSUBS) {
+		topicPt->subs[topicPt->subNum++] = subPt;
+		ret = 1;
+	}
+	EndCritical(sr);
+	return ret;
+}
+
+// ******** OS_Topic_Publish ************
+// Publish one sample to every reader of the topic
+// Called from the background by the only producer of this topic, so no waiting
+// Inputs:  pointer to the topic, data
+// Outputs: none
+// A queued subscriber that has fallen TOPIC_QUEUESIZE samples behind
+//   misses this sample, counted in its lost field
+void OS_Topic_Publish(TopicType *topicPt, unsigned long data) {
+	unsigned long time = OS_Time();
+	// seqlock: odd while the sample is being written, readers retry
+	topicPt->seq++;
+	topicPt->sample.data = data;
+	topicPt->sample.time = time;
+	topicPt->seq++;
+	for (int i = 0; i < topicPt->subNum; i++) {
+		TopicSubType *subPt = topicPt->subs[i];
+		if ((subPt->putI - subPt->getI) >= TOPIC_QUEUESIZE) {
+			subPt->lost++;
+			continue;
+		}
+		TopicSampleType *slot = &subPt->queue[subPt->putI & (TOPIC_QUEUESIZE - 1)];
+		slot->data = data;
+		slot->time = time;
+		subPt->putI++;
+		OS_Signal(&subPt->dataNum);
+	}
+}
+
+// ******** OS_Topic_Latest ************
+// Read the most recent sample without ever blocking the producer
+// Inputs:  pointer to the topic, where to store the sample
+// Outputs: sequence number of the sample, 0 if nothing published yet
+//          compare with the previous return value to detect a new sample
+unsigned long OS_Topic_Latest(TopicType *topicPt, TopicSampleType *samplePt) {
+	unsigned long seq;
+	do {
+		seq = topicPt->seq;
+		samplePt->data = topicPt->sample.data;
+		samplePt->time = topicPt->sample.time;
+	} while ((seq & 1) || seq != topicPt->seq);  // producer wrote in between, try again
+	return seq / 2;
+}
+
+// ******** OS_Topic_Read ************
+// Remove the oldest queued sample of a subscriber
+// Called in foreground by the owner of the subscriber, will block if empty
+// Inputs:  pointer to the subscriber, where to store the sample
+// Outputs: none
+void OS_Topic_Read(TopicSubType *subPt, TopicSampleType *samplePt) {
+	OS_Wait(&subPt->dataNum);
+	*samplePt = subPt->queue[subPt->getI & (TOPIC_QUEUESIZE - 1)];
+	subPt->getI++;
+}
+
+// ******** OS_Topic_TryRead ************
+// Remove the oldest queued sample of a subscriber if there is one, never waits
+// Inputs:  pointer to the subscriber, where to store the sample
+// Outputs: 1 if a sample was read, 0 if the queue is empty
+int OS_Topic_TryRead(TopicSubType *subPt, TopicSampleType *samplePt) {
+	if (!OS_TryWait(&subPt->dataNum)) return 0;
+	*samplePt = subPt->queue[subPt->getI & (TOPIC_QUEUESIZE - 1)];
+	subPt->getI++;
+	return 1;
+}
+
+
+#define POOL_QUEUE_SIZE 8     // must be a power of 2
+static struct {
+	void (*fn)(void *);
+	void *arg;
+	unsigned long submitTime;    // OS_Time when it was queued
+} poolJobs[POOL_QUEUE_SIZE];
+static unsigned long poolPutI;
+static unsigned long poolGetI;
+static Sema4Type poolJobNum;
+static PoolStatsType poolStats;
+
+static void poolWorker(void) {
+	void (*fn)(void *);
+	void *arg;
+	while (1) {
+		OS_Wait(&poolJobNum);
+		unsigned long sr = StartCritical();   // several workers take jobs
+		unsigned long i = poolGetI++ & (POOL_QUEUE_SIZE - 1);
+		fn = poolJobs[i].fn;
+		arg = poolJobs[i].arg;
+		unsigned long wait = OS_TimeDifference(poolJobs[i].submitTime, OS_Time());
+		poolStats.jobsRun++;
+		poolStats.totalWait += wait;
+		if (wait > poolStats.maxWait)
+			poolStats.maxWait = wait;
+		EndCritical(sr);
+		fn(arg);
+	}
+}
+
+// ******** OS_Pool_Init ************
+// Create the worker threads that run jobs passed to OS_Pool_Submit
+// Inputs:  number of worker threads, priority of the workers
+// Outputs: number of workers actually created
+// Call once, from main before OS_Launch or from a thread
+int OS_Pool_Init(unsigned long workers, unsigned long priority) {
+	int created = 0;
+	poolPutI = poolGetI = 0;
+	poolStats.jobsRun = poolStats.jobsRejected = 0;
+	poolStats.totalWait = poolStats.maxWait = 0;
+	OS_InitSemaphore(&poolJobNum, 0);
+	for (unsigned long i = 0; i < workers; i++) {
+		created += OS_AddProcess(&poolWorker, 0, 0, 128, priority);
 	}
-	return ((unsigned short)(putPt-getPt)/sizeof(uint32_t));
+	return created;
+}
+
+// ******** OS_Pool_Submit ************
+// Queue a job for the next free worker thread
+// Can be called from threads and from the background, never waits
+// Inputs:  function to run, argument passed to it
+// Outputs: 1 if queued, 0 if POOL_QUEUE_SIZE jobs are already waiting
+// The job runs to completion on a worker, it can sleep or block, but must return
+int OS_Pool_Submit(void (*fn)(void *), void *arg) {
+	unsigned long sr = StartCritical();   // several producers, threads and ISRs
+	if (poolPutI - poolGetI >= POOL_QUEUE_SIZE) {
+		poolStats.jobsRejected++;
+		EndCritical(sr);
+		return 0;
+	}
+	unsigned long i = poolPutI++ & (POOL_QUEUE_SIZE - 1);
+	poolJobs[i].fn = fn;
+	poolJobs[i].arg = arg;
+	poolJobs[i].submitTime = OS_Time();
+	EndCritical(sr);
+	OS_Signal(&poolJobNum);
+	return 1;
+}
+
+// ******** OS_Pool_Stats ************
+// How long jobs have waited in the queue before a worker picked them up
+// Inputs:  none
+// Outputs: copy of the pool statistics, wait times in 12.5ns units
+PoolStatsType OS_Pool_Stats(void) {
+	unsigned long sr = StartCritical();
+	PoolStatsType stats = poolStats;
+	EndCritical(sr);
+	return stats;
+}
+
+
+/*
+ * Process arenas, see OS_Arena_Init
+ */
+int OS_Arena_Init(unsigned long bytes) {
+	pcbType *pcb = RunPt->pcb;
+	unsigned long sr = StartCritical();   // two threads of one process may race
+	if (pcb->arena == 0)
+		pcb->arena = Heap_ArenaCreate(bytes);
+	else
+		bytes = 0;
+	EndCritical(sr);
+	return bytes && pcb->arena;
+}
+
+void *OS_Arena_Malloc(unsigned long bytes) {
+	heap_arena_t *arena = RunPt->pcb->arena;
+	if (arena == 0)
+		return 0;
+	return Heap_ArenaMalloc(arena, bytes);
+}
+
+
+/*
+ *	Sporadic server for aperiodic jobs
+ *	The server thread runs jobs at serverPriority while it has budget left. Time it
+ *	spends at that priority is charged when it is switched out and on every
+ *	OS_Timer tick; when the budget runs out it drops to serverLowPriority until a
+ *	replenishment arrives. The time consumed during an active period is given back
+ *	serverPeriod ms after the period began (sporadic server rule), so in any window
+ *	of serverPeriod ms the server takes at most budget + 1ms (tick granularity)
+ *	from lower priority threads.
+ */
+#define SERVER_QUEUE_SIZE   8     // must be a power of 2
+#define SERVER_REPLENISH_NUM 8    // must be a power of 2
+static struct {
+	void (*fn)(void *);
+	void *arg;
+	unsigned long submitTime;    // OS_Time when it was queued
+} serverJobs[SERVER_QUEUE_SIZE];
+static unsigned long serverPutI;
+static unsigned long serverGetI;
+static Sema4Type serverJobNum;
+static struct {
+	unsigned long time;          // OS_Timer value when the amount is given back
+	unsigned long amount;        // in 12.5ns units
+} serverRepl[SERVER_REPLENISH_NUM];
+static unsigned long serverReplPutI;
+static unsigned long serverReplGetI;
+static unsigned long serverBudget;        // full budget, 12.5ns units
+static unsigned long serverLeft;          // budget left, 12.5ns units
+static unsigned long serverPeriod;        // replenishment period, ms
+static unsigned long serverPriority;
+static unsigned long serverLowPriority;
+static int serverActive;                  // consuming budget since serverActivation
+static unsigned long serverActivation;    // OS_Timer when the active period began
+static unsigned long serverUsed;          // consumed during the active period
+static ServerStatsType serverStats;
+static int serverReady;                   // OS_Server_Init created the thread
+
+// schedule the return of the budget used in the current active period
+// called with interrupts disabled
+static void serverReplenish(void) {
+	if (serverUsed) {
+		if (serverReplPutI - serverReplGetI < SERVER_REPLENISH_NUM) {
+			unsigned long i = serverReplPutI++ & (SERVER_REPLENISH_NUM - 1);
+			serverRepl[i].time = serverActivation + serverPeriod;
+			serverRepl[i].amount = serverUsed;
+		} else {
+			// queue full, merge into the latest entry, which only returns it later
+			serverRepl[(serverReplPutI - 1) & (SERVER_REPLENISH_NUM - 1)].amount += serverUsed;
+		}
+	}
+	serverUsed = 0;
+	serverActive = 0;
+}
+
+// charge the running server for the time since serverRunStart
+// called with interrupts disabled, from the scheduler and the OS_Timer tick
+static void serverCharge(void) {
+	unsigned long now = OS_Time();
+	if (serverTcb->priority == serverPriority) {
+		unsigned long used = OS_TimeDifference(serverRunStart, now);
+		if (!serverActive) {
+			serverActive = 1;
+			serverActivation = OS_Timer;   // no earlier than the real start, so never early
+		}
+		serverUsed += used;
+		if (used >= serverLeft) {
+			serverLeft = 0;
+			serverTcb->priority = serverLowPriority;
+			serverStats.exhaustions++;
+			serverReplenish();
+		} else {
+			serverLeft -= used;
+		}
+	}
+	serverRunStart = now;
+}
+
+// runs every OS_Timer tick from Timer3A_Handler
+static void serverTick(void) {
+	int reschedule = 0;
+	if (serverTcb == 0)
+		return;
+	if (RunPt == serverTcb && serverTcb->priority == serverPriority) {
+		serverCharge();
+		reschedule = serverTcb->priority != serverPriority;
+	}
+	while (serverReplPutI != serverReplGetI) {
+		unsigned long i = serverReplGetI & (SERVER_REPLENISH_NUM - 1);
+		if ((long)(OS_Timer - serverRepl[i].time) < 0)
+			break;
+		serverLeft += serverRepl[i].amount;
+		if (serverLeft > serverBudget)
+			serverLeft = serverBudget;
+		serverReplGetI++;
+		if (serverTcb->priority != serverPriority) {
+			serverTcb->priority = serverPriority;
+			serverRunStart = OS_Time();
+			reschedule = 1;
+		}
+	}
+	if (reschedule) {
+		NVIC_INT_CTRL_R |= 1 << 26;     // sets the PENDSTSET bit, force systick handler
+	}
+}
+
+static void serverThread(void) {
+	void (*fn)(void *);
+	void *arg;
+	unsigned long submitTime;
+	long sr = StartCritical();
+	serverTcb = RunPt;
+	serverRunStart = OS_Time();
+	EndCritical(sr);
+	while (1) {
+		if (OS_TryWait(&serverJobNum) == 0) {
+			// going idle, the active period ends here
+			sr = StartCritical();
+			serverCharge();
+			serverReplenish();
+			EndCritical(sr);
+			OS_Wait(&serverJobNum);
+		}
+		sr = StartCritical();
+		unsigned long i = serverGetI++ & (SERVER_QUEUE_SIZE - 1);
+		fn = serverJobs[i].fn;
+		arg = serverJobs[i].arg;
+		submitTime = serverJobs[i].submitTime;
+		EndCritical(sr);
+		fn(arg);
+		unsigned long response = OS_TimeDifference(submitTime, OS_Time());
+		sr = StartCritical();
+		serverStats.jobsRun++;
+		serverStats.totalResponse += response;
+		if (response > serverStats.maxResponse)
+			serverStats.maxResponse = response;
+		EndCritical(sr);
+	}
+}
+
+// ******** OS_Server_Init ************
+// Create the sporadic server thread that runs jobs passed to OS_Server_Submit
+// Inputs:  budget in 12.5ns units, replenishment period in ms,
+//          priority while budget is left, priority once it is exhausted
+// Outputs: 1 if successful, 0 if the thread could not be created
+// Call once, from main before OS_Launch or from a thread
+int OS_Server_Init(unsigned long budget, unsigned long period,
+		unsigned long priority, unsigned long lowPriority) {
+	serverPutI = serverGetI = 0;
+	serverReplPutI = serverReplGetI = 0;
+	serverBudget = serverLeft = budget;
+	serverPeriod = period;
+	serverPriority = priority;
+	serverLowPriority = lowPriority;
+	serverActive = 0;
+	serverUsed = 0;
+	OS_InitSemaphore(&serverJobNum, 0);
+	serverReady = OS_AddProcess(&serverThread, 0, 0, 128, priority);
+	return serverReady;
+}
+
+// ******** OS_Server_Submit ************
+// Queue an aperiodic job for the sporadic server
+// Can be called from threads and from the background, never waits
+// Inputs:  function to run, argument passed to it
+// Outputs: 1 if queued, 0 if SERVER_QUEUE_SIZE jobs are already waiting
+//          or there is no server thread to run it
+int OS_Server_Submit(void (*fn)(void *), void *arg) {
+	unsigned long sr = StartCritical();   // several producers, threads and ISRs
+	if (!serverReady) {
+		EndCritical(sr);
+		return 0;
+	}
+	if (serverPutI - serverGetI >= SERVER_QUEUE_SIZE) {
+		serverStats.jobsRejected++;
+		EndCritical(sr);
+		return 0;
+	}
+	unsigned long i = serverPutI++ & (SERVER_QUEUE_SIZE - 1);
+	serverJobs[i].fn = fn;
+	serverJobs[i].arg = arg;
+	serverJobs[i].submitTime = OS_Time();
+	EndCritical(sr);
+	OS_Signal(&serverJobNum);
+	return 1;
+}
+
+// ******** OS_Server_Stats ************
+// Response times and budget exhaustions of the sporadic server
+// Inputs:  none
+// Outputs: copy of the server statistics
+ServerStatsType OS_Server_Stats(void) {
+	unsigned long sr = StartCritical();
+	ServerStatsType stats = serverStats;
+	stats.budgetLeft = serverLeft;
+	EndCritical(sr);
+	return stats;
 }
 
 
@@ -668,6 +1677,7 @@ void Timer1A_Handler(void){
 	static unsigned long lastTime;
 	unsigned long jitter;
 	TIMER1_ICR_R = TIMER_ICR_TATOCINT;  // acknowledge
+	TRACE_ISR_IN();
 	unsigned long thisTime;
 
 	if (NumSamples < RUNLENGTH) {
@@ -690,12 +1700,14 @@ void Timer1A_Handler(void){
 		}
 		lastTime = thisTime;
 	}
+	TRACE_ISR_OUT();
 }
 
 void Timer0A_Handler(void){
 	static unsigned long lastTime;
 	unsigned long jitter;
 	TIMER0_ICR_R = TIMER_ICR_TATOCINT;  // acknowledge
+	TRACE_ISR_IN();
 	unsigned long thisTime;
 	if (NumSamples < RUNLENGTH) {
 		thisTime = OS_Time();       // current time, 12.5 ns
@@ -716,6 +1728,103 @@ void Timer0A_Handler(void){
 		}
 		lastTime = thisTime;
 	}
+	TRACE_ISR_OUT();
+}
+
+/*
+ *	Time-triggered cyclic executive on Timer2A
+ *	The timer is never reloaded by software, so slot releases do not drift, and
+ *	since one ISR releases every task in the table they can not delay each other
+ *	through the NVIC priorities of Timer0A, Timer1A or the ADC.
+ */
+static const TTSlotType *ttTable;
+static unsigned long ttSlots;
+static unsigned long ttSlotLength;
+static unsigned long ttSlot;                // slot released by the next interrupt
+static unsigned long ttLastLatency;
+static unsigned long ttOverruns[TT_MAXSLOTS];
+unsigned long maxJitterTT;   // in 0.1us units
+unsigned long jitterTTHistogram[JITTERSIZE]={0,};
+
+int OS_TT_Start(const TTSlotType *table, unsigned long slots,
+		unsigned long slotLength, unsigned long priority) {
+	if (table == 0 || slots == 0 || slots > TT_MAXSLOTS || slotLength == 0) {
+		return 0;
+	}
+	long sr = StartCritical();
+	if (ttTable) {
+		EndCritical(sr);
+		return 0;
+	}
+	ttTable = table;
+	ttSlots = slots;
+	ttSlotLength = slotLength;
+	ttSlot = 0;
+	ttLastLatency = 0;
+	maxJitterTT = 0;
+	for (int i = 0; i < TT_MAXSLOTS; i++) {
+		ttOverruns[i] = 0;
+	}
+	for (int i = 0; i < JITTERSIZE; i++) {
+		jitterTTHistogram[i] = 0;
+	}
+	SYSCTL_RCGCTIMER_R |= 0x04;   // 0) activate TIMER2
+	TIMER2_CTL_R = 0x00000000;    // 1) disable TIMER2A during setup
+	TIMER2_CFG_R = 0x00000000;    // 2) configure for 32-bit mode
+	TIMER2_TAMR_R = 0x00000002;   // 3) configure for periodic mode, default down-count settings
+	TIMER2_TAILR_R = slotLength-1;// 4) reload value
+	TIMER2_TAPR_R = 0;            // 5) bus clock resolution
+	TIMER2_ICR_R = 0x00000001;    // 6) clear TIMER2A timeout flag
+	TIMER2_IMR_R = 0x00000001;    // 7) arm timeout interrupt
+	NVIC_PRI5_R = (NVIC_PRI5_R&0x00FFFFFF)| ((priority & 0x07) << 29); // 8) priority bit 31-29
+	// vector number 39, interrupt number 23
+	NVIC_EN0_R = 1<<23;           // 9) enable IRQ 23 in NVIC
+	TIMER2_CTL_R = 0x00000001;    // 10) enable TIMER2A
+	EndCritical(sr);
+	return 1;
+}
+
+void OS_TT_Stop(void) {
+	long sr = StartCritical();
+	TIMER2_CTL_R = 0x00000000;    // disable TIMER2A
+	NVIC_DIS0_R = 1<<23;          // disable IRQ 23 in NVIC
+	ttTable = 0;
+	EndCritical(sr);
+}
+
+unsigned long OS_TT_Overruns(unsigned long slot) {
+	return slot < TT_MAXSLOTS ? ttOverruns[slot] : 0;
+}
+
+void Timer2A_Handler(void){
+	// time since the slot boundary, read before anything else
+	unsigned long latency = ttSlotLength - 1 - TIMER2_TAR_R;
+	unsigned long jitter;
+	TIMER2_ICR_R = TIMER_ICR_TATOCINT;  // acknowledge
+	TRACE_ISR_IN();
+	const TTSlotType *slot = &ttTable[ttSlot];
+
+	if (slot->task) {
+		slot->task();
+		unsigned long used = ttSlotLength - 1 - TIMER2_TAR_R - latency;
+		// a timeout flag already set means the task ran into the next slot
+		if ((TIMER2_RIS_R & TIMER_RIS_TATORIS) ||
+				(slot->budget && used > slot->budget)) {
+			ttOverruns[ttSlot]++;
+		}
+	}
+	// same jitter measure as Timer1A_Handler: deviation of the release period
+	jitter = latency > ttLastLatency ? latency - ttLastLatency : ttLastLatency - latency;
+	jitter = (jitter+4)/8;  // in 0.1 usec
+	ttLastLatency = latency;
+	if (jitter > maxJitterTT)
+		maxJitterTT = jitter;
+	if (jitter >= JITTERSIZE)
+		jitter = JITTERSIZE-1;
+	jitterTTHistogram[jitter]++;
+	if (++ttSlot == ttSlots)
+		ttSlot = 0;
+	TRACE_ISR_OUT();
 }
 
 static void (*sw1_task)(void);
@@ -834,6 +1943,7 @@ static void sw2_debounce(void) {
 }
 
 void GPIOPortF_Handler(void) {  // negative logic
+	TRACE_ISR_IN();
 	unsigned long sr = StartCritical();
 	if (GPIO_PORTF_RIS_R & 0x10) {  // if PF4 pressed
 		GPIO_PORTF_IM_R &= ~0x10;	// disarm interrupt on PF4, debounce purpose
@@ -859,5 +1969,6 @@ void GPIOPortF_Handler(void) {  // negative logic
 		}
 	}
 	EndCritical(sr);
+	TRACE_ISR_OUT();
 }
 
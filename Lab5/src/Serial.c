@@ -6,6 +6,9 @@
 #include "Serial.h"
 #include "LED.h"
 #include "OS.h"
+#include "heap.h"
+#include "trace.h"
+#include "blockpool.h"
 
 
 #define NVIC_EN0_INT5           0x00000020  // Interrupt 5 enable
@@ -38,6 +41,12 @@
 #define FIFOFAIL    0         // return value on failure
                               // create index implementation FIFO (see FIFO.h)
 static Sema4Type serial_lock;
+#define FORMATSIZE 64          // bytes in each thread's formatting buffer
+#define FORMATBUFS 6           // threads that hold a buffer, later ones print unbuffered
+typedef struct { char text[FORMATSIZE]; } formatBufType;
+BLOCKPOOL_STORAGE(formatStorage, formatBufType, FORMATBUFS);
+static BlockPoolType formatPool;
+static char formatShared[FORMATSIZE];  // before OS_Launch and in handlers
 
 // Initialize UART0
 // Baud rate is 115200 bits/sec
@@ -66,7 +75,7 @@ void Serial_Init(void){
   NVIC_PRI1_R = (NVIC_PRI1_R&0xFFFF00FF)|0x00004000; // bits 13-15  UART0 = priority 2
   NVIC_EN0_R = NVIC_EN0_INT5;           // enable interrupt 5 in NVIC
   OS_InitSemaphore(&serial_lock, 1);
-
+  BlockPool_Init(&formatPool, "format", formatStorage, FORMATSIZE, FORMATBUFS);
 }
 
 // copy from hardware RX FIFO to software RX FIFO
@@ -88,13 +97,13 @@ void static copyHardwareToSoftware(void){
  * even setting UART0's priority to the highest wouldn't solve the issue. But disabling interrupt magically solves the issue.
  */
 void static copySoftwareToHardware(void){
-	OS_DisableInterrupts();
+	unsigned long sr = StartCritical();   // Serial_printf may already have interrupts off
 	char letter;
 	while(((UART0_FR_R&UART_FR_TXFF) == 0) && (TxFifo_Size() > 0)){
 		TxFifo_Get(&letter);  // due to while loop condition, never return 0
 		UART0_DR_R = letter;
 	}
-	OS_EnableInterrupts();
+	EndCritical(sr);
 }
 // input ASCII character from UART
 // spin if RxFifo is empty
@@ -106,10 +115,12 @@ char Serial_InChar(void){
   return(letter);
 }
 // output ASCII character to UART
-// spin if TxFifo is full
+// spin if TxFifo is full, draining it by polling since interrupts may be off
 void Serial_OutChar(char data){
-  while(TxFifo_Put(data) == FIFOFAIL){};
   UART0_IM_R &= ~UART_IM_TXIM;          // disable TX FIFO interrupt does not affect TXRIS, so if UART0_Handler is triggered due to other reason, TxFIFO could stil be modified
+  while(TxFifo_Put(data) == FIFOFAIL){
+    copySoftwareToHardware();
+  }
   copySoftwareToHardware();
   UART0_IM_R |= UART_IM_TXIM;           // enable TX FIFO interrupt is a must, since UART0_Handler potentially disables it
 }
@@ -118,6 +129,7 @@ void Serial_OutChar(char data){
 // hardware RX FIFO goes from 1 to 2 or more items
 // UART receiver has timed out
 void UART0_Handler(void){
+  TRACE_ISR_IN();
   if(UART0_RIS_R&UART_RIS_TXRIS){       // hardware TX FIFO <= 2 items
     UART0_ICR_R = UART_ICR_TXIC;        // acknowledge TX FIFO
     // copy from software TX FIFO to hardware TX FIFO
@@ -137,6 +149,7 @@ void UART0_Handler(void){
     // copy from hardware RX FIFO to software RX FIFO
     copyHardwareToSoftware();
   }
+  TRACE_ISR_OUT();
 }
 
 //------------Serial_OutString------------
@@ -300,20 +313,114 @@ void Serial_InString(char *bufPt, uint16_t max) {
 
 
 
-//-----------Serial_println-------------
-// C stdio style println
-// automatically insrt the newline and carriage return at the end
-// input: format string and arguments
-// output: none
-void Serial_println(char *format, ...) {
-	/*
-	 * Reason to lock here:
-	 * to preserve the order of a series of Serial_println call by different threads
-	 */
+/*
+ * Formatting state of one Serial_printf call
+ * Text is formatted into the calling thread's own buffer (TLS slot OS_TLS_SERIAL,
+ * a formatPool block) without holding serial_lock; the lock is only taken to
+ * send the finished text. Output longer than the buffer is sent in pieces, and
+ * the lock is then held from the first piece to the end so the line stays in
+ * one piece. Before OS_Launch and in a handler there is no thread to own a
+ * buffer or to wait for the lock, so formatShared is used with interrupts off.
+ */
+typedef struct {
+	char *buf;
+	int size;
+	int len;
+	int locked;
+} format_t;
 
-	OS_bWait(&serial_lock);
-	va_list ap;
-	va_start(ap, format);
+static void formatFlush(format_t *f) {
+	if (!f->locked) {
+		OS_bWait(&serial_lock);
+		f->locked = 1;
+	}
+	for (int i = 0; i < f->len; i++) {
+		Serial_OutChar(f->buf[i]);
+	}
+	f->len = 0;
+}
+
+static void formatChar(format_t *f, char c) {
+	if (f->len == f->size) {
+		formatFlush(f);
+	}
+	f->buf[f->len++] = c;
+}
+
+static void formatString(format_t *f, char *pt) {
+	while (*pt) {
+		formatChar(f, *pt++);
+	}
+}
+
+static void formatUDec(format_t *f, uint32_t n) {
+	char digits[10];
+	int i = 0;
+	do {
+		digits[i++] = n%10 + '0';
+		n /= 10;
+	} while (n);
+	while (i) {
+		formatChar(f, digits[--i]);
+	}
+}
+
+static void formatUHex(format_t *f, uint32_t n) {
+	char digits[8];
+	int i = 0;
+	do {
+		digits[i++] = (n&0xF) < 0xA ? (n&0xF) + '0' : (n&0xF) - 0xA + 'A';
+		n >>= 4;
+	} while (n);
+	while (i) {
+		formatChar(f, digits[--i]);
+	}
+}
+
+// the running thread's formatting buffer, taken from formatPool on first use
+static char *formatBuffer(void) {
+	char *buf = OS_TLS_Get(OS_TLS_SERIAL);
+	if (buf == 0) {
+		unsigned long sr = StartCritical();      // the pool is not locked
+		buf = BlockPool_Alloc(&formatPool);
+		EndCritical(sr);
+		OS_TLS_Set(OS_TLS_SERIAL, buf);
+	}
+	return buf;
+}
+
+//------------Serial_ThreadExit------------
+// give the running thread's formatting buffer back to formatPool
+// called by OS_Exit, after the thread's last print
+void Serial_ThreadExit(void) {
+	char *buf = OS_TLS_Get(OS_TLS_SERIAL);
+	if (buf) {
+		unsigned long sr = StartCritical();
+		BlockPool_Free(&formatPool, buf);
+		EndCritical(sr);
+		OS_TLS_Set(OS_TLS_SERIAL, 0);
+	}
+}
+
+static void vprint(char *format, va_list ap, int newline) {
+	char direct;
+	format_t f;
+	unsigned long sr = 0;
+	int shared = RunPt == 0 || Trace_IPSR() != 0;
+	if (shared) {
+		sr = StartCritical();       // formatShared has one user at a time
+		f.buf = formatShared;
+		f.locked = 1;               // can not wait for serial_lock here
+	} else {
+		f.buf = formatBuffer();
+		f.locked = 0;
+	}
+	f.size = FORMATSIZE;
+	f.len = 0;
+	if (f.buf == 0) {           // pool empty, send every character as it is formatted
+		f.buf = &direct;
+		f.size = 1;
+	}
 
 	while (*format != '\0') {
 		if (*format == '%') {
@@ -321,66 +428,55 @@ void Serial_println(char *format, ...) {
 			switch (*format) {
 			case 'u' :
 			case 'U' :
-				Serial_OutUDec(va_arg(ap, uint32_t));
+				formatUDec(&f, va_arg(ap, uint32_t));
 				break;
 			case 's' :
 			case 'S' :
-				Serial_OutString(va_arg(ap, char *));
+				formatString(&f, va_arg(ap, char *));
 				break;
 			case 'c' :
 			case 'C' :
-				Serial_OutChar(va_arg(ap, int));
+				formatChar(&f, va_arg(ap, int));
 				break;
 			case 'x' :
 			case 'X' :
-				Serial_OutUHex(va_arg(ap, uint32_t));
+				formatUHex(&f, va_arg(ap, uint32_t));
 				break;
 			}
 		}
 		else {
-			Serial_OutChar(*format);
+			formatChar(&f, *format);
 		}
 		format++;
 	}
+	if (newline) {
+		formatChar(&f, LF);
+		formatChar(&f, CR);
+	}
+	formatFlush(&f);
+	if (shared) {
+		EndCritical(sr);
+	} else {
+		OS_bSignal(&serial_lock);
+	}
+}
+
+//-----------Serial_println-------------
+// C stdio style println
+// automatically insrt the newline and carriage return at the end
+// input: format string and arguments
+// output: none
+void Serial_println(char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	vprint(format, ap, 1);
 	va_end(ap);
-	Serial_OutChar(LF);
-	Serial_OutChar(CR);
-	OS_bSignal(&serial_lock);
 }
 
 
 void Serial_printf(char *format, ...) {
-	OS_bWait(&serial_lock);
 	va_list ap;
 	va_start(ap, format);
-
-	while (*format != '\0') {
-		if (*format == '%') {
-			format++;
-			switch (*format) {
-			case 'u' :
-			case 'U' :
-				Serial_OutUDec(va_arg(ap, uint32_t));
-				break;
-			case 's' :
-			case 'S' :
-				Serial_OutString(va_arg(ap, char *));
-				break;
-			case 'c' :
-			case 'C' :
-				Serial_OutChar(va_arg(ap, int));
-				break;
-			case 'x' :
-			case 'X' :
-				Serial_OutUHex(va_arg(ap, uint32_t));
-				break;
-			}
-		}
-		else {
-			Serial_OutChar(*format);
-		}
-		format++;
-	}
+	vprint(format, ap, 0);
 	va_end(ap);
-	OS_bSignal(&serial_lock);
 }
@@ -0,0 +1,72 @@
+// filename *************************bench.c ************************
+// Cycle-accurate microbenchmarks, see bench.h
+
+#include <stdint.h>
+#include "bench.h"
+#include "OS.h"
+
+#define CALIBRATION_RUNS 16
+
+static BenchStatsType benchSites[BENCH_SITES];
+static uint32_t benchOverhead;
+
+#ifndef HOST
+static void benchStart(void) {
+	DEMCR_R |= DEMCR_TRCENA;
+	DWT_CYCCNT_R = 0;
+	DWT_CTRL_R |= DWT_CTRL_CYCCNTENA;
+}
+#else
+static void benchStart(void) {   // Host_Cycles runs from Host_Init
+}
+#endif
+
+void Bench_Reset(void) {
+	unsigned long sr = StartCritical();
+	for (int i = 0; i < BENCH_SITES; i++) {
+		benchSites[i].count = 0;
+		benchSites[i].total = 0;
+		benchSites[i].min = 0xFFFFFFFF;
+		benchSites[i].max = 0;
+	}
+	EndCritical(sr);
+}
+
+void Bench_Init(void) {
+	benchStart();
+	benchOverhead = 0;
+	// the smallest empty pair is the cost of the two counter reads
+	uint32_t best = 0xFFFFFFFF;
+	for (int i = 0; i < CALIBRATION_RUNS; i++) {
+		uint32_t start = BENCH_NOW();
+		uint32_t elapsed = BENCH_NOW() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	benchOverhead = best;
+	Bench_Reset();
+}
+
+void Bench_Record(int site, uint32_t elapsed) {
+	BenchStatsType *s = &benchSites[site];
+	elapsed = elapsed > benchOverhead ? elapsed - benchOverhead : 0;
+	unsigned long sr = StartCritical();
+	s->count++;
+	s->total += elapsed;
+	if (elapsed < s->min)
+		s->min = elapsed;
+	if (elapsed > s->max)
+		s->max = elapsed;
+	EndCritical(sr);
+}
+
+BenchStatsType Bench_Get(int site) {
+	unsigned long sr = StartCritical();
+	BenchStatsType stats = benchSites[site];
+	EndCritical(sr);
+	return stats;
+}
+
+uint32_t Bench_Overhead(void) {
+	return benchOverhead;
+}
@@ -0,0 +1,74 @@
+// filename *************************blockpool.c ************************
+// Fixed-size block pools, see blockpool.h
+
+#include <stdint.h>
+#include "blockpool.h"
+
+static BlockPoolType *blockPools[BLOCKPOOL_MAXPOOLS];
+static int blockPoolNum;
+
+static void blockPoolRegister(BlockPoolType *pool) {
+	for (int i = 0; i < blockPoolNum; i++) {
+		if (blockPools[i] == pool)
+			return;
+	}
+	if (blockPoolNum < BLOCKPOOL_MAXPOOLS)
+		blockPools[blockPoolNum++] = pool;
+}
+
+void BlockPool_Init(BlockPoolType *pool, const char *name, uint32_t *storage,
+		uint32_t objectBytes, uint32_t blocks) {
+	uint32_t words = BLOCKPOOL_WORDS(objectBytes);
+	pool->name = name;
+	pool->start = storage;
+	pool->end = storage + words * blocks;
+	pool->blockWords = words;
+	pool->blocks = blocks;
+	pool->used = 0;
+	pool->peak = 0;
+	pool->failures = 0;
+	// each free block holds the address of the next one in its first word
+	pool->free = blocks ? storage : 0;
+	for (uint32_t i = 0; i < blocks; i++) {
+		uint32_t *block = storage + i * words;
+		*(uint32_t **)block = (i + 1 < blocks) ? block + words : 0;
+	}
+	blockPoolRegister(pool);
+}
+
+void *BlockPool_Alloc(BlockPoolType *pool) {
+	uint32_t *block = pool->free;
+	if (block == 0) {
+		pool->failures++;
+		return 0;
+	}
+	pool->free = *(uint32_t **)block;
+	if (++pool->used > pool->peak)
+		pool->peak = pool->used;
+	return block;
+}
+
+int BlockPool_Owns(const BlockPoolType *pool, const void *block) {
+	uintptr_t b = (uintptr_t)block;
+	uintptr_t start = (uintptr_t)pool->start;
+	// byte offsets, so a pointer into the middle of a word is not rounded down
+	return b >= start && b < (uintptr_t)pool->end &&
+			(b - start) % (pool->blockWords * sizeof(uint32_t)) == 0;
+}
+
+int32_t BlockPool_Free(BlockPoolType *pool, void *block) {
+	if (!BlockPool_Owns(pool, block))
+		return BLOCKPOOL_ERROR_NOT_IN_POOL;
+	if (pool->used == 0 || block == pool->free)
+		return BLOCKPOOL_ERROR_NOT_USED;
+	*(uint32_t **)block = pool->free;
+	pool->free = block;
+	pool->used--;
+	return BLOCKPOOL_OK;
+}
+
+const BlockPoolType *BlockPool_Get(int index) {
+	if (index < 0 || index >= blockPoolNum)
+		return 0;
+	return blockPools[index];
+}
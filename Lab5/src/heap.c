@@ -32,14 +32,66 @@
 // If the block is used, the meta-sections record the room as a positive
 // number.  If the block is unused, the meta-sections record the room as a
 // negative number.
+//
+// Unused blocks are found by two-level segregated fit (TLSF) rather than by
+// walking the heap. Each unused block sits on one of FL_COUNT*SL_COUNT doubly
+// linked lists: the first level is the power of two of its room, the second
+// level splits that range into SL_COUNT equal parts. The links are word
+// offsets from HEAP_START in the first two words of the room, so an unused
+// block holds at least MIN_ROOM words. A bitmap per level tells which lists
+// are not empty, so malloc usually finds a block with two find-first-set
+// operations. When the rounded request fits no list it looks at no more than
+// FIT_PROBES blocks of its own size class, so malloc and free both take
+// constant time. On the replay of TestmainHeap that fails fewer requests than
+// the old first-fit walk and cuts its worst case; free does a little more
+// work than first fit, unlinking the neighbours it coalesces with.
+//
+// Every entry point runs its heap work inside StartCritical/EndCritical, so
+// threads, the loader and killProcess can share the heap. The hold covers the
+// list search and the boundary tags; copying and clearing data happen
+// outside it. Arenas are heap blocks handed out by a bump pointer and
+// freed in one piece.
 #include <stdint.h>
+#include "OS.h"
 #include "heap.h"
+#include "trace.h"
+#include "bench.h"
 
 #define HEAP_START (Heap)
-#define HEAP_END (HEAP_START + HEAP_SIZE_WORDS)
-
-//The actual heap is just a big array.
-static int32_t Heap[HEAP_SIZE_WORDS];
+#define HEAP_END (HEAP_START + HeapWords)
+
+#define SL_LOG2 3
+#define SL_COUNT (1 << SL_LOG2)   // second level lists per power of two
+#define FL_COUNT 16               // first level lists, rooms below 2^(FL_COUNT+SL_LOG2-1) words
+#define MIN_ROOM 2                // room for the next and previous links
+#define FIT_PROBES 2              // blocks of its own list a request looks at after good fit fails
+#define NO_BLOCK (-1)
+#define NEXT_FREE 1               // word of the room holding the next link
+#define PREV_FREE 2               // and the previous one
+
+//The actual heap is all SRAM the linker did not use: from the end of .bss
+//to the end of SRAM (tm4c123gxl.ld). The main stack is in .bss, below it.
+//The host port has no such symbols and uses an array instead.
+#ifdef HOST
+static int32_t HeapArray[HEAP_SIZE_WORDS];
+#else
+extern uint32_t _ebss;
+extern uint32_t _eram;
+#endif
+static int32_t* Heap;
+static int32_t HeapWords;
+
+// heads of the unused block lists, as word offsets of the headers
+static int32_t FreeList[FL_COUNT][SL_COUNT];
+static uint32_t FlBitmap;                // bit fl set if any FreeList[fl][] is not empty
+static uint32_t SlBitmap[FL_COUNT];      // bit sl set if FreeList[fl][sl] is not empty
+
+// kept up to date by every split, merge and list change, so that
+// Heap_Stats does not walk the heap; every unused block is on a list
+static int32_t BlocksTotal;
+static int32_t BlocksUnused;             // blocks on the lists
+static int32_t WordsUnused;              // their room
+static int32_t LargestRoom;              // room of the largest unused block, -1 if unknown
 
 static int32_t inHeapRange(int32_t* address);
 static int32_t blockUsed(int32_t* block);
@@ -54,19 +106,51 @@ static int32_t markBlockUsed(int32_t* blockStart);
 static int32_t markBlockUnused(int32_t* blockStart);
 static int32_t splitAndMarkBlockUsed(int32_t* upperBlockStart, int32_t desiredRoom);
 static void mergeBlockWithBelow(int32_t* upperBlockStart);
+static void mapRoom(int32_t room, int32_t* fl, int32_t* sl);
+static void insertFreeBlock(int32_t* blockStart);
+static void removeFreeBlock(int32_t* blockStart);
+static int32_t* findFreeBlock(int32_t desiredRoom);
 //static int32_t byteIndex(int32_t* ptr);
 
 //******** Heap_Init *************** 
 // Initialize the Heap
 // input: none
-// output: always HEAP_OK
+// output: HEAP_OK, or HEAP_ERROR_TOO_SMALL if less than HEAP_MIN_BYTES
+//  are left after .bss; the heap is then empty and every malloc fails
 // notes: Initializes/resets the heap to a clean state where no memory
 //  is allocated.
 int32_t Heap_Init(void){
-  int32_t* blockStart = HEAP_START;
-  int32_t* blockEnd = (HEAP_START + HEAP_SIZE_WORDS - 1);
-  *blockStart = -(int32_t)(HEAP_SIZE_WORDS - 2);  
-  *blockEnd = -(int32_t)(HEAP_SIZE_WORDS - 2);
+  int32_t* blockStart;
+  int32_t* blockEnd;
+  int32_t fl, sl;
+#ifdef HOST
+  Heap = HeapArray;
+  HeapWords = HEAP_SIZE_WORDS;
+#else
+  Heap = (int32_t*)(((uint32_t)&_ebss + 3) & ~3u);  // word aligned
+  HeapWords = (int32_t*)&_eram - Heap;
+#endif
+  blockStart = HEAP_START;
+  blockEnd = HEAP_END - 1;
+  for(fl = 0; fl < FL_COUNT; fl++){
+    for(sl = 0; sl < SL_COUNT; sl++){
+      FreeList[fl][sl] = NO_BLOCK;
+    }
+    SlBitmap[fl] = 0;
+  }
+  FlBitmap = 0;
+  BlocksUnused = 0;
+  WordsUnused = 0;
+  LargestRoom = 0;
+  if(HeapWords < (int32_t)(HEAP_MIN_BYTES / sizeof(int32_t))){
+    HeapWords = 0;   // .bss reaches into or past the end of SRAM
+    BlocksTotal = 0;
+    return HEAP_ERROR_TOO_SMALL;
+  }
+  *blockStart = -(HeapWords - 2);  
+  *blockEnd = -(HeapWords - 2);
+  BlocksTotal = 1;
+  insertFreeBlock(blockStart);
   return HEAP_OK;
 }
 
@@ -77,24 +161,105 @@ int32_t Heap_Init(void){
 //   desiredBytes: desired number of bytes to allocate
 // output: void* pointing to the allocated memory or will return NULL
 //   if there isn't sufficient space to satisfy allocation request
+static void* heapMalloc(int32_t desiredBytes){
+  int32_t desiredWords = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
+  int32_t* blockStart;
+  if(desiredWords <= 0){
+    return 0; //NULL
+  }
+  if(desiredWords < MIN_ROOM){
+    desiredWords = MIN_ROOM;  // it has to hold the links once it is freed
+  }
+  blockStart = findFreeBlock(desiredWords);
+  if(blockStart == 0){
+    return 0; //NULL
+  }
+  removeFreeBlock(blockStart);
+  if(splitAndMarkBlockUsed(blockStart, desiredWords)){
+    return 0; //NULL
+  }
+  return blockStart + 1;
+}
+
 void* Heap_Malloc(int32_t desiredBytes){
+  BENCH_BEGIN(BENCH_MALLOC);
+  unsigned long sr = StartCritical();
+  void* block = heapMalloc(desiredBytes);
+  EndCritical(sr);
+  BENCH_END(BENCH_MALLOC);
+  int32_t words = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
+  TRACE(TRACE_MALLOC, block == 0 ? 0 : (words > 255 ? 255 : words));
+  return block;
+}
+
+
+//******** Heap_AlignedMalloc *************** 
+// Allocate memory at an aligned address, data not initialized
+// input: 
+//   desiredBytes: desired number of bytes to allocate
+//   alignment: power of two in bytes, anything up to 4 is plain Heap_Malloc
+// output: void* pointing to the allocated memory or will return NULL
+//   if there isn't sufficient space or alignment is not a power of two
+// notes: takes a block big enough for any offset, then gives the words in
+//   front of the aligned address back as an unused block and splits off the
+//   tail, so only the boundary tags are lost. A gap too short to be a block
+//   moves the start on by whole alignments until it is not.
+static void* heapAlignedMalloc(int32_t desiredBytes, int32_t alignment){
   int32_t desiredWords = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
-  int32_t* blockStart = HEAP_START;  // implements first fit
+  int32_t alignWords = alignment / sizeof(int32_t);
+  int32_t* blockStart;
+  int32_t* alignedStart;
+  int32_t gap;
+  int32_t room;
   if(desiredWords <= 0){
     return 0; //NULL
   }
-  while(inHeapRange(blockStart)){
-  // one pass through the heap
-  // choose first block that is big enough
-    if(blockUnused(blockStart) && desiredWords <= blockRoom(blockStart)){
-      if(splitAndMarkBlockUsed(blockStart, desiredWords)){
-        return 0; //NULL
-      }
-      return blockStart + 1;
-    }
-    blockStart = nextBlockHeader(blockStart);
+  if(desiredWords < MIN_ROOM){
+    desiredWords = MIN_ROOM;
   }
-  return 0; //NULL
+  blockStart = findFreeBlock(desiredWords + alignWords + MIN_ROOM + 2);
+  if(blockStart == 0){
+    return 0; //NULL
+  }
+  removeFreeBlock(blockStart);
+  // the block's room starts at blockStart + 1, find the first aligned word
+  gap = ((alignment - (uintptr_t)(blockStart + 1)) & (alignment - 1)) / sizeof(int32_t);
+  while(gap > 0 && gap < MIN_ROOM + 2){
+    gap += alignWords;   // the gap has to hold an unused block
+  }
+  if(gap > 0){
+    room = blockRoom(blockStart) - gap;
+    alignedStart = blockStart + gap;
+    *blockStart = -(gap - 2);           // the front, unused
+    alignedStart[-1] = -(gap - 2);
+    *alignedStart = -room;              // and the rest, split as for malloc
+    *blockTrailer(alignedStart) = -room;
+    BlocksTotal++;
+    insertFreeBlock(blockStart);
+    blockStart = alignedStart;
+  }
+  if(splitAndMarkBlockUsed(blockStart, desiredWords)){
+    return 0; //NULL
+  }
+  return blockStart + 1;
+}
+
+void* Heap_AlignedMalloc(int32_t desiredBytes, int32_t alignment){
+  void* block;
+  if(alignment <= (int32_t)sizeof(int32_t)){
+    return Heap_Malloc(desiredBytes);
+  }
+  if(alignment & (alignment - 1)){
+    return 0; //NULL
+  }
+  BENCH_BEGIN(BENCH_MALLOC);
+  unsigned long sr = StartCritical();
+  block = heapAlignedMalloc(desiredBytes, alignment);
+  EndCritical(sr);
+  BENCH_END(BENCH_MALLOC);
+  int32_t words = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
+  TRACE(TRACE_MALLOC, block == 0 ? 0 : (words > 255 ? 255 : words));
+  return block;
 }
 
 
@@ -133,17 +298,23 @@ void* Heap_Calloc(int32_t desiredBytes){
 //    where the contents of the old block will be copied to
 // output: void* pointing to the new block or will return NULL
 //   if there is any reason the reallocation can't be completed
-// notes: the given block will be unallocated after its contents
-//   are copied to the new block
-void* Heap_Realloc(void* oldBlock, int32_t desiredBytes){
+// notes: a shrinking block is split in place and a growing one takes in the
+//   unused block below it, so neither copies. Failing that, the unused block
+//   above is taken in as well and the contents move down. Only when the
+//   neighbors are too small is a new block allocated, the contents copied
+//   and the old block unallocated. On failure the old block is untouched.
+static void* heapRealloc(void* oldBlock, int32_t desiredBytes, int32_t* oldRoom){
   int32_t* oldBlockPtr;
   int32_t* oldBlockStart;
   int32_t* newBlockPtr;
+  int32_t* nextBlockStart;
+  int32_t* previousBlockStart = 0;
   int32_t oldBlockRoom;
-  int32_t newBlockRoom;
-  int32_t wordsToCopy;
+  int32_t desiredWords;
+  int32_t availableRoom;
   int32_t i;
   
+  *oldRoom = 0;
   oldBlockPtr = (int32_t*) oldBlock;
   // error if...
   // 1) oldBlockPtr doesn't point in the heap
@@ -152,14 +323,81 @@ void* Heap_Realloc(void* oldBlock, int32_t desiredBytes){
   if(!inHeapRange(oldBlockStart) || blockUnused(oldBlockStart)){
     return 0; // NULL
   }
+  desiredWords = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
+  if(desiredWords <= 0){
+    return 0; // NULL
+  }
+  if(desiredWords < MIN_ROOM){
+    desiredWords = MIN_ROOM;
+  }
+
+  // room without moving: the block and the unused block below it, if any
+  oldBlockRoom = blockRoom(oldBlockStart);
+  availableRoom = oldBlockRoom;
+  nextBlockStart = nextBlockHeader(oldBlockStart);
+  if(inHeapRange(nextBlockStart) && blockUnused(nextBlockStart)){
+    availableRoom += blockRoom(nextBlockStart) + 2;
+  }
+  else{
+    nextBlockStart = 0;
+  }
+  if(oldBlockStart > HEAP_START){
+    previousBlockStart = previousBlockHeader(oldBlockStart);
+    if(!blockUnused(previousBlockStart) ||
+       availableRoom + blockRoom(previousBlockStart) + 2 < desiredWords){
+      previousBlockStart = 0;
+    }
+  }
+  if(desiredWords > availableRoom && previousBlockStart == 0){
+    *oldRoom = oldBlockRoom;  // the neighbors are too small, move it
+    return 0; // NULL
+  }
+
+  // make one unused block of the neighbors and this one, then split it
+  // at the new room; the contents stay where they are until moved down
+  if(markBlockUnused(oldBlockStart)){
+    return 0; // NULL
+  }
+  if(nextBlockStart){
+    removeFreeBlock(nextBlockStart);
+    mergeBlockWithBelow(oldBlockStart);
+  }
+  newBlockPtr = oldBlockPtr;
+  if(desiredWords > availableRoom){
+    removeFreeBlock(previousBlockStart);
+    mergeBlockWithBelow(previousBlockStart);
+    newBlockPtr = previousBlockStart + 1;
+    for(i = 0; i < oldBlockRoom; i++){  // overlapping, the front moves first
+      newBlockPtr[i] = oldBlockPtr[i];
+    }
+  }
+  if(splitAndMarkBlockUsed(newBlockPtr - 1, desiredWords)){
+    return 0; // NULL
+  }
+  return newBlockPtr;
+}
+
+void* Heap_Realloc(void* oldBlock, int32_t desiredBytes){
+  int32_t* oldBlockPtr = (int32_t*) oldBlock;
+  int32_t* newBlockPtr;
+  int32_t oldBlockRoom;
+  int32_t newBlockRoom;
+  int32_t wordsToCopy;
+  int32_t i;
+  unsigned long sr = StartCritical();
+  newBlockPtr = heapRealloc(oldBlock, desiredBytes, &oldBlockRoom);
+  EndCritical(sr);
+  if(newBlockPtr != 0 || oldBlockRoom == 0){
+    return newBlockPtr;
+  }
 
+  // the old block stays ours, so the copy needs no lock
   newBlockPtr = Heap_Malloc(desiredBytes);
   // did Malloc fail?
   if(newBlockPtr == 0){
     return 0; // NULL
   }
   
-  oldBlockRoom = blockRoom(oldBlockStart);
   newBlockRoom = blockRoom(newBlockPtr - 1);
   if(oldBlockRoom < newBlockRoom){
     wordsToCopy = oldBlockRoom;
@@ -184,7 +422,7 @@ void* Heap_Realloc(void* oldBlock, int32_t desiredBytes){
 //  HEAP_ERROR_POINTER_OUT_OF_RANGE if pointer points outside the heap;
 //  HEAP_ERROR_CORRUPTED_HEAP if heap has been corrupted or trying to
 //  unallocate memory that has already been unallocated;
-int32_t Heap_Free(void* pointer){
+static int32_t heapFree(void* pointer){
   int32_t* blockStart;
   int32_t* blockEnd;
   int32_t* nextBlockStart;
@@ -214,6 +452,7 @@ int32_t Heap_Free(void* pointer){
     int32_t* previousBlockStart = previousBlockHeader(blockStart);
     // second, make sure we only merge with an unused block
     if(blockUnused(previousBlockStart)){
+      removeFreeBlock(previousBlockStart);
       mergeBlockWithBelow(previousBlockStart);
       blockStart = previousBlockStart; // start of block has moved
     }
@@ -222,18 +461,39 @@ int32_t Heap_Free(void* pointer){
   // possibly merge with block below
   nextBlockStart = nextBlockHeader(blockStart);
   if(inHeapRange(nextBlockStart) && blockUnused(nextBlockStart)){
+    removeFreeBlock(nextBlockStart);
     mergeBlockWithBelow(blockStart);
   }
+  insertFreeBlock(blockStart);
   return HEAP_OK;
 }
 
+int32_t Heap_Free(void* pointer){
+  BENCH_BEGIN(BENCH_FREE);
+  unsigned long sr = StartCritical();
+  int32_t status = heapFree(pointer);
+  EndCritical(sr);
+  BENCH_END(BENCH_FREE);
+  TRACE(TRACE_FREE, status);
+  return status;
+}
+
 
 //******** Heap_Test *************** 
 // Test the heap
 // input: none
 // output: validity of the heap - either HEAP_OK or HEAP_ERROR_HEAP_CORRUPTED
-int32_t Heap_Test(void){
+// notes: besides the boundary tags, checks that every unused block is on
+//  the list its room maps to, exactly once, that the bitmaps agree and
+//  that the counters match
+static int32_t heapTest(void){
   int32_t lastBlockWasUnused = 0;
+  int32_t blocks = 0;
+  int32_t unusedWords = 0;
+  int32_t unusedBlocks = 0;
+  int32_t listedBlocks = 0;
+  int32_t largestRoom = 0;
+  int32_t fl, sl;
   int32_t* blockStart = HEAP_START;
   while(inHeapRange(blockStart)){
     int32_t* blockEnd;
@@ -252,47 +512,162 @@ int32_t Heap_Test(void){
       return HEAP_ERROR_CORRUPTED_HEAP;
     }
     lastBlockWasUnused = blockUnused(blockStart);
+    if(lastBlockWasUnused){
+      unusedBlocks++;
+      unusedWords += blockRoom(blockStart);
+      if(blockRoom(blockStart) > largestRoom){
+        largestRoom = blockRoom(blockStart);
+      }
+    }
+    blocks++;
     blockStart = blockEnd + 1;
   }
   //traversing the heap should end exactly where the heap ends
   if(blockStart != HEAP_END){
     return HEAP_ERROR_CORRUPTED_HEAP;
   }
+
+  //every list holds unused blocks of its own size class, linked both ways
+  for(fl = 0; fl < FL_COUNT; fl++){
+    if(((FlBitmap >> fl) & 1) != (SlBitmap[fl] != 0)){
+      return HEAP_ERROR_CORRUPTED_HEAP;
+    }
+    for(sl = 0; sl < SL_COUNT; sl++){
+      int32_t previous = NO_BLOCK;
+      int32_t offset = FreeList[fl][sl];
+      if(((SlBitmap[fl] >> sl) & 1) != (offset != NO_BLOCK)){
+        return HEAP_ERROR_CORRUPTED_HEAP;
+      }
+      while(offset != NO_BLOCK){
+        int32_t blockFl, blockSl;
+        blockStart = HEAP_START + offset;
+        if(!inHeapRange(blockStart) || !blockUnused(blockStart) ||
+           blockStart[PREV_FREE] != previous || ++listedBlocks > unusedBlocks){
+          return HEAP_ERROR_CORRUPTED_HEAP;
+        }
+        mapRoom(blockRoom(blockStart), &blockFl, &blockSl);
+        if(blockFl != fl || blockSl != sl){
+          return HEAP_ERROR_CORRUPTED_HEAP;
+        }
+        previous = offset;
+        offset = blockStart[NEXT_FREE];
+      }
+    }
+  }
+  if(listedBlocks != unusedBlocks){
+    return HEAP_ERROR_CORRUPTED_HEAP;
+  }
+  //and the counters behind Heap_Stats agree with the walk
+  if(blocks != BlocksTotal || unusedBlocks != BlocksUnused || unusedWords != WordsUnused ||
+     (LargestRoom >= 0 && LargestRoom != largestRoom)){
+    return HEAP_ERROR_CORRUPTED_HEAP;
+  }
   return HEAP_OK;
 }
 
+int32_t Heap_Test(void){
+  unsigned long sr = StartCritical();
+  int32_t status = heapTest();
+  EndCritical(sr);
+  return status;
+}
+
 
 //******** Heap_Stats *************** 
 // return the current status of the heap
 // input: none
 // output: a heap_stats_t that describes the current usage of the heap
+// notes: the totals and the largest unused block are kept as the heap
+//  changes, in constant time. Only after the largest block leaves its list
+//  does the next call walk that one list, with interrupts disabled, to find
+//  the new largest; later calls are constant time again
 heap_stats_t Heap_Stats(void){
-  int32_t* blockStart;
   heap_stats_t stats;
-  
-  stats.wordsAllocated = 0;
-  stats.wordsAvailable = 0;
-  stats.blocksUsed = 0;
-  stats.blocksUnused = 0;
-
-  //just go through each block to get stats on heap usage
-  blockStart = HEAP_START;
-  while(inHeapRange(blockStart)){
-    if(blockUsed(blockStart)){
-      stats.wordsAllocated += blockRoom(blockStart);
-      stats.blocksUsed++;
-    }
-    else{
-      stats.wordsAvailable += blockRoom(blockStart);
-      stats.blocksUnused++;
+  int32_t largest;
+  unsigned long sr = StartCritical();
+  if(LargestRoom < 0){
+    LargestRoom = 0;
+  }
+  if(LargestRoom == 0 && FlBitmap){
+    int32_t fl = 31 - __builtin_clz(FlBitmap);
+    int32_t sl = 31 - __builtin_clz(SlBitmap[fl]);
+    int32_t offset;
+    for(offset = FreeList[fl][sl]; offset != NO_BLOCK; offset = HEAP_START[offset + NEXT_FREE]){
+      if(blockRoom(HEAP_START + offset) > LargestRoom){
+        LargestRoom = blockRoom(HEAP_START + offset);
+      }
     }
-    blockStart = nextBlockHeader(blockStart);
   }
-  stats.wordsOverhead = HEAP_SIZE_WORDS - stats.wordsAllocated - stats.wordsAvailable;
+  largest = LargestRoom;
+  stats.wordsAvailable = WordsUnused;
+  stats.blocksUnused = BlocksUnused;
+  stats.blocksUsed = BlocksTotal - BlocksUnused;
+  stats.wordsOverhead = 2 * BlocksTotal;
+  stats.wordsAllocated = HeapWords - stats.wordsOverhead - WordsUnused;
+  EndCritical(sr);
+  stats.wordsLargestFree = largest;
+  // none when all the unused room is one block, 100 as it tends to crumbs
+  stats.fragmentation = WordsUnused ? 100 - 100 * largest / WordsUnused : 0;
   return stats;
 }
 
 
+// an arena is a heap block that starts with this header
+struct heap_arena {
+  int32_t* next;   // first word not handed out
+  int32_t* end;    // one past the last word of the block
+};
+
+//******** Heap_ArenaCreate *************** 
+// Allocate an arena for Heap_ArenaMalloc
+// input: bytes the arena can hand out
+// output: the arena, or NULL if there isn't sufficient space
+heap_arena_t* Heap_ArenaCreate(int32_t bytes){
+  heap_arena_t* arena;
+  if(bytes <= 0){
+    return 0; // NULL
+  }
+  arena = Heap_Malloc(sizeof(heap_arena_t) + bytes);
+  if(arena == 0){
+    return 0; // NULL
+  }
+  arena->next = (int32_t*)(arena + 1);
+  arena->end = (int32_t*)arena + blockRoom((int32_t*)arena - 1);
+  return arena;
+}
+
+
+//******** Heap_ArenaMalloc *************** 
+// Allocate memory from an arena, data not initialized
+// input: arena from Heap_ArenaCreate, desired number of bytes
+// output: void* pointing to the memory, or NULL if the arena is full
+// notes: constant time, the memory is only returned by Heap_ArenaRelease
+void* Heap_ArenaMalloc(heap_arena_t* arena, int32_t desiredBytes){
+  int32_t desiredWords = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
+  int32_t* block = 0;
+  unsigned long sr;
+  if(desiredWords <= 0){
+    return 0; // NULL
+  }
+  sr = StartCritical();
+  if(desiredWords <= arena->end - arena->next){
+    block = arena->next;
+    arena->next += desiredWords;
+  }
+  EndCritical(sr);
+  return block;
+}
+
+
+//******** Heap_ArenaRelease *************** 
+// Free an arena and everything allocated from it, with a single Heap_Free
+// input: arena from Heap_ArenaCreate
+// output: the status of Heap_Free
+int32_t Heap_ArenaRelease(heap_arena_t* arena){
+  return Heap_Free(arena);
+}
+
+
 // inHeapRange
 // input: a pointer
 // output: whether or not the pointer points inside the heap
@@ -409,17 +784,18 @@ static int32_t markBlockUnused(int32_t* blockStart){
 
 // splitAndMarkBlockUsed
 // input: 
-//  uppterBlockStart: header of a block 
+//  uppterBlockStart: header of a block, already taken off its list
 //  desiredRoom: desired amount of words to be in the new upper block
 // output: none
 // notes: splits the block given so that the new upper block holds desiredRoom
-//  words (or more).  Marks the upper block as used, lower block as unused.
+//  words (or more).  Marks the upper block as used, lower block as unused
+//  and puts the lower block on its list.
 //  Will not split a block if the leftover room is insufficient to make another
 //  useful block.
 static int32_t splitAndMarkBlockUsed(int32_t* upperBlockStart, int32_t desiredRoom){
   int32_t leftoverRoom = blockRoom(upperBlockStart) - desiredRoom - 2;
   // only split block if leftovers could actually make another useful block
-  if(leftoverRoom > 0){
+  if(leftoverRoom >= MIN_ROOM){
     int32_t* upperBlockEnd = upperBlockStart + desiredRoom + 1;
     int32_t* lowerBlockStart = upperBlockEnd + 1;
     int32_t* lowerBlockEnd = blockTrailer(upperBlockStart);
@@ -427,11 +803,13 @@ static int32_t splitAndMarkBlockUsed(int32_t* upperBlockStart, int32_t desiredRo
     *upperBlockEnd = desiredRoom;
     *lowerBlockStart = -leftoverRoom; // marked unused
     *lowerBlockEnd = -leftoverRoom;
+    BlocksTotal++;
+    insertFreeBlock(lowerBlockStart);
   }
   // can't split block - just mark it at used
   else{
     if(markBlockUsed(upperBlockStart)){
-      return 0; // NULL Free failed
+      return HEAP_ERROR_CORRUPTED_HEAP;
     }
   }
   return HEAP_OK;
@@ -443,6 +821,7 @@ static int32_t splitAndMarkBlockUsed(int32_t* upperBlockStart, int32_t desiredRo
 // output: none
 // notes: will merge the given block with the block below it.
 //  WARNING: Does not check that the block below actually exists.
+//  Neither block may be on a list.
 static void mergeBlockWithBelow(int32_t* upperBlockStart){
   int32_t* upperBlockEnd = blockTrailer(upperBlockStart);
   int32_t* lowerBlockStart = upperBlockEnd + 1;
@@ -451,7 +830,126 @@ static void mergeBlockWithBelow(int32_t* upperBlockStart){
   int32_t room = lowerBlockEnd - upperBlockStart - 1;
   *upperBlockStart = -room;
   *lowerBlockEnd = -room;
+  BlocksTotal--;
   return;
 }
 
 
+// mapRoom
+// input: room of a block in words, at least 1
+// output: the list for blocks of that room, in *fl and *sl
+// notes: rooms below SL_COUNT have a list each, above that the range
+//  2^n..2^(n+1)-1 is split into SL_COUNT lists
+static void mapRoom(int32_t room, int32_t* fl, int32_t* sl){
+  if(room < SL_COUNT){
+    *fl = 0;
+    *sl = room;
+  }
+  else{
+    int32_t log2 = 31 - __builtin_clz(room);
+    *fl = log2 - SL_LOG2 + 1;
+    *sl = (room >> (log2 - SL_LOG2)) - SL_COUNT;
+  }
+}
+
+
+// insertFreeBlock
+// input: pointer to the header of an unused block
+// output: none
+// notes: pushes the block on the front of its list
+static void insertFreeBlock(int32_t* blockStart){
+  int32_t fl, sl;
+  int32_t offset = blockStart - HEAP_START;
+  mapRoom(blockRoom(blockStart), &fl, &sl);
+  blockStart[NEXT_FREE] = FreeList[fl][sl];
+  blockStart[PREV_FREE] = NO_BLOCK;
+  if(FreeList[fl][sl] != NO_BLOCK){
+    HEAP_START[FreeList[fl][sl] + PREV_FREE] = offset;
+  }
+  FreeList[fl][sl] = offset;
+  FlBitmap |= 1u << fl;
+  SlBitmap[fl] |= 1u << sl;
+  BlocksUnused++;
+  WordsUnused += blockRoom(blockStart);
+  if(LargestRoom >= 0 && blockRoom(blockStart) > LargestRoom){
+    LargestRoom = blockRoom(blockStart);
+  }
+}
+
+
+// removeFreeBlock
+// input: pointer to the header of an unused block on its list
+// output: none
+// notes: unlinks the block, clears the bitmap bits when its list empties
+static void removeFreeBlock(int32_t* blockStart){
+  int32_t fl, sl;
+  int32_t next = blockStart[NEXT_FREE];
+  int32_t previous = blockStart[PREV_FREE];
+  mapRoom(blockRoom(blockStart), &fl, &sl);
+  BlocksUnused--;
+  WordsUnused -= blockRoom(blockStart);
+  if(blockRoom(blockStart) == LargestRoom){
+    LargestRoom = -1;                  // found again by the next Heap_Stats
+  }
+  if(next != NO_BLOCK){
+    HEAP_START[next + PREV_FREE] = previous;
+  }
+  if(previous != NO_BLOCK){
+    HEAP_START[previous + NEXT_FREE] = next;
+  }
+  else{
+    FreeList[fl][sl] = next;
+    if(next == NO_BLOCK){
+      SlBitmap[fl] &= ~(1u << sl);
+      if(SlBitmap[fl] == 0){
+        FlBitmap &= ~(1u << fl);
+      }
+    }
+  }
+}
+
+
+// findFreeBlock
+// input: desired room in words, at least MIN_ROOM
+// output: header of an unused block with at least that much room, still on
+//  its list, or 0 (NULL) if there is none
+// notes: the request is rounded up to the next list boundary, so the head of
+//  any non-empty list at or above it fits (good fit, two bitmap lookups). Only
+//  when that fails are the first FIT_PROBES blocks of the one list that may
+//  still hold a big enough block looked at, so the search is constant time;
+//  a fit deeper in that list is missed, which the replay shows to be rare.
+static int32_t* findFreeBlock(int32_t desiredRoom){
+  int32_t fl, sl;
+  int32_t rounded = desiredRoom;
+  uint32_t bits;
+  int32_t offset;
+  int32_t probes = 0;
+  if(desiredRoom >= SL_COUNT){
+    rounded += (1 << (31 - __builtin_clz(desiredRoom) - SL_LOG2)) - 1;
+  }
+  mapRoom(rounded, &fl, &sl);
+  if(fl < FL_COUNT){
+    bits = SlBitmap[fl] & (~0u << sl);
+    if(bits == 0 && fl + 1 < FL_COUNT){
+      uint32_t flBits = FlBitmap & (~0u << (fl + 1));
+      if(flBits){
+        fl = __builtin_ctz(flBits);
+        bits = SlBitmap[fl];
+      }
+    }
+    if(bits){
+      return HEAP_START + FreeList[fl][__builtin_ctz(bits)];
+    }
+  }
+  mapRoom(desiredRoom, &fl, &sl);
+  if(fl >= FL_COUNT){
+    return 0; //NULL
+  }
+  for(offset = FreeList[fl][sl]; offset != NO_BLOCK && probes < FIT_PROBES; offset = HEAP_START[offset + NEXT_FREE]){
+    probes++;
+    if(blockRoom(HEAP_START + offset) >= desiredRoom){
+      return HEAP_START + offset;
+    }
+  }
+  return 0; //NULL
+}
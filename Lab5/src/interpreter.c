@@ -9,6 +9,10 @@
 #include "heap.h"
 #include "loader.h"
 #include "sysent.h"
+#include "trace.h"
+#include "profile.h"
+#include "bench.h"
+#include "blockpool.h"
 
 
 static void parse_lcd(char cmd[][20], int len);
@@ -22,6 +26,14 @@ static void parse_malloc(char cmd[][20], int len);
 static void parse_free(char cmd[][20], int len);
 static void parse_load(char cmd[][20], int len);
 void parse_dg(char cmd[][20], int len);
+static void parse_pool(char cmd[][20], int len);
+static void parse_tt(char cmd[][20], int len);
+static void parse_server(char cmd[][20], int len);
+static void parse_trace(char cmd[][20], int len);
+static void parse_prof(char cmd[][20], int len);
+static void parse_bench(char cmd[][20], int len);
+static void parse_blocks(char cmd[][20], int len);
+static void parse_heap(char cmd[][20], int len);
 
 
 char input[200];
@@ -33,7 +45,106 @@ static const ELFSymbol_t exports[] = {
 
 static const ELFEnv_t env = { exports, sizeof(exports) / sizeof(*exports) };
 
+static struct cmdJob {
+	char (*cmd)[20];
+	int len;
+} cmdJob;
+static Sema4Type cmdDone;     // signaled by runCommand when the command is finished
+
+// run one parsed command, arg points to a struct cmdJob
+static void runCommand(void *arg) {
+	char (*command)[20] = ((struct cmdJob *)arg)->cmd;
+	int len = ((struct cmdJob *)arg)->len;
+
+	// lcd output
+	if (strcmp(command[0], "lcd") == 0) {
+		parse_lcd(command, len);
+
+	}
+	// led
+	else if (strcmp(command[0], "led") == 0) {
+		parse_led(command, len);
+	}
+
+	else if (strcmp(command[0], "jitter") == 0) {
+		parse_jitter(command, len);
+	}
+
+//	display directory
+//	else if (strcmp(command[0], "ls") == 0) {
+//		parse_ls(command, len);
+//	}
+
+//	else if (strcmp(command[0], "format") == 0) {
+//		parse_format(command, len);
+//	}
+
+	else if (strcmp(command[0], "cat") == 0) {
+		parse_cat(command, len);
+	}
+
+//	else if (strcmp(command[0], "rm") == 0) {
+//		parse_rm(command,  len);
+//	}
+
+	else if (strcmp(command[0], "malloc") == 0) {
+		parse_malloc(command,  len);
+	}
+
+	else if (strcmp(command[0], "free") == 0) {
+		parse_free(command,  len);
+	}
+
+
+	else if (strcmp(command[0], "load") == 0) {
+		parse_load(command,  len);
+	}
+
+
+	else if (strcmp(command[0], "dg") == 0) {
+		parse_dg(command,  len);
+	}
+
+	else if (strcmp(command[0], "pool") == 0) {
+		parse_pool(command,  len);
+	}
+
+	else if (strcmp(command[0], "tt") == 0) {
+		parse_tt(command,  len);
+	}
+
+	else if (strcmp(command[0], "server") == 0) {
+		parse_server(command,  len);
+	}
+
+	else if (strcmp(command[0], "trace") == 0) {
+		parse_trace(command,  len);
+	}
+
+	else if (strcmp(command[0], "prof") == 0) {
+		parse_prof(command,  len);
+	}
+
+	else if (strcmp(command[0], "bench") == 0) {
+		parse_bench(command,  len);
+	}
+
+	else if (strcmp(command[0], "blocks") == 0) {
+		parse_blocks(command,  len);
+	}
+
+	else if (strcmp(command[0], "heap") == 0) {
+		parse_heap(command,  len);
+	}
+
+	else {
+		Serial_printf("Unrecognized command.\n\r");
+	}
+	OS_bSignal(&cmdDone);
+}
+
 void interpreter(void) {
+	OS_InitSemaphore(&cmdDone, 0);
 	while (1) {
 		Serial_printf("$ ");
 		Serial_InString(input, 30);  // 200 will not work for some reason
@@ -81,58 +192,16 @@ void interpreter(void) {
 		command[len++][i] = '\0';   // terminate the final token
 		command[len][0] = '\0';     // terminate the array with a NULL
 
-		// lcd output
-		if (strcmp(command[0], "lcd") == 0) {
-			parse_lcd(command, len);
-
-		}
-		// led
-		else if (strcmp(command[0], "led") == 0) {
-			parse_led(command, len);
-		}
-
-		else if (strcmp(command[0], "jitter") == 0) {
-			parse_jitter(command, len);
-		}
-
-//		display directory
-//		else if (strcmp(command[0], "ls") == 0) {
-//			parse_ls(command, len);
-//		}
-
-//		else if (strcmp(command[0], "format") == 0) {
-//			parse_format(command, len);
-//		}
-
-		else if (strcmp(command[0], "cat") == 0) {
-			parse_cat(command, len);
-		}
-
-//		else if (strcmp(command[0], "rm") == 0) {
-//			parse_rm(command,  len);
-//		}
-
-		else if (strcmp(command[0], "malloc") == 0) {
-			parse_malloc(command,  len);
-		}
-
-		else if (strcmp(command[0], "free") == 0) {
-			parse_free(command,  len);
-		}
-
-
-		else if (strcmp(command[0], "load") == 0) {
-			parse_load(command,  len);
-		}
-
-
-		else if (strcmp(command[0], "dg") == 0) {
-			parse_dg(command,  len);
-		}
-
-		else {
-			Serial_printf("Unrecognized command.\n\r");
+		// every command runs as an aperiodic job on the sporadic server, so it
+		// can not take more than its budget from other threads; load and cat
+		// read the SD card for longer than the budget and finish at the
+		// server's low priority
+		cmdJob.cmd = command;
+		cmdJob.len = len;
+		if (OS_Server_Submit(&runCommand, &cmdJob) == 0) {
+			runCommand(&cmdJob);  // no server or queue full, run it here
 		}
+		OS_bWait(&cmdDone);
 		END_OF_LOOP : ;
 	}
 }
@@ -304,3 +373,170 @@ void parse_dg(char cmd[][20], int len) {
 
 
 }
+
+static void parse_pool(char cmd[][20], int len) {
+	PoolStatsType stats = OS_Pool_Stats();
+	unsigned long avg = stats.jobsRun ? stats.totalWait / stats.jobsRun : 0;
+	Serial_printf("jobs run: %u, rejected: %u\n\r", stats.jobsRun, stats.jobsRejected);
+	Serial_printf("queue wait (12.5ns): avg %u, max %u\n\r", avg, stats.maxWait);
+}
+
+extern unsigned long maxJitterTT;
+
+static void parse_tt(char cmd[][20], int len) {
+	for (int i = 0; i < TT_MAXSLOTS; i++) {
+		unsigned long n = OS_TT_Overruns(i);
+		if (n) {
+			Serial_printf("slot %u overruns: %u\n\r", i, n);
+		}
+	}
+	Serial_printf("max jitter (0.1us): %u\n\r", maxJitterTT);
+}
+
+static void parse_server(char cmd[][20], int len) {
+	ServerStatsType stats = OS_Server_Stats();
+	unsigned long avg = stats.jobsRun ? stats.totalResponse / stats.jobsRun : 0;
+	Serial_printf("jobs run: %u, rejected: %u\n\r", stats.jobsRun, stats.jobsRejected);
+	Serial_printf("response (12.5ns): avg %u, max %u\n\r", avg, stats.maxResponse);
+	Serial_printf("budget exhausted: %u, left: %u\n\r", stats.exhaustions, stats.budgetLeft);
+}
+
+#define TRACE_COSTRUNS 16
+
+/*
+ * trace          dump the ring over UART as text, one "event id delta" line per record in hex
+ * trace <file>   write the ring to a file on the SD card, "TRC1" then the raw records
+ * trace cost     average cost of one event in 12.5ns units, leaves TRACE_COSTRUNS user events
+ * Recording stops during the dump so the dump's own UART and disk events do not
+ * overwrite the ring. Decode either form with Lab5/tools/tracedecode.c
+ */
+static void parse_trace(char cmd[][20], int len) {
+	if (len > 1 && !strcmp(cmd[1], "cost")) {
+		unsigned long start = OS_Time();
+		for (int i = 0; i < TRACE_COSTRUNS; i++) {
+			Trace_Event(TRACE_USER, i);
+		}
+		Serial_printf("trace cost: %u\n\r", OS_TimeDifference(start, OS_Time()) / TRACE_COSTRUNS);
+		return;
+	}
+
+	Trace_Stop();
+	unsigned long n = Trace_Count();
+	if (len == 1) {
+		Serial_printf("trace %u\n\r", n);
+		for (unsigned long i = 0; i < n; i++) {
+			TraceRecordType r = Trace_Get(i);
+			Serial_printf("%x %x %x\n\r", r.event, r.id, r.delta);
+		}
+	} else {
+		FIL handle;
+		UINT written;
+		FRESULT res = f_open(&handle, cmd[1], FA_WRITE | FA_CREATE_ALWAYS);
+		if (res != FR_OK) {
+			Serial_printf("trace: open error: %u\n\r", res);
+			Trace_Start();
+			return;
+		}
+		res = f_write(&handle, "TRC1", 4, &written);
+		for (unsigned long i = 0; i < n && res == FR_OK; i++) {
+			TraceRecordType r = Trace_Get(i);
+			res = f_write(&handle, &r, sizeof(r), &written);
+		}
+		if (res != FR_OK) {
+			Serial_printf("trace: write error: %u\n\r", res);
+		}
+		if (f_close(&handle) != FR_OK) {
+			Serial_printf("trace: close failed.\n\r");
+		}
+	}
+	Trace_Start();
+}
+
+#define PROF_DEFAULT_HZ 997   // prime, so samples do not lock to the 1ms tick
+
+/*
+ * prof start [Hz]   clear the histogram and sample at Hz
+ * prof stop         stop sampling
+ * prof dump         print the histogram, decode with Lab5/tools/profdecode.c
+ */
+static void parse_prof(char cmd[][20], int len) {
+	if (len == 1) {
+		Serial_printf("prof: need at least an argument.\n\r");
+		return;
+	}
+
+	if (!strcmp(cmd[1], "start")) {
+		unsigned long hz = len > 2 ? atoi(cmd[2]) : PROF_DEFAULT_HZ;
+		if (hz == 0 || hz > 100000) {
+			Serial_printf("prof start: incorrect rate.\n\r");
+			return;
+		}
+		Profile_Start(80000000 / hz, 0);
+	} else if (!strcmp(cmd[1], "stop")) {
+		Profile_Stop();
+	} else if (!strcmp(cmd[1], "dump")) {
+		Profile_Dump();
+	} else {
+		Serial_printf("Unrecognized argument.\n\r");
+	}
+}
+
+static const char * const benchNames[BENCH_SITES] = {
+	"switch", "wait", "signal", "fifo put", "fifo get", "malloc", "free"
+};
+
+/*
+ * bench          per-site count, average, min and max in bus cycles
+ * bench reset    clear the accumulators
+ */
+static void parse_bench(char cmd[][20], int len) {
+	if (len > 1 && !strcmp(cmd[1], "reset")) {
+		Bench_Reset();
+		return;
+	}
+	Serial_printf("overhead %u cycles, removed from every sample\n\r", Bench_Overhead());
+	for (int i = 0; i < BENCH_SITES; i++) {
+		BenchStatsType stats = Bench_Get(i);
+		if (stats.count) {
+			Serial_printf("%s: n %u, avg %u, min %u, max %u\n\r", benchNames[i],
+					stats.count, stats.total / stats.count, stats.min, stats.max);
+		}
+	}
+}
+
+/*
+ * blocks         use of each fixed-size block pool
+ */
+static void parse_blocks(char cmd[][20], int len) {
+	const BlockPoolType *pool;
+	for (int i = 0; (pool = BlockPool_Get(i)) != 0; i++) {
+		Serial_printf("%s: %u of %u blocks of %u bytes, peak %u, failed %u\n\r",
+				(char *)pool->name, pool->used, pool->blocks,
+				pool->blockWords * sizeof(uint32_t), pool->peak, pool->failures);
+	}
+}
+
+/*
+ * heap           usage, largest unused block and fragmentation
+ * heap <bytes>   also whether a block that big can be allocated now,
+ *                such as a section before load
+ */
+static void parse_heap(char cmd[][20], int len) {
+	heap_stats_t stats = Heap_Stats();
+	Serial_printf("heap %u bytes\n\r",
+			(stats.wordsAllocated + stats.wordsAvailable + stats.wordsOverhead) * 4);
+	Serial_printf("used %u bytes in %u blocks, free %u bytes in %u blocks\n\r",
+			stats.wordsAllocated * 4, stats.blocksUsed,
+			stats.wordsAvailable * 4, stats.blocksUnused);
+	Serial_printf("largest free %u bytes, fragmentation %u percent, overhead %u bytes\n\r",
+			stats.wordsLargestFree * 4, stats.fragmentation, stats.wordsOverhead * 4);
+	if (len > 1) {
+		int32_t bytes = atoi(cmd[1]);
+		if (bytes <= 0)
+			Serial_printf("heap: incorrect size.\n\r");
+		else if (bytes > stats.wordsLargestFree * 4)
+			Serial_printf("LOW: a %u byte block does not fit\n\r", bytes);
+		else
+			Serial_printf("a %u byte block fits\n\r", bytes);
+	}
+}
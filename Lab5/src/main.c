@@ -30,6 +30,22 @@
 #include "Serial.h"
 #include "LED.h"
 #include "ff.h"
+#include "bench.h"
+#include "heap.h"
+#ifdef HOST
+#include "host.h"
+#endif
+
+// the test mains below realmain and their state, about 1.7 KB of .bss; to run
+// one on the target build with -DTESTMAIN_ENABLE=1 -DSTACKSIZE=320, no test
+// main runs the interpreter, and the smaller stacks leave room for the heap
+#ifndef TESTMAIN_ENABLE
+#ifdef HOST
+#define TESTMAIN_ENABLE 1
+#else
+#define TESTMAIN_ENABLE 0
+#endif
+#endif
 
 
 #define PE0  (*((volatile unsigned long *)0x40024004))
@@ -72,10 +88,7 @@ void interpreter(void);    // just a prototype, link to your interpreter
 const char inFilename[] = "test.txt";   // 8 characters or fewer
 const char outFilename[] = "out.txt";   // 8 characters or fewer
 static FATFS g_sFatFs;
-FIL Handle,Handle2;
 FRESULT MountFresult;
-FRESULT Fresult;
-unsigned char buffer[512];
 #define MAXBLOCKS 100
 
 void filesystem(void) {
@@ -92,7 +105,7 @@ void filesystem(void) {
 
 void OS_Test(void);
 
-void button(void) {
+void ButtonWork(void *arg) {
 
 }
 
@@ -100,13 +113,13 @@ void button(void) {
 // Called when SW1 Button pushed
 // background threads execute once and return
 void SW1Push(void){
-    NumCreated += OS_AddThread(&button,128,1);  // start a 2 second run
-
+    OS_Server_Submit(&ButtonWork, 0);  // runs on the sporadic server thread
 }
 //************SW2Push*************
 // Called when SW2 Button pushed
 // background threads execute once and return
 void SW2Push(void){
+    OS_Server_Submit(&ButtonWork, (void *)1);  // runs on the sporadic server thread
 }
 
 
@@ -122,6 +135,7 @@ int main(void){        // realmain
   OS_AddProcess(&interpreter, 0, 0, 128, 2);
   OS_AddProcess(&filesystem, 0, 0, 128, 1);
   OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Server_Init(2*TIME_1MS, 10, 1, 6);  // button and interpreter jobs, 2ms every 10ms
 //  NumCreated += OS_AddThread(&filesystem,128,1);
 //  NumCreated += OS_AddThread(&interpreter,128,2);
 //  NumCreated += OS_AddThread(&IdleTask,128,7);  // runs when nothing useful to do
@@ -129,3 +143,853 @@ int main(void){        // realmain
   OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
   return 0;            // this never executes
 }
+
+//+++++++++++++++++++++++++DEBUGGING CODE++++++++++++++++++++++++
+// ONCE YOUR RTOS WORKS YOU CAN COMMENT OUT THE REMAINING CODE
+//
+#if TESTMAIN_ENABLE
+//*******************FIFO batch TEST**********
+// Measures the CPU time saved by OS_Fifo_GetN at 10 kHz sampling
+// The producer puts one sample per interrupt in both phases
+// Phase 0: consumer calls OS_Fifo_Get once per sample, watermark 1
+// Phase 1: consumer calls OS_Fifo_GetN, woken once every FIFOBATCH samples
+// FillerCount counts loops of the lowest priority thread during each phase,
+// so the difference between the two phases is the CPU time saved; on the
+// host -v charges no time for kernel calls, so both phases count the same
+// FifoWakeups counts the times the consumer blocked, each one costs two
+// context switches when the producer wakes it; expect about 10000 in phase 0
+// and 10000/FIFOBATCH in phase 1, on the host as well as on the board
+// The producer flushes the Fifo when it stops so the consumer never sleeps
+// below the watermark; expected errors and DataLost are zero in both phases
+#define FIFORATE    (TIME_1MS/10)    // 10 kHz producer
+#define FIFODEPTH   32               // OS_FIFO_SIZE, more than 2ms of samples
+#define FIFOBATCH   8                // samples moved per OS_Fifo_GetN
+#define FIFOPHASEMS 1000             // length of each phase
+#define FILLERLOOP  6                // bus cycles of one filler loop
+unsigned long FifoCount;             // samples produced
+unsigned long FifoExpected;          // next sample the consumer expects
+unsigned long FifoErrors;            // out of order samples
+unsigned long FifoLost;              // samples dropped because the Fifo was full
+unsigned long FillerCount;           // loops of the filler thread
+unsigned long FifoWakeups[2];        // times the consumer blocked in each phase
+int FifoPhase;                       // 0 single, 1 batch, 2 done
+int FifoFlushed;                     // the producer has flushed the last batch
+
+void FifoProducer(void){   // called periodically at FIFORATE
+  if(FifoPhase < 2){
+    if(OS_Fifo_Put(FifoCount) == 0){
+      FifoLost++;
+    }
+    FifoCount++;
+  } else if(!FifoFlushed){
+    FifoFlushed = 1;
+    OS_Fifo_Flush();                 // less than FIFOBATCH samples may be left
+  }
+}
+static void fifoCheck(unsigned long data){
+  if(data != FifoExpected){
+    FifoErrors++;
+  }
+  FifoExpected = data+1;
+}
+void FifoConsumer(void){
+  unsigned long buf[FIFOBATCH];
+  unsigned long n;
+  while(1){
+    int phase = FifoPhase;
+    if(phase < 2 && OS_Fifo_Size() < (phase ? FIFOBATCH : 1)){
+      FifoWakeups[phase]++;          // the next call blocks
+    }
+    if(phase == 0){
+      fifoCheck(OS_Fifo_Get());
+    } else{
+      n = OS_Fifo_GetN(buf, FIFOBATCH);
+      for(unsigned long i = 0; i < n; i++){
+        fifoCheck(buf[i]);
+      }
+    }
+  }
+}
+void FifoFiller(void){
+  while(1){
+    FillerCount++;
+#ifdef HOST
+    Host_Consume(FILLERLOOP);        // moves virtual time, -v would stop here
+#endif
+  }
+}
+void FifoReport(void){
+  unsigned long filler[2];
+  for(int phase = 0; phase < 2; phase++){
+    OS_Fifo_SetWatermark(phase ? FIFOBATCH : 1);
+    FillerCount = 0;
+    OS_Sleep(FIFOPHASEMS);
+    filler[phase] = FillerCount;
+    FifoPhase = phase + 1;
+  }
+  OS_Sleep(1);                       // let the consumer take the flushed samples
+  Serial_println("fifo single: filler=%u wakeups=%u", filler[0], FifoWakeups[0]);
+  Serial_println("fifo batch:  filler=%u wakeups=%u", filler[1], FifoWakeups[1]);
+  Serial_println("fifo errors=%u lost=%u left=%u", FifoErrors, FifoLost,
+                 FifoCount - FifoExpected);
+  OS_Kill();
+}
+int TestmainFifo(void){   // TestmainFifo
+  OS_Init();           // initialize, disable interrupts
+  FifoCount = FifoExpected = FifoErrors = FifoLost = 0;
+  FifoWakeups[0] = FifoWakeups[1] = 0;
+  FifoPhase = FifoFlushed = 0;
+  OS_Fifo_Init(FIFODEPTH);
+  OS_AddPeriodicThread(&FifoProducer, FIFORATE, 0);
+  OS_AddProcess(&FifoReport, 0, 0, 128, 0);
+  OS_AddProcess(&FifoConsumer, 0, 0, 128, 1);
+  OS_AddProcess(&FifoFiller, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Topic fan-out TEST**********
+// Measures the cost of OS_Topic_Publish with 0 to TOPIC_MAXSUBS queued subscribers
+// Each round adds one subscriber, publishes TOPICRUNS samples and drains the queues
+// Prints the average publish time in 12.5ns units for each subscriber count
+// Readers using OS_Topic_Latest cost the producer nothing, so they are not counted
+#define TOPICRUNS 1000
+TopicType TopicBus;
+TopicSubType TopicSubs[TOPIC_MAXSUBS];
+void TopicBench(void){
+  TopicSampleType sample;
+  unsigned long start, total;
+  OS_Topic_Init(&TopicBus);
+  for(int subs = 0; subs <= TOPIC_MAXSUBS; subs++){
+    if(subs){
+      OS_Topic_Subscribe(&TopicBus, &TopicSubs[subs-1]);
+    }
+    total = 0;
+    for(int i = 0; i < TOPICRUNS; i++){
+      long sr = StartCritical();   // time only the publish, not the interrupts
+      start = OS_Time();
+      OS_Topic_Publish(&TopicBus, i);
+      total += OS_TimeDifference(start, OS_Time());
+      EndCritical(sr);
+      for(int j = 0; j < subs; j++){
+        while(OS_Topic_TryRead(&TopicSubs[j], &sample)){};
+      }
+    }
+    Serial_println("topic subs=%u publish=%u", subs, total/TOPICRUNS);
+  }
+  OS_Topic_Latest(&TopicBus, &sample);
+  Serial_println("topic latest=%u", sample.data);
+  OS_Kill();
+}
+int TestmainTopic(void){   // TestmainTopic
+  OS_Init();           // initialize, disable interrupts
+  OS_AddProcess(&TopicBench, 0, 0, 128, 1);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Reader-writer lock TEST**********
+// Shared calibration table read by RWREADERS threads, rewritten every 10 ms
+// Phase 0 protects the table with a binary semaphore, phase 1 with a reader-writer lock
+// Readers hold the lock long enough to be preempted inside it, so with the
+// semaphore the other readers block, with the reader-writer lock they keep going
+// Prints the number of table reads and table writes finished in each phase;
+// Errors should be zero, and with the reader-writer lock the writer, which
+// sleeps 10 ms between writes and outranks the readers, must get about
+// RWPHASEMS/10 writes; the binary semaphore does not hand itself over, so
+// readers that release and retake it can hold the writer off in phase 0
+// On the host each read of an entry takes RWENTRYCOST on -v
+#define RWREADERS  4
+#define RWTABLE    64
+#define RWPHASEMS  1000
+#define RWENTRYCOST 4                // bus cycles to compare one entry
+#define RWMINWRITES (RWPHASEMS/10/2) // fewer writes in a phase is starvation
+long CalTable[RWTABLE];          // every entry equals CalVersion when consistent
+long CalVersion;
+Sema4Type CalMutex;
+RWLockType CalLock;
+unsigned long CalReads;
+unsigned long CalErrors;
+int CalMode;                     // 0 semaphore, 1 reader-writer lock, 2 done
+void CalReader(void){
+  long first;
+  int bad;
+  while(CalMode < 2){
+    int mode = CalMode;
+    if(mode) OS_ReadLock(&CalLock); else OS_bWait(&CalMutex);
+    first = CalTable[0];
+    bad = 0;
+    for(int i = 1; i < RWTABLE; i++){
+      if(CalTable[i] != first) bad = 1;
+    }
+#ifdef HOST
+    Host_Consume(RWTABLE*RWENTRYCOST);   // -v would stop in here
+#endif
+    if(mode) OS_ReadUnlock(&CalLock); else OS_bSignal(&CalMutex);
+    CalReads++;
+    CalErrors += bad;
+  }
+  OS_Kill();
+}
+void CalWriter(void){
+  while(CalMode < 2){
+    // take both, so readers are excluded even while the phase changes
+    OS_bWait(&CalMutex);
+    OS_WriteLock(&CalLock);
+    CalVersion++;
+    for(int i = 0; i < RWTABLE; i++){
+      CalTable[i] = CalVersion;
+    }
+    OS_WriteUnlock(&CalLock);
+    OS_bSignal(&CalMutex);
+    OS_Sleep(10);
+  }
+  OS_Kill();
+}
+void CalReport(void){
+  unsigned long reads[2], writes[2];
+  long version;
+  for(int phase = 0; phase < 2; phase++){
+    CalReads = 0;
+    version = CalVersion;
+    OS_Sleep(RWPHASEMS);
+    reads[phase] = CalReads;
+    writes[phase] = CalVersion - version;
+    CalMode = phase + 1;
+  }
+  Serial_println("rwlock semaphore: reads=%u writes=%u", reads[0], writes[0]);
+  Serial_println("rwlock rwlock:    reads=%u writes=%u", reads[1], writes[1]);
+  Serial_println("rwlock errors=%u", CalErrors);
+  if(writes[1] < RWMINWRITES){
+    Serial_println("rwlock FAIL: writer starved");
+  }
+  OS_Kill();
+}
+int TestmainRWLock(void){   // TestmainRWLock
+  OS_Init();           // initialize, disable interrupts
+  OS_InitSemaphore(&CalMutex, 1);
+  OS_InitRWLock(&CalLock);
+  CalMode = 0;
+  CalVersion = 0;
+  CalReads = CalErrors = 0;
+  OS_AddProcess(&CalReport, 0, 0, 128, 0);
+  OS_AddProcess(&CalWriter, 0, 0, 128, 1);
+  for(int i = 0; i < RWREADERS; i++){
+    OS_AddProcess(&CalReader, 0, 0, 128, 2);
+  }
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Semaphore fast path TEST**********
+// Run once with SEMA_FASTPATH 1 and once with 0 in OS.c and compare
+// Round trip: average cycles for an uncontended OS_Signal+OS_Wait (OS_bSignal+OS_bWait) pair
+// ISR latency: a 10 kHz Timer1A task reads how far the timer has counted past its
+// timeout when the task starts; the worst case grows with every interrupt-masked section
+// On the host run it on the real clock: -v charges no time for kernel calls, so
+// the round trip only shows the clock reads, and takes every interrupt on time
+#define SEMARUNS   10000
+#define SEMAPERIOD (TIME_1MS/10)
+Sema4Type SemaCount, SemaBinary;
+unsigned long MaxIsrLatency;     // in 12.5ns units
+void SemaLatencyTask(void){      // runs in Timer1A_Handler
+  unsigned long latency = SEMAPERIOD - 1 - TIMER1_TAR_R;
+  if(latency > MaxIsrLatency){
+    MaxIsrLatency = latency;
+  }
+}
+void SemaBench(void){
+  unsigned long start;
+  unsigned long counting, binary;
+  OS_Sleep(10);                  // let the periodic task settle
+  MaxIsrLatency = 0;
+  start = OS_Time();
+  for(int i = 0; i < SEMARUNS; i++){
+    OS_Signal(&SemaCount);
+    OS_Wait(&SemaCount);
+  }
+  counting = OS_TimeDifference(start, OS_Time())/SEMARUNS;
+  start = OS_Time();
+  for(int i = 0; i < SEMARUNS; i++){
+    OS_bSignal(&SemaBinary);
+    OS_bWait(&SemaBinary);
+  }
+  binary = OS_TimeDifference(start, OS_Time())/SEMARUNS;
+  Serial_println("sema round trip: counting=%u binary=%u x12.5ns", counting, binary);
+#ifdef HOST
+  if(Host_Virtual()){
+    Serial_println("sema max isr latency: none on -v");
+  } else
+#endif
+  Serial_println("sema max isr latency=%u x12.5ns", MaxIsrLatency);
+  OS_Kill();
+}
+int TestmainSema(void){   // TestmainSema
+  OS_Init();           // initialize, disable interrupts
+  OS_InitSemaphore(&SemaCount, 0);
+  OS_InitSemaphore(&SemaBinary, 0);
+  MaxIsrLatency = 0;
+  OS_AddPeriodicThread(&SemaLatencyTask, SEMAPERIOD, 0);
+  OS_AddProcess(&SemaBench, 0, 0, 128, 1);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Thread join TEST**********
+// Spawns JOINBURSTS bursts of JOINBURST joinable workers and joins every one
+// Far more workers than NUMTHREADS are created in total, so the TCBs must be
+// reaped as soon as each worker exits; Failed should be zero
+// Each worker exits with its own thread ID, which OS_Join must hand back
+// Then NUMTHREADS workers exit unjoined, which takes every exit record, so one
+// more OS_AddJoinableThread must fail instead of losing an exit code, and the
+// parked codes must all still be joinable
+// Last, joining a reaped thread or itself must fail at once instead of
+// blocking; Refused should be two, the full table and the self join
+#define JOINBURST  4
+#define JOINBURSTS 50
+unsigned long JoinOK, JoinFailed, JoinRefused;
+void JoinWorker(void){
+  OS_Sleep(1);                   // make sure some workers exit after the join starts
+  OS_Exit(OS_Id());
+}
+void JoinQuick(void){
+  OS_Exit(OS_Id());
+}
+void JoinSelf(void){
+  OS_Exit(OS_Join(OS_Id(), 0));  // 0 when refused
+}
+void JoinSpawner(void){
+  int tids[JOINBURST];
+  int code;
+  for(int burst = 0; burst < JOINBURSTS; burst++){
+    for(int i = 0; i < JOINBURST; i++){
+      tids[i] = OS_AddJoinableThread(&JoinWorker,128,2);
+    }
+    for(int i = 0; i < JOINBURST; i++){
+      if(tids[i] >= 0 && OS_Join(tids[i], &code) && code == tids[i]){
+        JoinOK++;
+      } else{
+        JoinFailed++;
+      }
+    }
+  }
+  int parked[NUMTHREADS];
+  for(int i = 0; i < NUMTHREADS; i++){
+    parked[i] = OS_AddJoinableThread(&JoinQuick,128,2);
+    OS_Sleep(1);                 // let it exit before the next one is added
+  }
+  if(OS_AddJoinableThread(&JoinQuick,128,2) < 0){
+    JoinRefused++;
+  }
+  for(int i = 0; i < NUMTHREADS; i++){
+    if(parked[i] >= 0 && OS_Join(parked[i], &code) && code == parked[i]){
+      JoinOK++;
+    } else{
+      JoinFailed++;
+    }
+  }
+  if(parked[0] >= 0 && OS_Join(parked[0], &code)){
+    JoinFailed++;                // joined above, its thread is gone
+  }
+  int self = OS_AddJoinableThread(&JoinSelf,128,2);
+  if(self >= 0 && OS_Join(self, &code) && code == 0){
+    JoinRefused++;
+  } else{
+    JoinFailed++;
+  }
+  Serial_println("join ok=%u failed=%u refused=%u", JoinOK, JoinFailed, JoinRefused);
+  OS_Kill();
+}
+int TestmainJoin(void){   // TestmainJoin
+  OS_Init();           // initialize, disable interrupts
+  JoinOK = JoinFailed = JoinRefused = 0;
+  OS_AddProcess(&JoinSpawner, 0, 0, 128, 1);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Process exit TEST**********
+// Each round adds a process whose two threads both print and then exit, so
+// OS_Exit frees a Serial buffer both with and without killProcess printing
+// "pid freed" from the same thread; every round must finish, Heap_Test must
+// pass and the heap must end with as many words allocated as it started with
+#define EXITROUNDS 20
+unsigned long ExitRounds, ExitErrors;
+void ExitHelper(void){
+  Serial_println("exit helper %u", OS_Id());
+  OS_Kill();
+}
+void ExitWorker(void){
+  OS_AddThread(&ExitHelper,128,2);
+  Serial_println("exit worker %u", OS_Id());
+  OS_Kill();
+}
+void ExitSpawner(void){
+  int32_t baseline;
+  Serial_println("exit test, %u rounds", EXITROUNDS);  // our own buffer is in the baseline
+  baseline = Heap_Stats().wordsAllocated;
+  for(int round = 0; round < EXITROUNDS; round++){
+    OS_AddProcess(&ExitWorker, 0, 0, 128, 2);
+    OS_Sleep(5);                 // both threads print and exit
+    if(Heap_Test() != HEAP_OK){
+      ExitErrors++;
+    }
+    ExitRounds++;
+  }
+  Serial_println("exit rounds=%u heap errors=%u leaked=%u words", ExitRounds, ExitErrors,
+      Heap_Stats().wordsAllocated - baseline);
+  OS_Kill();
+}
+int TestmainExit(void){   // TestmainExit
+  OS_Init();           // initialize, disable interrupts
+  ExitRounds = ExitErrors = 0;
+  OS_AddProcess(&ExitSpawner, 0, 0, 128, 1);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Cyclic executive TEST**********
+// A 1 kHz control task competes with a 200us disturbance task
+// TT_MODE 0: both are periodic threads, the disturbance on Timer0A at a higher
+//            priority and a period that is not a multiple of the control period
+// TT_MODE 1: both are in a 500us slot table run by OS_TT_Start
+// The report prints the non-empty jitter histogram bins (0.1us) of the control
+// path and, in TT_MODE 1, the overruns of each slot; run once in each mode to compare
+#define TT_MODE    1
+#define TTSLOT     (TIME_1MS/2)
+#define TTRUNMS    5000
+unsigned long ControlCount, DisturbCount;
+void ControlTask(void){
+  ControlCount++;
+}
+void DisturbTask(void){          // about 200us of work
+  // counted loop, OS_Time does not advance while Timer3A is masked by this ISR
+  for(volatile int i = 0; i < 3000; i++){};
+  DisturbCount++;
+}
+const TTSlotType TTTable[4] = {
+  { &ControlTask, TIME_1MS/20 },
+  { &DisturbTask, 0 },           // may use its whole slot
+  { &ControlTask, TIME_1MS/20 },
+  { 0, 0 }
+};
+extern unsigned long jitter1Histogram[JITTERSIZE];
+extern unsigned long jitterTTHistogram[JITTERSIZE];
+void TTReport(void){
+  unsigned long *histogram = TT_MODE ? jitterTTHistogram : jitter1Histogram;
+  OS_Sleep(TTRUNMS);
+  Serial_println("mode %u: control=%u disturb=%u", TT_MODE, ControlCount, DisturbCount);
+  for(int i = 0; i < JITTERSIZE; i++){
+    if(histogram[i]){
+      Serial_println("jitter %u: %u", i, histogram[i]);
+    }
+  }
+  if(TT_MODE){
+    for(int i = 0; i < 4; i++){
+      Serial_println("slot %u overruns: %u", i, OS_TT_Overruns(i));
+    }
+  }
+  OS_Kill();
+}
+int TestmainTT(void){   // TestmainTT
+  OS_Init();           // initialize, disable interrupts
+  ControlCount = DisturbCount = 0;
+  if(TT_MODE){
+    OS_TT_Start(TTTable, 4, TTSLOT, 0);
+  } else{
+    OS_AddPeriodicThread(&ControlTask, TIME_1MS, 1);
+    OS_AddPeriodicThread(&DisturbTask, 1300*TIME_1MS/1000, 0);
+  }
+  OS_AddProcess(&TTReport, 0, 0, 128, 1);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Sporadic server TEST**********
+// Timer1A submits a SRVJOBMS ms aperiodic job every 4ms, 75% of the CPU, to a
+// server at priority 1 with a 2ms budget every 10ms
+// SrvControl is a priority 2 thread that needs 1ms every 5ms; it only misses a
+// deadline if the server takes more than its budget
+// ControlMisses should be zero, the server stats show the budget exhaustions
+#define SRVJOBMS   3
+#define SRVRUNMS   2000
+unsigned long ControlRuns, ControlMisses;
+void SrvJob(void *arg){
+  unsigned long start = OS_Time();
+  while(OS_TimeDifference(start, OS_Time()) < SRVJOBMS*TIME_1MS){};
+}
+void SrvSubmitTask(void){        // runs in Timer1A_Handler
+  OS_Server_Submit(&SrvJob, 0);
+}
+void SrvControl(void){
+  unsigned long start, next;
+  ServerStatsType stats;
+  next = OS_MsTime();
+  while(OS_MsTime() < SRVRUNMS){
+    next += 5;
+    start = OS_Time();
+    while(OS_TimeDifference(start, OS_Time()) < TIME_1MS){};  // control work
+    ControlRuns++;
+    if(OS_MsTime() > next){
+      ControlMisses++;
+      next = OS_MsTime();
+    } else if(OS_MsTime() < next){   // OS_Sleep(0) would never wake
+      OS_Sleep(next - OS_MsTime());
+    }
+  }
+  stats = OS_Server_Stats();
+  Serial_println("control runs=%u misses=%u", ControlRuns, ControlMisses);
+  Serial_println("server jobs=%u rejected=%u exhausted=%u", stats.jobsRun, stats.jobsRejected, stats.exhaustions);
+  Serial_println("server response avg=%u max=%u", stats.jobsRun ? stats.totalResponse/stats.jobsRun : 0, stats.maxResponse);
+  OS_Kill();
+}
+int TestmainServer(void){   // TestmainServer
+  OS_Init();           // initialize, disable interrupts
+  ControlRuns = ControlMisses = 0;
+  OS_Server_Init(2*TIME_1MS, 10, 1, 6);
+  OS_AddPeriodicThread(&SrvSubmitTask, 4*TIME_1MS, 2);
+  OS_AddProcess(&SrvControl, 0, 0, 128, 2);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Worker pool TEST**********
+// Timer1A submits a job every POOLPERIODMS ms, as a button task would; each job
+// sleeps POOLJOBMS ms, which a background task may not do, and that is longer
+// than the period, so only POOLWORKERS workers together keep up
+// Expected: no rejected jobs, and every job picked up has finished except the
+// ones still sleeping when the report is printed
+#define POOLWORKERS  2
+#define POOLPERIODMS 5
+#define POOLJOBMS    8
+#define POOLRUNMS    2000
+unsigned long PoolDone;          // jobs that returned
+void PoolJob(void *arg){
+  OS_Sleep(POOLJOBMS);
+  unsigned long sr = StartCritical();  // both workers count
+  PoolDone++;
+  EndCritical(sr);
+}
+void PoolSubmitTask(void){       // runs in Timer1A_Handler
+  OS_Pool_Submit(&PoolJob, 0);
+}
+void PoolReport(void){
+  PoolStatsType stats;
+  OS_Sleep(POOLRUNMS);
+  stats = OS_Pool_Stats();
+  Serial_println("pool jobs=%u done=%u rejected=%u", stats.jobsRun, PoolDone, stats.jobsRejected);
+  Serial_println("pool wait avg=%u max=%u", stats.jobsRun ? stats.totalWait/stats.jobsRun : 0, stats.maxWait);
+  if(stats.jobsRejected || PoolDone + POOLWORKERS < stats.jobsRun){
+    Serial_println("pool FAIL: workers fell behind");
+  }
+  OS_Kill();
+}
+int TestmainPool(void){   // TestmainPool
+  OS_Init();           // initialize, disable interrupts
+  PoolDone = 0;
+  OS_Pool_Init(POOLWORKERS, 1);
+  OS_AddPeriodicThread(&PoolSubmitTask, POOLPERIODMS*TIME_1MS, 2);
+  OS_AddProcess(&PoolReport, 0, 0, 128, 0);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Mailbox TEST**********
+// MBOXSENDERS threads and a periodic task send multi-word messages through one
+// mailbox of MBOXSLOTS slots to a lower priority receiver, so the box fills up:
+// the threads block in OS_MBox_Send and the task counts the times
+// OS_MBox_TrySend found the box full
+// The receiver checks that the messages of every sender arrive whole and in
+// order; a mailbox with messages over MBOX_MAXSIZE bytes must be refused
+// Expected: errors=0 and received equal to sent
+#define MBOXSENDERS 2
+#define MBOXSLOTS   4
+#define MBOXRATE    (TIME_1MS/2)     // 2 kHz background sender
+#define MBOXRUNMS   1000
+#define MBOXWORK    400              // bus cycles the receiver spends on a message
+typedef struct{
+  uint32_t sender;
+  uint32_t seq;
+  uint32_t check;                    // sender^~seq, catches a half copied slot
+} MBoxMsgType;
+MBoxType MBox;
+MBoxMsgType MBoxBuf[MBOXSLOTS];
+unsigned long MBoxSent[MBOXSENDERS+1];  // the last one is the periodic task
+unsigned long MBoxNext[MBOXSENDERS+1];  // next seq the receiver expects
+unsigned long MBoxRecv;              // messages received
+unsigned long MBoxErrors;            // torn or out of order messages
+unsigned long MBoxFull;              // OS_MBox_TrySend calls that found the box full
+int MBoxDone;                        // senders stop
+
+static void mboxMake(MBoxMsgType *msg, uint32_t sender){
+  msg->sender = sender;
+  msg->seq = MBoxSent[sender];
+  msg->check = sender ^ ~msg->seq;
+}
+static void mboxSender(uint32_t sender){
+  MBoxMsgType msg;
+  while(!MBoxDone){
+    mboxMake(&msg, sender);
+    OS_MBox_Send(&MBox, &msg);
+    MBoxSent[sender]++;
+  }
+  OS_Kill();
+}
+void MBoxSender0(void){
+  mboxSender(0);
+}
+void MBoxSender1(void){
+  mboxSender(1);
+}
+void MBoxSendTask(void){             // runs in Timer1A_Handler
+  MBoxMsgType msg;
+  if(MBoxDone){
+    return;
+  }
+  mboxMake(&msg, MBOXSENDERS);
+  if(OS_MBox_TrySend(&MBox, &msg)){
+    MBoxSent[MBOXSENDERS]++;
+  } else{
+    MBoxFull++;
+  }
+}
+void MBoxReceiver(void){
+  MBoxMsgType msg;
+  while(1){
+    OS_MBox_Recv(&MBox, &msg);
+    if(msg.sender > MBOXSENDERS || msg.check != (msg.sender ^ ~msg.seq) ||
+       msg.seq != MBoxNext[msg.sender]){
+      MBoxErrors++;
+    } else{
+      MBoxNext[msg.sender]++;
+    }
+    MBoxRecv++;
+#ifdef HOST
+    Host_Consume(MBOXWORK);          // moves virtual time, -v would stop here
+#endif
+  }
+}
+void MBoxReport(void){
+  MBoxType tooBig;
+  unsigned long sent = 0;
+  if(OS_MBox_Init(&tooBig, MBoxBuf, MBOX_MAXSIZE+1, 1)){
+    MBoxErrors++;
+  }
+  OS_Sleep(MBOXRUNMS);
+  MBoxDone = 1;
+  OS_Sleep(10);                      // the receiver empties the box
+  for(int i = 0; i <= MBOXSENDERS; i++){
+    sent += MBoxSent[i];
+  }
+  Serial_println("mbox sent=%u received=%u full=%u errors=%u", sent, MBoxRecv, MBoxFull, MBoxErrors);
+  if(MBoxErrors || sent != MBoxRecv){
+    Serial_println("mbox FAIL");
+  }
+  OS_Kill();
+}
+int TestmainMBox(void){   // TestmainMBox
+  OS_Init();           // initialize, disable interrupts
+  for(int i = 0; i <= MBOXSENDERS; i++){
+    MBoxSent[i] = MBoxNext[i] = 0;
+  }
+  MBoxRecv = MBoxErrors = MBoxFull = 0;
+  MBoxDone = 0;
+  OS_MBox_Init(&MBox, MBoxBuf, sizeof(MBoxMsgType), MBOXSLOTS);
+  OS_AddPeriodicThread(&MBoxSendTask, MBOXRATE, 1);
+  OS_AddProcess(&MBoxReport, 0, 0, 128, 0);
+  OS_AddProcess(&MBoxSender0, 0, 0, 128, 2);
+  OS_AddProcess(&MBoxSender1, 0, 0, 128, 2);
+  OS_AddProcess(&MBoxReceiver, 0, 0, 128, 3);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+
+//*******************Kernel benchmark suite**********
+// Measures the kernel primitives with 0, 4 and 8 extra threads in the system
+// and prints one machine-readable line per result:
+//   BENCH,<name>,<extra threads>,<value>,<unit>
+// so runs before and after a change to OS.c can be compared with diff or a
+// spreadsheet. The extra threads are ready at priority 5 and only run while the
+// benchmark threads (priority 2) are all blocked or asleep; they make the
+// scheduler scan longer. Cycles are 12.5ns bus cycles.
+#define BENCHRUNS     1000
+#define BENCHFIFORUNS 2000
+#define BENCHFILLERS  8
+const int BenchThreadCounts[] = {0, 4, 8};
+volatile int BenchFillerStop, BenchPartnerStop;
+Sema4Type BenchPing, BenchPong;
+unsigned long BenchMboxTotal, BenchMboxMax;
+extern unsigned long maxJitter1;
+
+void BenchReport(const char *name, int threads, unsigned long value, const char *unit){
+  Serial_println("BENCH,%s,%u,%u,%s", name, threads, value, unit);
+}
+void BenchFiller(void){
+  while(!BenchFillerStop){};
+  OS_Exit(0);
+}
+void BenchPeriodic(void){        // runs in Timer1A_Handler, only its jitter matters
+}
+void BenchYieldPartner(void){
+  while(!BenchPartnerStop){
+    OS_Suspend();
+  }
+  OS_Exit(0);
+}
+void BenchPingPartner(void){
+  for(int i = 0; i < BENCHRUNS; i++){
+    OS_Wait(&BenchPing);
+    OS_Signal(&BenchPong);
+  }
+  OS_Exit(0);
+}
+void BenchFifoConsumer(void){
+  unsigned long buf[8];
+  unsigned long got = 0;
+  while(got < BENCHFIFORUNS){
+    got += OS_Fifo_GetN(buf, 8);
+  }
+  OS_Exit(0);
+}
+void BenchMboxReceiver(void){
+  for(int i = 0; i < BENCHRUNS; i++){
+    unsigned long sent = OS_MailBox_Recv();   // before OS_Time, argument order is unspecified
+    unsigned long latency = OS_TimeDifference(sent, OS_Time());
+    BenchMboxTotal += latency;
+    if(latency > BenchMboxMax){
+      BenchMboxMax = latency;
+    }
+  }
+  OS_Exit(0);
+}
+// run a partner at the benchmark priority, returns its thread ID for BenchJoin
+int BenchStart(void(*task)(void)){
+  return OS_AddJoinableThread(task, 128, 2);
+}
+void BenchJoin(int tid){
+  int code;
+  if(tid >= 0){
+    OS_Join(tid, &code);
+  }
+}
+
+void BenchSuite(void){
+  int fillers[BENCHFILLERS];
+  unsigned long start, elapsed;
+  int tid;
+  OS_AddPeriodicThread(&BenchPeriodic, TIME_1MS, 0);
+  for(int t = 0; t < sizeof(BenchThreadCounts)/sizeof(BenchThreadCounts[0]); t++){
+    int n = BenchThreadCounts[t];
+    BenchFillerStop = 0;
+    for(int i = 0; i < n; i++){
+      fillers[i] = OS_AddJoinableThread(&BenchFiller, 128, 5);
+    }
+    maxJitter1 = 0;
+    Bench_Reset();
+
+    // yield to nobody: OS_Suspend with no other ready thread at this priority
+    start = OS_Time();
+    for(int i = 0; i < BENCHRUNS; i++){
+      OS_Suspend();
+    }
+    BenchReport("yield", n, OS_TimeDifference(start, OS_Time())/BENCHRUNS, "cycles");
+
+    // context switch: two threads at the same priority yielding to each other
+    BenchPartnerStop = 0;
+    tid = BenchStart(&BenchYieldPartner);
+    OS_Suspend();                // let the partner reach its loop
+    start = OS_Time();
+    for(int i = 0; i < BENCHRUNS; i++){
+      OS_Suspend();
+    }
+    elapsed = OS_TimeDifference(start, OS_Time());
+    BenchPartnerStop = 1;
+    BenchJoin(tid);
+    BenchReport("switch", n, elapsed/(2*BENCHRUNS), "cycles");
+
+    // semaphore ping-pong between two threads
+    OS_InitSemaphore(&BenchPing, 0);
+    OS_InitSemaphore(&BenchPong, 0);
+    tid = BenchStart(&BenchPingPartner);
+    start = OS_Time();
+    for(int i = 0; i < BENCHRUNS; i++){
+      OS_Signal(&BenchPing);
+      OS_Wait(&BenchPong);
+    }
+    elapsed = OS_TimeDifference(start, OS_Time());
+    BenchJoin(tid);
+    BenchReport("sema_roundtrip", n, elapsed/BENCHRUNS, "cycles");
+    BenchReport("sema_rate", n, 80000000/(elapsed/BENCHRUNS), "per_s");
+
+    // FIFO throughput, thread producer and batched consumer
+    OS_Fifo_Init(0);
+    OS_Fifo_SetWatermark(8);
+    tid = BenchStart(&BenchFifoConsumer);
+    start = OS_Time();
+    for(unsigned long sent = 0; sent < BENCHFIFORUNS; ){
+      if(OS_Fifo_Put(sent)){
+        sent++;
+      } else{
+        OS_Suspend();            // full, let the consumer drain it
+      }
+    }
+    BenchJoin(tid);
+    elapsed = OS_TimeDifference(start, OS_Time())/80;   // us
+    BenchReport("fifo_throughput", n, BENCHFIFORUNS*1000000/elapsed, "per_s");
+
+    // mailbox latency, send to the receiver waking up
+    OS_MailBox_Init();
+    BenchMboxTotal = BenchMboxMax = 0;
+    tid = BenchStart(&BenchMboxReceiver);
+    for(int i = 0; i < BENCHRUNS; i++){
+      OS_MailBox_Send(OS_Time());
+      OS_Suspend();              // a send only readies the receiver
+    }
+    BenchJoin(tid);
+    BenchReport("mbox_latency_avg", n, BenchMboxTotal/BENCHRUNS, "cycles");
+    BenchReport("mbox_latency_max", n, BenchMboxMax, "cycles");
+
+    // sleep accuracy, time actually spent in OS_Sleep
+    for(unsigned long ms = 1; ms <= 10; ms *= 10){
+      unsigned long total = 0;
+      for(int i = 0; i < 10; i++){
+        start = OS_Time();
+        OS_Sleep(ms);
+        total += OS_TimeDifference(start, OS_Time())/80;
+      }
+      BenchReport(ms == 1 ? "sleep_1ms" : "sleep_10ms", n, total/10, "us");
+    }
+
+    // scheduler decision time from the cycle counter sites
+    BenchStatsType sched = Bench_Get(BENCH_SWITCH);
+    BenchReport("sched_avg", n, sched.count ? sched.total/sched.count : 0, "cycles");
+    BenchReport("sched_max", n, sched.max, "cycles");
+
+    // periodic jitter over everything above
+    BenchReport("periodic_jitter", n, maxJitter1, "0.1us");
+
+    BenchFillerStop = 1;
+    for(int i = 0; i < n; i++){
+      BenchJoin(fillers[i]);
+    }
+  }
+  Serial_println("BENCH,done");
+  OS_Kill();
+}
+int TestmainBench(void){   // TestmainBench
+  OS_Init();           // initialize, disable interrupts
+  OS_AddProcess(&BenchSuite, 0, 0, 128, 2);
+  OS_AddProcess(&IdleTask, 0, 0, 128, 7);
+  OS_Launch(TIME_2MS); // doesn't return, interrupts enabled in here
+  return 0;            // this never executes
+}
+#endif
@@ -0,0 +1,96 @@
+// filename *************************profile.c ************************
+// Statistical PC-sampling profiler, see profile.h
+
+#include <stdint.h>
+#include "tm4c123gh6pm.h"
+#include "profile.h"
+#include "OS.h"
+#include "Serial.h"
+
+extern char _text, _etext;    // kernel code, from the linker script
+extern pcbType *pcbPt;        // current running process
+
+static uint16_t kernelBins[PROF_BINS];
+static uint16_t procBins[PROF_PROC_BINS];
+static unsigned long kernelShift;    // kernel bin size is 2^kernelShift bytes
+static int procPid;                  // process in procBins, -1 if none yet
+static uint32_t procText;
+static unsigned long samples;
+static unsigned long others;
+
+void Profile_Start(unsigned long period, unsigned long priority) {
+	unsigned long sr = StartCritical();
+	uint32_t size = &_etext - &_text;
+	kernelShift = 0;
+	while ((size >> kernelShift) >= PROF_BINS) {
+		kernelShift++;
+	}
+	for (int i = 0; i < PROF_BINS; i++) {
+		kernelBins[i] = 0;
+	}
+	for (int i = 0; i < PROF_PROC_BINS; i++) {
+		procBins[i] = 0;
+	}
+	procPid = -1;
+	samples = others = 0;
+	SYSCTL_RCGCTIMER_R |= 0x10;   // 0) activate TIMER4
+	TIMER4_CTL_R = 0x00000000;    // 1) disable TIMER4A during setup
+	TIMER4_CFG_R = 0x00000000;    // 2) configure for 32-bit mode
+	TIMER4_TAMR_R = 0x00000002;   // 3) configure for periodic mode, default down-count settings
+	TIMER4_TAILR_R = period-1;    // 4) reload value
+	TIMER4_TAPR_R = 0;            // 5) bus clock resolution
+	TIMER4_ICR_R = 0x00000001;    // 6) clear TIMER4A timeout flag
+	TIMER4_IMR_R = 0x00000001;    // 7) arm timeout interrupt
+	NVIC_PRI17_R = (NVIC_PRI17_R&0xFF00FFFF)| ((priority & 0x07) << 21); // 8) priority bit 23-21
+	// vector number 86, interrupt number 70
+	NVIC_EN2_R = 1<<(70-64);      // 9) enable IRQ 70 in NVIC
+	TIMER4_CTL_R = 0x00000001;    // 10) enable TIMER4A
+	EndCritical(sr);
+}
+
+void Profile_Stop(void) {
+	TIMER4_CTL_R = 0x00000000;    // disable TIMER4A
+	NVIC_DIS2_R = 1<<(70-64);     // disable IRQ 70 in NVIC
+}
+
+void Profile_Sample(uint32_t pc) {
+	TIMER4_ICR_R = TIMER_ICR_TATOCINT;  // acknowledge
+	samples++;
+	pc &= ~1;
+	if (pc >= (uint32_t)&_text && pc < (uint32_t)&_etext) {
+		uint16_t *bin = &kernelBins[(pc - (uint32_t)&_text) >> kernelShift];
+		if (*bin != 0xFFFF)
+			(*bin)++;
+		return;
+	}
+	// loaded ELF process, binned from its text base
+	if (pcbPt && pcbPt->loaded) {   // other processes have a wordPool placeholder
+		if (procPid < 0) {
+			procPid = pcbPt->pid;
+			procText = (uint32_t)pcbPt->text;
+		}
+		uint32_t offset = pc - procText;
+		if (pcbPt->pid == procPid && offset < (PROF_PROC_BINS << PROF_PROC_SHIFT)) {
+			uint16_t *bin = &procBins[offset >> PROF_PROC_SHIFT];
+			if (*bin != 0xFFFF)
+				(*bin)++;
+			return;
+		}
+	}
+	others++;
+}
+
+void Profile_Dump(void) {
+	Serial_printf("prof %x %x %x\n\r", samples, (uint32_t)&_text, kernelShift);
+	for (int i = 0; i < PROF_BINS; i++) {
+		if (kernelBins[i]) {
+			Serial_printf("K %x %x\n\r", (uint32_t)&_text + (i << kernelShift), kernelBins[i]);
+		}
+	}
+	for (int i = 0; i < PROF_PROC_BINS; i++) {
+		if (procBins[i]) {
+			Serial_printf("P %x %x %x %x\n\r", procPid, procText, i << PROF_PROC_SHIFT, procBins[i]);
+		}
+	}
+	Serial_printf("X %x\n\r", others);
+}
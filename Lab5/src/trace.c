@@ -0,0 +1,49 @@
+// filename *************************trace.c ************************
+// Kernel event trace ring, see trace.h
+
+#include <stdint.h>
+#include "trace.h"
+#include "OS.h"
+
+
+static TraceRecordType traceRing[TRACE_SIZE];
+static unsigned long tracePutI;       // free-running, next record to write
+static unsigned long traceLast;       // timestamp of the last record
+static int traceStopped;
+
+void Trace_Event(uint8_t event, uint8_t id) {
+	unsigned long sr = StartCritical();
+	if (!traceStopped) {
+		// OS_Time wraps at 2^32 cycles, so timestamps wrap at 2^(32-TRACE_SHIFT)
+		unsigned long now = OS_Time() >> TRACE_SHIFT;
+		unsigned long delta = (now - traceLast) & (0xFFFFFFFF >> TRACE_SHIFT);
+		traceLast = now;
+		if (delta > 0xFFFF) {
+			TraceRecordType *r = &traceRing[tracePutI++ & (TRACE_SIZE - 1)];
+			r->event = TRACE_TIME;
+			r->id = 0;
+			r->delta = delta >> 16;
+		}
+		TraceRecordType *r = &traceRing[tracePutI++ & (TRACE_SIZE - 1)];
+		r->event = event;
+		r->id = id;
+		r->delta = delta;
+	}
+	EndCritical(sr);
+}
+
+void Trace_Stop(void) {
+	traceStopped = 1;
+}
+
+void Trace_Start(void) {
+	traceStopped = 0;   // the next delta covers the stopped time too
+}
+
+unsigned long Trace_Count(void) {
+	return tracePutI < TRACE_SIZE ? tracePutI : TRACE_SIZE;
+}
+
+TraceRecordType Trace_Get(unsigned long i) {
+	return traceRing[(tracePutI - Trace_Count() + i) & (TRACE_SIZE - 1)];
+}
@@ -0,0 +1,150 @@
+// filename *************************profdecode.c ************************
+// Host side decoder for the PC-sampling profiler, see Lab5/inc/profile.h
+// Maps the bins of a "prof dump" (captured from the terminal) to functions and
+// prints them by sample count. Symbols are read from either the GNU ld map file
+// (-Map) or "arm-none-eabi-nm -n" output of the kernel; a second symbol file
+// can be given for the loaded ELF process, with addresses relative to its text.
+// A bin is charged to the function containing its start address, so functions
+// smaller than a bin share it with their neighbours.
+// Build and run on the host:
+//   gcc -std=c99 -o profdecode profdecode.c
+//   ./profdecode prof.txt Lab5.map [process.nm]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXSYMS 8192
+
+typedef struct {
+	unsigned long addr;
+	char name[64];
+	unsigned long count;
+} Symbol;
+
+typedef struct {
+	Symbol syms[MAXSYMS];
+	int n;
+} SymTable;
+
+static SymTable kernel, process;
+
+static int byAddr(const void *a, const void *b) {
+	unsigned long x = ((const Symbol *)a)->addr, y = ((const Symbol *)b)->addr;
+	return x < y ? -1 : x > y;
+}
+
+static int byCount(const void *a, const void *b) {
+	unsigned long x = ((const Symbol *)a)->count, y = ((const Symbol *)b)->count;
+	return x > y ? -1 : x < y;
+}
+
+// accepts "addr name" (ld map symbol lines) and "addr type name" (nm)
+static int readSymbols(const char *path, SymTable *t) {
+	char line[256], a[64], b[128], c[128];
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (t->n < MAXSYMS && fgets(line, sizeof(line), f)) {
+		int k = sscanf(line, "%63s %127s %127s", a, b, c);
+		char *name;
+		char *end;
+		unsigned long addr = strtoul(a, &end, 16);
+		if (k < 2 || *end != '\0' || addr == 0)
+			continue;
+		if (k == 3 && strlen(b) == 1) {
+			if (strchr("tTwW", b[0]) == NULL)
+				continue;      // nm, code symbols only
+			name = c;
+		} else if (k == 2) {
+			name = b;          // map file symbol line
+		} else {
+			continue;
+		}
+		t->syms[t->n].addr = addr;
+		size_t len = strlen(name);
+		if (len >= sizeof(t->syms[t->n].name))
+			len = sizeof(t->syms[t->n].name) - 1;   // long names are cut
+		memcpy(t->syms[t->n].name, name, len);
+		t->syms[t->n].name[len] = '\0';
+		t->syms[t->n].count = 0;
+		t->n++;
+	}
+	fclose(f);
+	qsort(t->syms, t->n, sizeof(Symbol), byAddr);
+	return 0;
+}
+
+// charge count to the function containing addr
+static int charge(SymTable *t, unsigned long addr, unsigned long count) {
+	int lo = 0, hi = t->n - 1, found = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (t->syms[mid].addr <= addr) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (found < 0)
+		return 0;
+	t->syms[found].count += count;
+	return 1;
+}
+
+static void report(SymTable *t, const char *title, unsigned long samples) {
+	qsort(t->syms, t->n, sizeof(Symbol), byCount);
+	printf("%s\n", title);
+	for (int i = 0; i < t->n && t->syms[i].count; i++) {
+		printf("%8lu %5.1f%%  %s\n", t->syms[i].count,
+				100.0 * t->syms[i].count / samples, t->syms[i].name);
+	}
+}
+
+int main(int argc, char **argv) {
+	char line[256];
+	unsigned long samples = 0, base, shift, addr, count, pid, text, offset;
+	unsigned long unknown = 0, others = 0;
+	FILE *f;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <prof dump> <kernel map or nm> [process nm]\n", argv[0]);
+		return 1;
+	}
+	if (readSymbols(argv[2], &kernel) || (argc > 3 && readSymbols(argv[3], &process)))
+		return 1;
+	f = fopen(argv[1], "r");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "prof %lx %lx %lx", &samples, &base, &shift) == 3) {
+			continue;
+		} else if (sscanf(line, "K %lx %lx", &addr, &count) == 2) {
+			if (!charge(&kernel, addr, count))
+				unknown += count;
+		} else if (sscanf(line, "P %lx %lx %lx %lx", &pid, &text, &offset, &count) == 4) {
+			if (process.n == 0 || !charge(&process, offset, count))
+				unknown += count;
+		} else if (sscanf(line, "X %lx", &count) == 1) {
+			others = count;
+		}
+	}
+	fclose(f);
+	if (samples == 0) {
+		fprintf(stderr, "%s: no \"prof\" header found\n", argv[1]);
+		return 1;
+	}
+
+	printf("%lu samples\n", samples);
+	report(&kernel, "kernel:", samples);
+	if (process.n)
+		report(&process, "process:", samples);
+	printf("%8lu %5.1f%%  (no symbol)\n", unknown, 100.0 * unknown / samples);
+	printf("%8lu %5.1f%%  (outside profiled code)\n", others, 100.0 * others / samples);
+	return 0;
+}
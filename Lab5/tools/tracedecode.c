@@ -0,0 +1,144 @@
+// filename *************************tracedecode.c ************************
+// Host side decoder for the kernel event trace, see Lab5/inc/trace.h
+// Reads either the text dump of the interpreter "trace" command (captured
+// from the terminal) or the binary file written by "trace <file>", and prints
+// one line per event with its absolute time, followed by the CPU time each
+// thread and handler used between the first and last record.
+// Build and run on the host:
+//   gcc -std=c99 -I../inc -o tracedecode tracedecode.c
+//   ./tracedecode trace.txt
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "trace.h"
+
+#define CYCLE_NS  12.5                           // 80 MHz bus clock
+#define UNIT_US   ((1 << TRACE_SHIFT) * CYCLE_NS / 1000.0)
+#define MAXRECORDS 65536
+#define MAXNEST   8                              // nested handlers tracked
+#define MAXCTX    256
+
+static const char *names[TRACE_EVENTNUM] = {
+	"time", "switch", "isr enter", "isr exit", "sem block", "sem wake",
+	"fifo put", "fifo get", "malloc", "free", "user"
+};
+
+static TraceRecordType records[MAXRECORDS];
+
+// binary file: "TRC1" followed by 4-byte records, little endian
+static long readBinary(FILE *f) {
+	long n = 0;
+	uint8_t b[4];
+	while (n < MAXRECORDS && fread(b, 1, 4, f) == 4) {
+		records[n].event = b[0];
+		records[n].id = b[1];
+		records[n].delta = b[2] | (b[3] << 8);
+		n++;
+	}
+	return n;
+}
+
+// text dump: a "trace <count>" line, then "event id delta" in hex
+static long readText(FILE *f) {
+	char line[128];
+	unsigned event, id, delta;
+	long n = 0;
+	int started = 0;
+	while (n < MAXRECORDS && fgets(line, sizeof(line), f)) {
+		if (!started) {
+			started = strncmp(line, "trace ", 6) == 0;
+			continue;
+		}
+		if (sscanf(line, "%x %x %x", &event, &id, &delta) != 3)
+			break;    // end of the dump
+		records[n].event = event;
+		records[n].id = id;
+		records[n].delta = delta;
+		n++;
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	FILE *f;
+	char magic[4];
+	long n;
+	double now = 0, last = 0;
+	double threadTime[MAXCTX] = {0}, isrTime[MAXCTX] = {0};
+	int nest[MAXNEST], depth = 0;
+	int thread = -1;                 // unknown until the first switch
+	unsigned long high = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace dump or file>\n", argv[0]);
+		return 1;
+	}
+	f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(magic, 1, 4, f) == 4 && memcmp(magic, "TRC1", 4) == 0) {
+		n = readBinary(f);
+	} else {
+		rewind(f);
+		n = readText(f);
+	}
+	fclose(f);
+
+	printf("%12s  %-8s %-10s %s\n", "time (us)", "context", "event", "id");
+	for (long i = 0; i < n; i++) {
+		TraceRecordType *r = &records[i];
+		if (r->event == TRACE_TIME) {
+			high = (unsigned long)r->delta << 16;
+			continue;
+		}
+		// the first record's delta is relative to a record that was overwritten
+		if (i > 0)
+			now += (high + r->delta) * UNIT_US;
+		high = 0;
+
+		// charge the time since the last record to whoever was running
+		if (depth)
+			isrTime[nest[depth - 1]] += now - last;
+		else if (thread >= 0)
+			threadTime[thread] += now - last;
+		last = now;
+
+		char ctx[24];
+		if (depth)
+			snprintf(ctx, sizeof(ctx), "isr %d", nest[depth - 1]);
+		else if (thread >= 0)
+			snprintf(ctx, sizeof(ctx), "thread %d", thread);
+		else
+			snprintf(ctx, sizeof(ctx), "?");
+		printf("%12.1f  %-8s %-10s %u\n", now, ctx,
+				r->event < TRACE_EVENTNUM ? names[r->event] : "bad", r->id);
+
+		switch (r->event) {
+		case TRACE_SWITCH:
+			thread = r->id;
+			break;
+		case TRACE_ISR_ENTER:
+			if (depth < MAXNEST)
+				nest[depth++] = r->id;
+			break;
+		case TRACE_ISR_EXIT:
+			if (depth)
+				depth--;
+			break;
+		}
+	}
+
+	printf("\nCPU time over %.1f us\n", now);
+	for (int i = 0; i < MAXCTX; i++) {
+		if (threadTime[i] > 0)
+			printf("thread %3d  %10.1f us  %5.1f%%\n", i, threadTime[i], 100 * threadTime[i] / now);
+	}
+	for (int i = 0; i < MAXCTX; i++) {
+		if (isrTime[i] > 0)
+			printf("isr %6d  %10.1f us  %5.1f%%\n", i, isrTime[i], 100 * isrTime[i] / now);
+	}
+	return 0;
+}